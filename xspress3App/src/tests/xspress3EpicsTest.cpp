@@ -3,8 +3,13 @@
 #include <boost/test/unit_test.hpp>
 
 #include <stdio.h>
+#include <math.h>
+#include <vector>
 #include "xspress3Epics.h"
 #include "xspress3.h"
+#include "xsp3Simulator.h"
+#include "asynGenericPointer.h"
+#include "epicsStdio.h"
 
 #define MAX_SPECTRA 4096
 #define NUM_CHANNELS 10
@@ -56,6 +61,120 @@ BOOST_AUTO_TEST_CASE(createMCAArrayFloat64)
     BOOST_CHECK(xsp.createMCAArray(dims, pMCA, NDFloat64) == false);
 }
 
+BOOST_AUTO_TEST_CASE(createMCAArrayUInt16)
+{
+    size_t dims[2] = {MAX_SPECTRA, NUM_CHANNELS};
+    NDArray *pMCA;
+    NDArrayInfo_t info;
+    BOOST_CHECK(xsp.createMCAArray(dims, pMCA, NDUInt16) == false);
+    BOOST_CHECK_EQUAL(pMCA->dataType, NDUInt16);
+    BOOST_CHECK_EQUAL(pMCA->dims[0].size, dims[0]);
+    BOOST_CHECK_EQUAL(pMCA->dims[1].size, dims[1]);
+    pMCA->getInfo(&info);
+    BOOST_CHECK_EQUAL(info.bytesPerElement, 2);
+    BOOST_CHECK_EQUAL(info.totalBytes, MAX_SPECTRA * NUM_CHANNELS * sizeof(epicsUInt16));
+    pMCA->release();
+}
+
+BOOST_AUTO_TEST_CASE(createMCAArrayFloat32)
+{
+    size_t dims[2] = {MAX_SPECTRA, NUM_CHANNELS};
+    NDArray *pMCA;
+    NDArrayInfo_t info;
+    BOOST_CHECK(xsp.createMCAArray(dims, pMCA, NDFloat32) == false);
+    BOOST_CHECK_EQUAL(pMCA->dataType, NDFloat32);
+    BOOST_CHECK_EQUAL(pMCA->dims[0].size, dims[0]);
+    BOOST_CHECK_EQUAL(pMCA->dims[1].size, dims[1]);
+    pMCA->getInfo(&info);
+    BOOST_CHECK_EQUAL(info.bytesPerElement, 4);
+    BOOST_CHECK_EQUAL(info.totalBytes, MAX_SPECTRA * NUM_CHANNELS * sizeof(epicsFloat32));
+    pMCA->release();
+}
+
+BOOST_AUTO_TEST_CASE(saturate)
+{
+    u_int32_t raw[5] = {0, 1, 65535, 65536, 0xFFFFFFFF};
+    epicsUInt16 compact[5];
+    BOOST_CHECK_EQUAL(xsp3Spectrum::saturate(raw, 5, compact), 2);
+    BOOST_CHECK_EQUAL(compact[0], 0);
+    BOOST_CHECK_EQUAL(compact[1], 1);
+    BOOST_CHECK_EQUAL(compact[2], 65535);
+    BOOST_CHECK_EQUAL(compact[3], 65535);
+    BOOST_CHECK_EQUAL(compact[4], 65535);
+}
+
+BOOST_AUTO_TEST_CASE(rebin)
+{
+    u_int32_t spectra[12];
+    double dSpectra[12];
+    for (int i=0; i<12; i++) {
+        spectra[i] = i;
+        dSpectra[i] = i;
+    }
+    // A factor of 1 leaves the spectra as they are
+    xsp3Spectrum::rebin(spectra, 12, 1);
+    for (int i=0; i<12; i++)
+        BOOST_CHECK_EQUAL(spectra[i], i);
+    xsp3Spectrum::rebin(spectra, 6, 2);
+    for (int i=0; i<6; i++)
+        BOOST_CHECK_EQUAL(spectra[i], 4*i + 1);
+    xsp3Spectrum::rebin(spectra, 2, 3);
+    BOOST_CHECK_EQUAL(spectra[0], 1 + 5 + 9);
+    BOOST_CHECK_EQUAL(spectra[1], 13 + 17 + 21);
+    xsp3Spectrum::rebin(dSpectra, 4, 3);
+    for (int i=0; i<4; i++)
+        BOOST_CHECK_EQUAL(dSpectra[i], 9*i + 3);
+}
+
+BOOST_AUTO_TEST_CASE(rebinSaturate)
+{
+    // Bins that each fit in 16 bits can overflow once they are summed
+    u_int32_t raw[6] = {40000, 40000, 30000, 35535, 1, 2};
+    epicsUInt16 compact[3];
+    xsp3Spectrum::rebin(raw, 3, 2);
+    BOOST_CHECK_EQUAL(xsp3Spectrum::saturate(raw, 3, compact), 1);
+    BOOST_CHECK_EQUAL(compact[0], 65535);
+    BOOST_CHECK_EQUAL(compact[1], 65535);
+    BOOST_CHECK_EQUAL(compact[2], 3);
+}
+
+BOOST_AUTO_TEST_CASE(energyWindow)
+{
+    int startParam, binsParam, rebinParam;
+    int firstBin, numBins, rebin;
+    size_t dims[2];
+    xsp.findParam(xsp3EnergyStartParamString, &startParam);
+    xsp.findParam(xsp3EnergyBinsParamString, &binsParam);
+    xsp.findParam(xsp3RebinParamString, &rebinParam);
+    BOOST_CHECK(!xsp.getEnergyWindow(firstBin, numBins, rebin));
+    BOOST_CHECK_EQUAL(numBins, MAX_SPECTRA);
+    // 102 bins do not divide by 4, so the last 2 bins are dropped
+    xsp.setIntegerParam(startParam, 10);
+    xsp.setIntegerParam(binsParam, 102);
+    xsp.setIntegerParam(rebinParam, 4);
+    BOOST_CHECK(xsp.getEnergyWindow(firstBin, numBins, rebin));
+    BOOST_CHECK_EQUAL(firstBin, 10);
+    BOOST_CHECK_EQUAL(numBins, 100);
+    BOOST_CHECK_EQUAL(rebin, 4);
+    xsp.getDims(dims);
+    BOOST_CHECK_EQUAL(dims[0], 25);
+    // A window past the end of the spectrum is clipped to it, and the
+    // rebin factor is cut to the largest power of 2 that fits in it
+    xsp.setIntegerParam(startParam, MAX_SPECTRA - 5);
+    xsp.setIntegerParam(rebinParam, 8);
+    xsp.getEnergyWindow(firstBin, numBins, rebin);
+    BOOST_CHECK_EQUAL(numBins, 4);
+    BOOST_CHECK_EQUAL(rebin, 4);
+    xsp.setIntegerParam(startParam, MAX_SPECTRA - 6);
+    xsp.setIntegerParam(rebinParam, 64);
+    xsp.getEnergyWindow(firstBin, numBins, rebin);
+    BOOST_CHECK_EQUAL(numBins, 4);
+    BOOST_CHECK_EQUAL(rebin, 4);
+    xsp.setIntegerParam(startParam, 0);
+    xsp.setIntegerParam(binsParam, 0);
+    xsp.setIntegerParam(rebinParam, 1);
+}
+
 BOOST_AUTO_TEST_CASE(readFrameDouble)
 {
     size_t dims[2] = {MAX_SPECTRA, NUM_CHANNELS};
@@ -69,8 +188,459 @@ BOOST_AUTO_TEST_CASE(readFrameDouble)
 
 BOOST_AUTO_TEST_CASE(readFrameUInt)
 {
-    u_int32_t SCA[XSP3_SW_NUM_SCALERS], MCAData[MAX_SPECTRA * NUM_CHANNELS];
+    u_int32_t SCA[XSP3_SW_NUM_SCALERS * NUM_CHANNELS], MCAData[MAX_SPECTRA * NUM_CHANNELS];
+    BOOST_CHECK(xsp.readFrame(&SCA[0], &MCAData[0], 1, MAX_SPECTRA) == false);
+}
+
+BOOST_AUTO_TEST_CASE(readFramesBatch)
+{
+    const int numFrames = 4;
+    size_t dims[2] = {MAX_SPECTRA, NUM_CHANNELS};
+    void *pSCABatch = NULL, *pMCABatch = NULL;
+    BOOST_CHECK(xsp.createBatchArrays(pSCABatch, pMCABatch, numFrames, dims) == false);
+    BOOST_CHECK(xsp.readFrames(static_cast<double*>(pSCABatch), static_cast<double*>(pMCABatch), 1, numFrames, 0, MAX_SPECTRA) == false);
+    // Each frame in the batch must match a single frame read of the same frame
+    double *pMCAData = (double*)malloc(MAX_SPECTRA * NUM_CHANNELS * 8);
+    double *pSCA = (double*)malloc(XSP3_SW_NUM_SCALERS * NUM_CHANNELS * 8);
+    BOOST_CHECK(xsp.readFrame(pSCA, pMCAData, 3, MAX_SPECTRA) == false);
+    BOOST_CHECK(memcmp(pMCAData, static_cast<double*>(pMCABatch) + 2 * MAX_SPECTRA * NUM_CHANNELS, MAX_SPECTRA * NUM_CHANNELS * 8) == 0);
+    free(pSCA);
+    free(pMCAData);
+    free(pSCABatch);
+    free(pMCABatch);
+}
+
+BOOST_AUTO_TEST_CASE(convertFrameDeadtime)
+{
+    size_t dims[2] = {MAX_SPECTRA, NUM_CHANNELS};
+    xsp3Api *xsp3 = xsp.getXsp3();
+    int handle = xsp.getXsp3Handle();
+    std::vector<u_int32_t> rawSCA(XSP3_SW_NUM_SCALERS * NUM_CHANNELS), rawMCA(MAX_SPECTRA * NUM_CHANNELS);
+    std::vector<double> dtcSCA(XSP3_SW_NUM_SCALERS * NUM_CHANNELS), dtcMCA(MAX_SPECTRA * NUM_CHANNELS);
+    NDArray *pMCA64, *pMCA32;
+    double dtcFactor, dtcAllEvent;
+    int wrong64 = 0, wrong32 = 0, wrongAPI = 0;
+    BOOST_REQUIRE(xsp.readFrame(&rawSCA[0], &rawMCA[0], 1, MAX_SPECTRA) == false);
+    BOOST_REQUIRE(xsp.readFrame(&dtcSCA[0], &dtcMCA[0], 1, MAX_SPECTRA) == false);
+    BOOST_REQUIRE(xsp.createMCAArray(dims, pMCA64, NDFloat64) == false);
+    BOOST_REQUIRE(xsp.createMCAArray(dims, pMCA32, NDFloat32) == false);
+    BOOST_CHECK(xsp.convertFrame(&rawMCA[0], &rawSCA[0], pMCA64, NUM_CHANNELS, MAX_SPECTRA) == false);
+    BOOST_CHECK(xsp.convertFrame(&rawMCA[0], &rawSCA[0], pMCA32, NUM_CHANNELS, MAX_SPECTRA) == false);
+    const double *pData64 = static_cast<double*>(pMCA64->pData);
+    const float *pData32 = static_cast<float*>(pMCA32->pData);
+    // Each channel is scaled by the factor the API gives for its scalers...
+    for (int chan=0; chan<NUM_CHANNELS; chan++) {
+        BOOST_REQUIRE(xsp3->get_dtcfactor(handle, &rawSCA[chan * XSP3_SW_NUM_SCALERS], &dtcFactor, &dtcAllEvent, chan) == XSP3_OK);
+        for (int bin=0; bin<MAX_SPECTRA; bin++) {
+            int i = chan * MAX_SPECTRA + bin;
+            double expected = rawMCA[i] * dtcFactor;
+            wrong64 += (fabs(pData64[i] - expected) > 1e-9 * fabs(expected));
+            wrong32 += (fabs(pData32[i] - expected) > 1e-6 * fabs(expected));
+        }
+    }
+    // ...so the frame matches the dead time corrected read of the same frame
+    for (int i=0; i<MAX_SPECTRA * NUM_CHANNELS; i++) {
+        wrongAPI += (fabs(pData64[i] - dtcMCA[i]) > 1e-9 * fabs(dtcMCA[i]));
+    }
+    BOOST_CHECK_EQUAL(wrong64, 0);
+    BOOST_CHECK_EQUAL(wrong32, 0);
+    BOOST_CHECK_EQUAL(wrongAPI, 0);
+    pMCA64->release();
+    pMCA32->release();
+}
+
+static int newFrames[NUM_CHANNELS];
+
+static void countNewFrame(int path, int chan, int tf, int64_t tf_ext, u_int32_t *buffer, void *user_ptr)
+{
+    // Each channel must be called back for every frame in order
+    if ((tf == newFrames[chan]) && (tf_ext == tf))
+        newFrames[chan]++;
+}
+
+BOOST_AUTO_TEST_CASE(newFrameCallback)
+{
+    const int numFrames = 5;
+    xsp3Api *xsp3 = xsp.getXsp3();
+    int handle = xsp.getXsp3Handle();
+    memset(newFrames, 0, sizeof(newFrames));
+    // Internally timed frames of 1ms complete on their own
+    xsp3->set_glob_timeA(handle, 0, XSP3_GLOB_TIMA_TF_SRC(XSP3_GTIMA_SRC_INTERNAL));
+    xsp3->itfg_setup(handle, 0, numFrames, 80000, 0, 0);
+    BOOST_CHECK_EQUAL(xsp3->histogram_set_new_frame_callback(handle, -1, countNewFrame, NULL, 1), XSP3_OK);
+    BOOST_CHECK_EQUAL(xsp3->histogram_set_new_frame_callback(handle, 1, NULL, NULL, 1), XSP3_OK);
+    xsp3->histogram_start(handle, -1);
+    for (int wait=0; (wait<100) && (newFrames[0]<numFrames); wait++)
+        epicsThreadSleep(0.01);
+    xsp3->histogram_stop(handle, -1);
+    BOOST_CHECK_EQUAL(newFrames[0], numFrames);
+    BOOST_CHECK_EQUAL(newFrames[1], 0);
+    BOOST_CHECK_EQUAL(newFrames[NUM_CHANNELS-1], numFrames);
+    xsp3->histogram_set_new_frame_callback(handle, -1, NULL, NULL, 1);
+}
+
+BOOST_AUTO_TEST_CASE(pushReadout)
+{
+    const int numFrames = 5;
+    xsp3Api *xsp3 = xsp.getXsp3();
+    int handle = xsp.getXsp3Handle();
+    int acquired = 0;
+    int numImagesParam, numChannelsParam;
+    xsp.findParam(ADNumImagesString, &numImagesParam);
+    xsp.findParam(xsp3NumChannelsParamString, &numChannelsParam);
+    xsp.setIntegerParam(numImagesParam, numFrames);
+    // Only the channels configured in the API call back
+    xsp.setIntegerParam(numChannelsParam, NUM_CHANNELS - 2);
+    xsp3->set_glob_timeA(handle, 0, XSP3_GLOB_TIMA_TF_SRC(XSP3_GTIMA_SRC_INTERNAL));
+    xsp3->itfg_setup(handle, 0, numFrames, 80000, 0, 0);
+    // The data task waits for the frames in callback mode like this
+    xsp.snapshotAcqConfig();
+    BOOST_CHECK(xsp.enablePushReadout() == false);
+    xsp3->histogram_start(handle, -1);
+    for (int wait=0; (wait<100) && (acquired<numFrames); wait++)
+        acquired = xsp.waitForFrames(0.1);
+    xsp3->histogram_stop(handle, -1);
+    xsp.disablePushReadout();
+    xsp.setIntegerParam(numChannelsParam, NUM_CHANNELS);
+    BOOST_CHECK_EQUAL(acquired, numFrames);
+}
+
+static struct
+{
+    int count;
+    int uniqueId;
+    int frames;
+    std::vector<double> sum;
+} accumArrays;
+
+static void countAccumulated(void *userPvt, asynUser *pasynUser, void *pointer)
+{
+    NDArray *pSum = static_cast<NDArray*>(pointer);
+    NDArrayInfo_t info;
+    pSum->getInfo(&info);
+    accumArrays.count++;
+    accumArrays.uniqueId = pSum->uniqueId;
+    pSum->pAttributeList->find("ACCUMULATED_FRAMES")->getValue(NDAttrInt32, &accumArrays.frames);
+    accumArrays.sum.assign(static_cast<double*>(pSum->pData), static_cast<double*>(pSum->pData) + info.nElements);
+}
+
+BOOST_AUTO_TEST_CASE(accumulate)
+{
+    const int numFrames = 5;
+    const int period = 2;
+    const int numBins = 8;
+    size_t dims[2] = {numBins, NUM_CHANNELS};
+    int periodParam, callbacksParam, dataParam, arrayCallbacks;
+    int wrong = 0;
+    NDArray *pMCA;
+    void *interruptPvt;
+    xsp.findParam(xsp3AccumulatePeriodParamString, &periodParam);
+    xsp.findParam(NDArrayCallbacksString, &callbacksParam);
+    xsp.findParam(NDArrayDataString, &dataParam);
+    xsp.getIntegerParam(callbacksParam, &arrayCallbacks);
+    xsp.setIntegerParam(periodParam, period);
+    xsp.setIntegerParam(callbacksParam, 1);
+    xsp.snapshotAcqConfig();
+    // Register for the accumulated spectra, on NDArray address 1, like a plugin does
+    asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+    BOOST_REQUIRE(pasynManager->connectDevice(pasynUser, xsp.portName, 1) == asynSuccess);
+    asynInterface *pGenericPointer = pasynManager->findInterface(pasynUser, asynGenericPointerType, 1);
+    BOOST_REQUIRE(pGenericPointer != NULL);
+    asynGenericPointer *pInterface = static_cast<asynGenericPointer*>(pGenericPointer->pinterface);
+    pasynUser->reason = dataParam;
+    BOOST_REQUIRE(pInterface->registerInterruptUser(pGenericPointer->drvPvt, pasynUser, countAccumulated, NULL, &interruptPvt) == asynSuccess);
+    accumArrays.count = 0;
+    for (int frame=1; frame<=numFrames; frame++) {
+        BOOST_REQUIRE(xsp.createMCAArray(dims, pMCA, NDUInt32) == false);
+        for (int i=0; i<numBins * NUM_CHANNELS; i++) {
+            static_cast<u_int32_t*>(pMCA->pData)[i] = frame * i;
+        }
+        xsp.accumulate(pMCA, frame);
+        pMCA->release();
+        // The sum is published every period frames
+        BOOST_CHECK_EQUAL(accumArrays.count, frame / period);
+    }
+    BOOST_CHECK_EQUAL(accumArrays.uniqueId, 4);
+    BOOST_CHECK_EQUAL(accumArrays.frames, 4);
+    // The frames since then are published once, at the end of the acquisition
+    xsp.publishAccumulated();
+    xsp.publishAccumulated();
+    BOOST_CHECK_EQUAL(accumArrays.count, 3);
+    BOOST_CHECK_EQUAL(accumArrays.uniqueId, numFrames);
+    BOOST_CHECK_EQUAL(accumArrays.frames, numFrames);
+    // Each value is summed over the frames, 1+2+3+4+5 times its index
+    BOOST_REQUIRE_EQUAL(accumArrays.sum.size(), numBins * NUM_CHANNELS);
+    for (int i=0; i<numBins * NUM_CHANNELS; i++) {
+        wrong += (accumArrays.sum[i] != 15.0 * i);
+    }
+    BOOST_CHECK_EQUAL(wrong, 0);
+    pInterface->cancelInterruptUser(pGenericPointer->drvPvt, pasynUser, interruptPvt);
+    pasynManager->freeAsynUser(pasynUser);
+    xsp.setIntegerParam(periodParam, 0);
+    xsp.setIntegerParam(callbacksParam, arrayCallbacks);
+}
+
+static struct
+{
+    int count;
+    int ndims;
+    size_t dims[3];
+    std::vector<double> values;
+} scaStreamArrays;
+
+static void countScaStream(void *userPvt, asynUser *pasynUser, void *pointer)
+{
+    NDArray *pStream = static_cast<NDArray*>(pointer);
+    NDArrayInfo_t info;
+    pStream->getInfo(&info);
+    scaStreamArrays.count++;
+    scaStreamArrays.ndims = pStream->ndims;
+    for (int dim=0; dim<pStream->ndims && dim<3; dim++) {
+        scaStreamArrays.dims[dim] = pStream->dims[dim].size;
+    }
+    scaStreamArrays.values.assign(static_cast<double*>(pStream->pData), static_cast<double*>(pStream->pData) + info.nElements);
+}
+
+BOOST_AUTO_TEST_CASE(scaStream)
+{
+    const int numFrames = 3;
+    int streamParam, streamFramesParam, scalerArraysParam, callbacksParam, dataParam, arrayCallbacks;
+    int wrong = 0;
+    u_int32_t SCA[XSP3_SW_NUM_SCALERS * NUM_CHANNELS];
+    double waveform[numFrames];
+    size_t nIn;
+    char paramName[64];
+    void *interruptPvt;
+    xsp.findParam(xsp3ScaStreamParamString, &streamParam);
+    xsp.findParam(xsp3ScaStreamFramesParamString, &streamFramesParam);
+    xsp.findParam(xsp3ScalerArraysParamString, &scalerArraysParam);
+    xsp.findParam(NDArrayCallbacksString, &callbacksParam);
+    xsp.findParam(NDArrayDataString, &dataParam);
+    xsp.getIntegerParam(callbacksParam, &arrayCallbacks);
+    xsp.setIntegerParam(streamParam, 1);
+    xsp.setIntegerParam(streamFramesParam, numFrames);
+    xsp.setIntegerParam(scalerArraysParam, 1);
+    xsp.setIntegerParam(callbacksParam, 1);
+    xsp.snapshotAcqConfig();
+    // Register for the SCA stream, on NDArray address 2, like a plugin does
+    asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+    BOOST_REQUIRE(pasynManager->connectDevice(pasynUser, xsp.portName, 2) == asynSuccess);
+    asynInterface *pGenericPointer = pasynManager->findInterface(pasynUser, asynGenericPointerType, 1);
+    BOOST_REQUIRE(pGenericPointer != NULL);
+    asynGenericPointer *pInterface = static_cast<asynGenericPointer*>(pGenericPointer->pinterface);
+    pasynUser->reason = dataParam;
+    BOOST_REQUIRE(pInterface->registerInterruptUser(pGenericPointer->drvPvt, pasynUser, countScaStream, NULL, &interruptPvt) == asynSuccess);
+    scaStreamArrays.count = 0;
+    for (int frame=1; frame<=numFrames; frame++) {
+        for (int chan=0; chan<NUM_CHANNELS; chan++) {
+            for (int scaler=0; scaler<XSP3_SW_NUM_SCALERS; scaler++) {
+                SCA[chan * XSP3_SW_NUM_SCALERS + scaler] = 1000 * frame + 10 * chan + scaler;
+            }
+        }
+        const xsp3Deadtime &dtc = xsp.calculateDeadtime(SCA, NUM_CHANNELS, NDUInt32, 1);
+        xsp.storeScas(SCA, dtc.getDTPercent(), dtc.getDTFactor(), NUM_CHANNELS, NDUInt32, frame);
+    }
+    pInterface->cancelInterruptUser(pGenericPointer->drvPvt, pasynUser, interruptPvt);
+    pasynManager->freeAsynUser(pasynUser);
+    // One array of [SCAs, dead time percent and factor][channel][frame]
+    BOOST_REQUIRE_EQUAL(scaStreamArrays.count, 1);
+    BOOST_REQUIRE_EQUAL(scaStreamArrays.ndims, 3);
+    BOOST_CHECK_EQUAL(scaStreamArrays.dims[0], XSP3_NUM_SCALER_ARRAYS);
+    BOOST_CHECK_EQUAL(scaStreamArrays.dims[1], NUM_CHANNELS);
+    BOOST_CHECK_EQUAL(scaStreamArrays.dims[2], numFrames);
+    BOOST_REQUIRE_EQUAL(scaStreamArrays.values.size(), XSP3_NUM_SCALER_ARRAYS * NUM_CHANNELS * numFrames);
+    BOOST_CHECK_EQUAL(scaStreamArrays.values[(2 * NUM_CHANNELS + 1) * XSP3_NUM_SCALER_ARRAYS + 4], 3014);
+    // Every value matches the scaler arrays of the channel
+    for (int chan=0; chan<NUM_CHANNELS; chan++) {
+        asynUser *pasynUserChan = pasynManager->createAsynUser(0, 0);
+        BOOST_REQUIRE(pasynManager->connectDevice(pasynUserChan, xsp.portName, chan) == asynSuccess);
+        for (int value=0; value<XSP3_NUM_SCALER_ARRAYS; value++) {
+            epicsSnprintf(paramName, sizeof(paramName), xsp3ChanScaArrayParamString, value);
+            xsp.findParam(paramName, &pasynUserChan->reason);
+            BOOST_CHECK(xsp.readFloat64Array(pasynUserChan, waveform, numFrames, &nIn) == asynSuccess);
+            BOOST_CHECK_EQUAL(nIn, numFrames);
+            for (int frame=0; frame<numFrames; frame++) {
+                wrong += (waveform[frame] != scaStreamArrays.values[(frame * NUM_CHANNELS + chan) * XSP3_NUM_SCALER_ARRAYS + value]);
+            }
+        }
+        pasynManager->freeAsynUser(pasynUserChan);
+    }
+    BOOST_CHECK_EQUAL(wrong, 0);
+    xsp.setIntegerParam(streamParam, 0);
+    xsp.setIntegerParam(scalerArraysParam, 0);
+    xsp.setIntegerParam(callbacksParam, arrayCallbacks);
+}
+
+BOOST_AUTO_TEST_CASE(simFaults)
+{
+    const int numFrames = 10;
+    const int burstFrames = 4;
+    xsp3Api *xsp3 = xsp.getXsp3();
+    int handle = xsp.getXsp3Handle();
+    int errorParam, dropParam, busyParam, burstParam;
+    int nonZero = 0, badProgress = 0, progress = 0;
+    u_int32_t SCA[XSP3_SW_NUM_SCALERS * NUM_CHANNELS];
+    std::vector<u_int32_t> MCAData(MAX_SPECTRA * NUM_CHANNELS);
+    xsp.findParam(xsp3SimErrorRateParamString, &errorParam);
+    xsp.findParam(xsp3SimDropRateParamString, &dropParam);
+    xsp.findParam(xsp3SimBusyTimeParamString, &busyParam);
+    xsp.findParam(xsp3SimBurstFramesParamString, &burstParam);
+    // Every read call fails
+    xsp.setDoubleParam(errorParam, 1.0);
+    xsp.setSimFaults();
+    BOOST_CHECK(xsp.readFrame(&SCA[0], &MCAData[0], 1, MAX_SPECTRA) == true);
+    xsp.setDoubleParam(errorParam, 0.0);
+    // Every frame is lost, so reads as 0
+    xsp.setDoubleParam(dropParam, 1.0);
+    xsp.setSimFaults();
+    BOOST_CHECK(xsp.readFrame(&SCA[0], &MCAData[0], 1, MAX_SPECTRA) == false);
+    for (int i=0; i<MAX_SPECTRA * NUM_CHANNELS; i++) {
+        nonZero += (MCAData[i] != 0);
+    }
+    for (int i=0; i<XSP3_SW_NUM_SCALERS * NUM_CHANNELS; i++) {
+        nonZero += (SCA[i] != 0);
+    }
+    BOOST_CHECK_EQUAL(nonZero, 0);
+    xsp.setDoubleParam(dropParam, 0.0);
+    xsp.setSimFaults();
     BOOST_CHECK(xsp.readFrame(&SCA[0], &MCAData[0], 1, MAX_SPECTRA) == false);
+    BOOST_CHECK(MCAData[0] != 0);
+    // Busy after a start until the busy time is up
+    xsp.setDoubleParam(busyParam, 10.0);
+    xsp.setSimFaults();
+    xsp3->histogram_start(handle, -1);
+    BOOST_CHECK_EQUAL(xsp3->histogram_is_any_busy(handle), 1);
+    xsp.setDoubleParam(busyParam, 0.0);
+    xsp.setSimFaults();
+    BOOST_CHECK_EQUAL(xsp3->histogram_is_any_busy(handle), 0);
+    xsp3->histogram_stop(handle, -1);
+    // Internally timed frames only arrive burstFrames at a time, apart from the last ones
+    xsp.setIntegerParam(burstParam, burstFrames);
+    xsp.setSimFaults();
+    xsp3->set_glob_timeA(handle, 0, XSP3_GLOB_TIMA_TF_SRC(XSP3_GTIMA_SRC_INTERNAL));
+    xsp3->itfg_setup(handle, 0, numFrames, 80000, 0, 0);
+    xsp3->histogram_start(handle, -1);
+    for (int wait=0; (wait<1000) && (progress<numFrames); wait++) {
+        progress = xsp3->scaler_check_progress(handle);
+        badProgress += ((progress % burstFrames != 0) && (progress != numFrames));
+        epicsThreadSleep(0.001);
+    }
+    xsp3->histogram_stop(handle, -1);
+    BOOST_CHECK_EQUAL(progress, numFrames);
+    BOOST_CHECK_EQUAL(badProgress, 0);
+    xsp.setIntegerParam(burstParam, 1);
+    xsp.setSimFaults();
+}
+
+BOOST_AUTO_TEST_CASE(deadtime)
+{
+    const int numFrames = 3;
+    xsp3Deadtime dtc(NUM_CHANNELS);
+    u_int32_t SCA[numFrames * NUM_CHANNELS * XSP3_SW_NUM_SCALERS] = {0};
+    for (int chan=0; chan<NUM_CHANNELS; chan++) {
+        dtc.setEventWidth(chan, 4.0);
+        u_int32_t *pScaData = &SCA[(NUM_CHANNELS + chan) * XSP3_SW_NUM_SCALERS];
+        pScaData[0] = 1000;
+        pScaData[1] = 50;
+        pScaData[3] = 10;
+    }
+    dtc.calculate(SCA, NUM_CHANNELS, numFrames);
+    // The first frame has too few clock ticks for a dead time
+    BOOST_CHECK(dtc.getDTPercent()[0] == 0.0);
+    BOOST_CHECK(dtc.getDTFactor()[0] == 1.0);
+    // 10 events of width 5 plus 50 reset ticks out of 1000 clock ticks
+    BOOST_CHECK_CLOSE(dtc.getDTPercent()[NUM_CHANNELS], 10.0, 1e-9);
+    BOOST_CHECK_CLOSE(dtc.getDTFactor()[2 * NUM_CHANNELS - 1], 1000.0 / 900.0, 1e-9);
+    // The third frame keeps the dead time of the second
+    BOOST_CHECK_CLOSE(dtc.getDTPercent()[2 * NUM_CHANNELS], 10.0, 1e-9);
+    BOOST_CHECK_CLOSE(dtc.getDTFactor()[3 * NUM_CHANNELS - 1], 1000.0 / 900.0, 1e-9);
+    // and so does the next block read out
+    dtc.calculate(SCA, NUM_CHANNELS, 1);
+    BOOST_CHECK_CLOSE(dtc.getDTPercent()[0], 10.0, 1e-9);
+    BOOST_CHECK_CLOSE(dtc.getDTFactor()[NUM_CHANNELS - 1], 1000.0 / 900.0, 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE(roi)
+{
+    const int numBins = 8;
+    xsp3Roi roi(NUM_CHANNELS, 3);
+    u_int32_t MCA[NUM_CHANNELS * numBins];
+    for (int i=0; i<NUM_CHANNELS * numBins; i++) {
+        MCA[i] = i;
+    }
+    for (int chan=0; chan<NUM_CHANNELS; chan++) {
+        roi.setLimits(chan, 0, 2, 5);
+        roi.setLimits(chan, 1, 6, 100);
+    }
+    // ROI 2 is left undefined
+    roi.setWindow(0, numBins, 1);
+    roi.calculate(MCA, NUM_CHANNELS, numBins);
+    BOOST_CHECK(roi.getSums()[0] == 2 + 3 + 4);
+    BOOST_CHECK(roi.getSums()[1] == 6 + 7);
+    BOOST_CHECK(roi.getSums()[2] == 0);
+    BOOST_CHECK(roi.getSums()[3] == 10 + 11 + 12);
+    // Detector bins 2 to 17 rebinned by 2, so bins 0 and 1 start in [2, 5) and the rest in [6, 100)
+    roi.setWindow(2, numBins, 2);
+    roi.calculate(MCA, NUM_CHANNELS, numBins);
+    BOOST_CHECK(roi.getSums()[0] == 0 + 1);
+    BOOST_CHECK(roi.getSums()[1] == 2 + 3 + 4 + 5 + 6 + 7);
+    BOOST_CHECK(!roi.isDefined(0, 2));
+}
+
+BOOST_AUTO_TEST_CASE(scalerStore)
+{
+    const int numScalers = 3;
+    xsp3ScalerStore store(NUM_CHANNELS, numScalers);
+    double sca[NUM_CHANNELS * numScalers];
+    double dtPercent[NUM_CHANNELS];
+    double dtFactor[NUM_CHANNELS];
+    store.resize(4);
+    for (int frame=0; frame<5; frame++) {
+        for (int i=0; i<NUM_CHANNELS * numScalers; i++) {
+            sca[i] = 100 * frame + i;
+        }
+        for (int chan=0; chan<NUM_CHANNELS; chan++) {
+            dtPercent[chan] = frame;
+            dtFactor[chan] = 1.0 + frame;
+        }
+        // Frame 1 is dropped, and frame 4 does not fit
+        if (frame != 1) {
+            store.store(frame, sca, dtPercent, dtFactor, NUM_CHANNELS);
+        }
+    }
+    BOOST_CHECK(store.getNumFrames() == 4);
+    BOOST_CHECK(store.getNumValues() == numScalers + 2);
+    BOOST_CHECK(store.getWaveform(0, 0)[0] == 0);
+    BOOST_CHECK(store.getWaveform(0, 0)[1] == 0);
+    BOOST_CHECK(store.getWaveform(2, 1)[3] == 300 + numScalers + 2);
+    BOOST_CHECK(store.getWaveform(numScalers, 0)[2] == 2);
+    BOOST_CHECK(store.getWaveform(numScalers + 1, NUM_CHANNELS - 1)[3] == 4);
+    BOOST_CHECK(store.getWaveform(numScalers + 2, 0) == NULL);
+    store.clear();
+    BOOST_CHECK(store.getNumFrames() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(channelMap)
+{
+    int enableParam;
+    size_t dims[2];
+    std::vector<int> chanMap;
+    xsp.findParam(xsp3ChanEnableParamString, &enableParam);
+    xsp.setIntegerParam(1, enableParam, 0);
+    xsp.setIntegerParam(2, enableParam, 0);
+    xsp.getChannelMap(chanMap);
+    BOOST_CHECK_EQUAL(chanMap.size(), NUM_CHANNELS - 2);
+    BOOST_CHECK_EQUAL(chanMap[0], 0);
+    BOOST_CHECK_EQUAL(chanMap[1], 3);
+    BOOST_CHECK(xsp.setChannelMap());
+    xsp.getDims(dims);
+    BOOST_CHECK_EQUAL(dims[1], NUM_CHANNELS - 2);
+    // Put every channel back so the readout is left as it was found
+    xsp.setIntegerParam(1, enableParam, 1);
+    xsp.setIntegerParam(2, enableParam, 1);
+    BOOST_CHECK(!xsp.setChannelMap());
+    xsp.getDims(dims);
+    BOOST_CHECK_EQUAL(dims[1], NUM_CHANNELS);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -97,6 +667,95 @@ BOOST_AUTO_TEST_CASE(integration)
     pMCA->release();
 }
 
+BOOST_AUTO_TEST_CASE(zeroCopyAck)
+{
+    Xspress3 xsp(&++asynPortHack, NUM_CHANNELS, 1);
+    xsp3Api *xsp3;
+    xsp3Simulator *sim;
+    NDArray *pMCA;
+    void *pSCA;
+    size_t dims[2] = {MAX_SPECTRA, NUM_CHANNELS};
+    xsp3 = xsp.getXsp3();
+    sim = dynamic_cast<xsp3Simulator*>(xsp3);
+    BOOST_REQUIRE(sim != NULL);
+    xsp.connect();
+    int handle = xsp.getXsp3Handle();
+    BOOST_CHECK(xsp3->has_get_data_ptr(handle) > 0);
+    xsp.createSCAArray(pSCA);
+    xsp3->histogram_start(handle, -1);
+    BOOST_REQUIRE(!xsp.readFrameZeroCopy(static_cast<u_int32_t*>(pSCA), pMCA, 0, dims));
+    // The array wraps the histogram memory rather than a copy of it
+    BOOST_CHECK(pMCA->pData == xsp3->histogram_get_data_ptr(handle, 0, 0, 0, 0));
+    // The frame is only acked when the last user releases it
+    pMCA->reserve();
+    pMCA->release();
+    BOOST_CHECK_EQUAL(sim->getCircAcks(), 0);
+    pMCA->release();
+    BOOST_CHECK_EQUAL(sim->getCircAcks(), 1);
+    // The pool reuses the array for the next frame, which is acked on its own
+    BOOST_REQUIRE(!xsp.readFrameZeroCopy(static_cast<u_int32_t*>(pSCA), pMCA, 1, dims));
+    pMCA->release();
+    BOOST_CHECK_EQUAL(sim->getCircAcks(), 2);
+    xsp3->histogram_stop(handle, -1);
+    free(pSCA);
+}
+
+BOOST_AUTO_TEST_CASE(circularBuffer)
+{
+    const int bufferFrames = 8;
+    const int numFrames = 20;
+    Xspress3 xsp(&++asynPortHack, NUM_CHANNELS, 1);
+    xsp3Api *xsp3;
+    int lagParam, maxLagParam, overrunsParam;
+    int lag, maxLag, overruns, progress = 0;
+    xsp3 = xsp.getXsp3();
+    xsp.connect();
+    int handle = xsp.getXsp3Handle();
+    xsp.findParam(xsp3SimCircLagParamString, &lagParam);
+    xsp.findParam(xsp3SimCircMaxLagParamString, &maxLagParam);
+    xsp.findParam(xsp3SimCircOverrunsParamString, &overrunsParam);
+    // The frames configured are the size of the buffer
+    xsp3->config(1, bufferFrames, const_cast<char*>("127.0.0.1"), -1, NULL, NUM_CHANNELS, 1, NULL, 0, 0);
+    xsp3->set_glob_timeA(handle, 0, XSP3_GLOB_TIMA_TF_SRC(XSP3_GTIMA_SRC_INTERNAL));
+    xsp3->itfg_setup(handle, 0, numFrames, 80000, 0, 0);
+    xsp3->histogram_start(handle, -1);
+    for (int wait=0; (wait<1000) && (progress<numFrames); wait++) {
+        progress = xsp3->scaler_check_progress(handle);
+        epicsThreadSleep(0.001);
+    }
+    xsp3->histogram_stop(handle, -1);
+    BOOST_REQUIRE_EQUAL(progress, numFrames);
+    // Nothing was acked, so every frame after the first bufferFrames overwrote one
+    xsp.updateSimCircStatus();
+    xsp.getIntegerParam(lagParam, &lag);
+    xsp.getIntegerParam(maxLagParam, &maxLag);
+    xsp.getIntegerParam(overrunsParam, &overruns);
+    BOOST_CHECK_EQUAL(lag, bufferFrames);
+    BOOST_CHECK_EQUAL(maxLag, bufferFrames);
+    BOOST_CHECK_EQUAL(overruns, numFrames - bufferFrames);
+    // Acking the oldest frames frees them
+    xsp.ackFrames(numFrames - bufferFrames, 2);
+    xsp.updateSimCircStatus();
+    xsp.getIntegerParam(lagParam, &lag);
+    BOOST_CHECK_EQUAL(lag, bufferFrames - 2);
+    // Frames that have been overwritten cannot be acked
+    xsp.ackFrames(0, 1);
+    xsp.updateSimCircStatus();
+    xsp.getIntegerParam(lagParam, &lag);
+    BOOST_CHECK_EQUAL(lag, bufferFrames - 2);
+    // A frame acked out of order is only freed once the frames before it are
+    xsp.ackFrames(numFrames - bufferFrames + 3, 1);
+    xsp.updateSimCircStatus();
+    xsp.getIntegerParam(lagParam, &lag);
+    BOOST_CHECK_EQUAL(lag, bufferFrames - 2);
+    xsp.ackFrames(numFrames - bufferFrames + 2, 1);
+    xsp.updateSimCircStatus();
+    xsp.getIntegerParam(lagParam, &lag);
+    xsp.getIntegerParam(overrunsParam, &overruns);
+    BOOST_CHECK_EQUAL(lag, bufferFrames - 4);
+    BOOST_CHECK_EQUAL(overruns, numFrames - bufferFrames);
+}
+
 BOOST_AUTO_TEST_CASE(dataTask)
 {
     xspress3Config(&++asynPortHack, NUM_CHANNELS, 1, "127.0.0.1", 16, 16, MAX_SPECTRA, -1, -1, 1, 1);
@@ -152,6 +152,18 @@ int xsp3Api::histogram_clear(int path, int first_chan, int num_chan, int first_f
     return status;
 }
 
+int xsp3Api::histogram_circ_ack(int path, int chan, int frame, int num_chan, int num_frames)
+{
+    int status;
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "xsp3_histogram_circ_ack( %d, %d, %d, %d, %d ) = ", path, chan, frame, num_chan, num_frames);
+
+    status = xsp3Api_histogram_circ_ack( path, chan, frame, num_chan, num_frames);
+
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "%d\n", status );
+
+    return status;
+}
+
 int xsp3Api::histogram_pause(int path, int card)
 {
     int status;
@@ -447,3 +459,75 @@ int xsp3Api::get_generation(int path, int card)
     return status;
 
 }
+
+int xsp3Api::histogram_set_new_frame_callback(int path, int chan, xsp3NewFrameCallback new_frame, void *user_ptr, int late)
+{
+    int status;
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "xsp3_histogram_set_new_frame_callback( %d, %d, %p, %p, %d ) = ", path, chan, new_frame, user_ptr, late);
+
+    status = xsp3Api_histogram_set_new_frame_callback(path, chan, new_frame, user_ptr, late);
+
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "%d\n", status );
+
+    return status;
+}
+
+int xsp3Api::has_get_data_ptr(int path)
+{
+    int status;
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "xsp3_has_get_data_ptr( %d ) = ", path);
+
+    status = xsp3Api_has_get_data_ptr(path);
+
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "%d\n", status );
+
+    return status;
+}
+
+u_int32_t* xsp3Api::histogram_get_data_ptr(int path, unsigned eng, unsigned aux, unsigned chan, unsigned tf)
+{
+    u_int32_t *pData;
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "xsp3_histogram_get_data_ptr( %d, %u, %u, %u, %u ) = ", path, eng, aux, chan, tf);
+
+    pData = xsp3Api_histogram_get_data_ptr(path, eng, aux, chan, tf);
+
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "%p\n", pData );
+
+    return pData;
+}
+
+int xsp3Api::has_roi(int path, int chan)
+{
+    int status;
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "xsp3_has_roi( %d, %d ) = ", path, chan);
+
+    status = xsp3Api_has_roi(path, chan);
+
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "%d\n", status );
+
+    return status;
+}
+
+int xsp3Api::set_roi(int path, int chan, int num_roi, XSP3Roi *roi)
+{
+    int status;
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "xsp3_set_roi( %d, %d, %d, %p ) = ", path, chan, num_roi, roi);
+
+    status = xsp3Api_set_roi(path, chan, num_roi, roi);
+
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "%d\n", status );
+
+    return status;
+}
+
+int xsp3Api::init_roi(int path, int chan)
+{
+    int status;
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "xsp3_init_roi( %d, %d ) = ", path, chan);
+
+    status = xsp3Api_init_roi(path, chan);
+
+    asynPrint(this->pasynUser, XSP3IF_DEBUG, "%d\n", status );
+
+    return status;
+}
@@ -30,6 +30,9 @@
 #include "xspress3.h"
 #include "asynDriver.h"
 
+/** Signature of the API new frame callback, see xsp3_histogram_set_new_frame_callback */
+typedef void (*xsp3NewFrameCallback)(int path, int chan, int tf, int64_t tf_ext, u_int32_t *buffer, void *user_ptr);
+
 class xsp3Api {
 public:
     xsp3Api(asynUser * pasynUser);
@@ -48,6 +51,7 @@ protected:
     virtual int xsp3Api_hist_dtc_read4d(int path, double *hist_buff, double *scal_buff, unsigned eng, unsigned aux, unsigned chan, unsigned tf,
                                      unsigned num_eng, unsigned num_aux, unsigned num_chan, unsigned num_tf) = 0;
     virtual int xsp3Api_histogram_clear(int path, int first_chan, int num_chan, int first_frame, int num_frames) = 0;
+    virtual int xsp3Api_histogram_circ_ack(int path, int chan, int frame, int num_chan, int num_frames) = 0;
     virtual int xsp3Api_histogram_arm(int path, int card) = 0;
     virtual int xsp3Api_histogram_continue(int path, int card) = 0;
     virtual int xsp3Api_histogram_pause(int path, int card) = 0;
@@ -72,6 +76,12 @@ protected:
     virtual int xsp3Api_get_trigger_b(int path, unsigned chan, Xspress3_TriggerB *trig_b) = 0;
     virtual int xsp3Api_get_dtcfactor(int path, u_int32_t *scaData, double *dtcFactor, double *dtcAllEvent, unsigned chan) = 0;
     virtual int xsp3Api_get_generation(int path, int card) = 0;
+    virtual int xsp3Api_histogram_set_new_frame_callback(int path, int chan, xsp3NewFrameCallback new_frame, void *user_ptr, int late) = 0;
+    virtual int xsp3Api_has_get_data_ptr(int path) = 0;
+    virtual u_int32_t* xsp3Api_histogram_get_data_ptr(int path, unsigned eng, unsigned aux, unsigned chan, unsigned tf) = 0;
+    virtual int xsp3Api_has_roi(int path, int chan) = 0;
+    virtual int xsp3Api_set_roi(int path, int chan, int num_roi, XSP3Roi *roi) = 0;
+    virtual int xsp3Api_init_roi(int path, int chan) = 0;
 
 public:
     int clocks_setup(int path, int card, int clk_src, int flags, int tp_type);
@@ -86,6 +96,7 @@ public:
     int hist_dtc_read4d(int path, double *hist_buff, double *scal_buff, unsigned eng, unsigned aux, unsigned chan, unsigned tf,
                     unsigned num_eng, unsigned num_aux, unsigned num_chan, unsigned num_tf);
     int histogram_clear(int path, int first_chan, int num_chan, int first_frame, int num_frames);
+    int histogram_circ_ack(int path, int chan, int frame, int num_chan, int num_frames);
     int histogram_pause(int path, int card);
     int histogram_arm(int path, int card);
     int histogram_continue(int path, int card);
@@ -110,6 +121,12 @@ public:
     int get_trigger_b(int path, unsigned card, Xspress3_TriggerB *trig_b);
     int get_dtcfactor(int path, u_int32_t *scaData, double *dtcFactor, double *dtcAllEvent, unsigned chan);
     int get_generation(int path, int card);
+    int histogram_set_new_frame_callback(int path, int chan, xsp3NewFrameCallback new_frame, void *user_ptr, int late);
+    int has_get_data_ptr(int path);
+    u_int32_t* histogram_get_data_ptr(int path, unsigned eng, unsigned aux, unsigned chan, unsigned tf);
+    int has_roi(int path, int chan);
+    int set_roi(int path, int chan, int num_roi, XSP3Roi *roi);
+    int init_roi(int path, int chan);
 
 private:
     asynUser * pasynUser;
@@ -0,0 +1,155 @@
+#include "xsp3Deadtime.h"
+#include "xspress3.h"
+
+const double xsp3Deadtime::minClockTicks = 10.0;
+
+//Indexes of the scalers used for the dead time
+static const int clockTicksScaler = 0;
+static const int resetTicksScaler = 1;
+static const int allEventScaler = 3;
+
+xsp3Deadtime::xsp3Deadtime(int numChannels) :
+    eventWidth_(numChannels, 5.0), lastPercent_(numChannels, 0.0), lastFactor_(numChannels, 1.0)
+{
+}
+
+void xsp3Deadtime::setEventWidth(int chan, double eventWidth)
+{
+    if ((chan >= 0) && (chan < static_cast<int>(eventWidth_.size()))) {
+        eventWidth_[chan] = eventWidth;
+    }
+}
+
+double xsp3Deadtime::getEventWidth(int chan) const
+{
+    return eventWidth_[chan];
+}
+
+/**
+ * Set the detector channel held by each channel slot of the scalers
+ * passed to calculate. An empty map means slot n holds channel n.
+ *
+ * @param chanMap The detector channel of each slot
+ */
+void xsp3Deadtime::setChannelMap(const std::vector<int> &chanMap)
+{
+    chanMap_ = chanMap;
+}
+
+/**
+ * Take the event widths and channel map of another instance, keeping the
+ * last valid dead time of each channel.
+ *
+ * @param other The instance to copy the settings from
+ */
+void xsp3Deadtime::copySettings(const xsp3Deadtime &other)
+{
+    eventWidth_ = other.eventWidth_;
+    chanMap_ = other.chanMap_;
+    lastPercent_.resize(eventWidth_.size(), 0.0);
+    lastFactor_.resize(eventWidth_.size(), 1.0);
+}
+
+/**
+ * Calculate the dead time percent and correction factor.
+ * Where there are no more than minClockTicks clock ticks a channel keeps
+ * the percent and factor of the last frame that had more, or 0 and 1 if
+ * there has not been one, as the dead time parameters always have.
+ *
+ * @param pSCA The scalers as [numFrames][numChannels][XSP3_SW_NUM_SCALERS]
+ * @param numChannels The number of channels in each frame
+ * @param numFrames The number of frames in pSCA
+ */
+void xsp3Deadtime::calculate(const double *pSCA, int numChannels, int numFrames)
+{
+    this->gather(pSCA, numChannels * numFrames);
+    this->calculate(numChannels, numFrames);
+}
+
+void xsp3Deadtime::calculate(const u_int32_t *pSCA, int numChannels, int numFrames)
+{
+    this->gather(pSCA, numChannels * numFrames);
+    this->calculate(numChannels, numFrames);
+}
+
+/**
+ * Copy the scalers needed for the dead time out of the interleaved
+ * scaler array into one contiguous array each.
+ */
+template <typename T> void xsp3Deadtime::gather(const T *pSCA, int numValues)
+{
+    if (static_cast<int>(clockTicks_.size()) < numValues) {
+        clockTicks_.resize(numValues);
+        resetTicks_.resize(numValues);
+        allEvent_.resize(numValues);
+        dtPercent_.resize(numValues);
+        dtFactor_.resize(numValues);
+    }
+    for (int i=0; i<numValues; i++) {
+        clockTicks_[i] = static_cast<double>(pSCA[i*XSP3_SW_NUM_SCALERS + clockTicksScaler]);
+        resetTicks_[i] = static_cast<double>(pSCA[i*XSP3_SW_NUM_SCALERS + resetTicksScaler]);
+        allEvent_[i] = static_cast<double>(pSCA[i*XSP3_SW_NUM_SCALERS + allEventScaler]);
+    }
+}
+
+void xsp3Deadtime::calculate(int numChannels, int numFrames)
+{
+    if (static_cast<int>(slotWidth_.size()) < numChannels) {
+        slotWidth_.resize(numChannels);
+        slotPercent_.resize(numChannels);
+        slotFactor_.resize(numChannels);
+    }
+    for (int chan=0; chan<numChannels; chan++) {
+        int mapped = (chan < static_cast<int>(chanMap_.size())) ? chanMap_[chan] : chan;
+        slotWidth_[chan] = eventWidth_[mapped];
+        slotPercent_[chan] = lastPercent_[mapped];
+        slotFactor_[chan] = lastFactor_[mapped];
+    }
+    const double *eventWidth = &slotWidth_[0];
+    double *lastPercent = &slotPercent_[0];
+    double *lastFactor = &slotFactor_[0];
+    for (int frame=0; frame<numFrames; frame++) {
+        const double *clockTicks = &clockTicks_[frame*numChannels];
+        const double *resetTicks = &resetTicks_[frame*numChannels];
+        const double *allEvent = &allEvent_[frame*numChannels];
+        double *dtPercent = &dtPercent_[frame*numChannels];
+        double *dtFactor = &dtFactor_[frame*numChannels];
+        for (int chan=0; chan<numChannels; chan++) {
+            double dead = allEvent[chan]*(eventWidth[chan]+1.0) + resetTicks[chan];
+            bool valid = clockTicks[chan] > minClockTicks;
+            double ticks = valid ? clockTicks[chan] : 1.0;
+            dtPercent[chan] = valid ? 100.0*dead/ticks : lastPercent[chan];
+            dtFactor[chan] = valid ? ticks/(ticks - dead) : lastFactor[chan];
+            lastPercent[chan] = dtPercent[chan];
+            lastFactor[chan] = dtFactor[chan];
+        }
+    }
+    for (int chan=0; chan<numChannels; chan++) {
+        int mapped = (chan < static_cast<int>(chanMap_.size())) ? chanMap_[chan] : chan;
+        lastPercent_[mapped] = slotPercent_[chan];
+        lastFactor_[mapped] = slotFactor_[chan];
+    }
+}
+
+/**
+ * Scale a raw spectrum by a dead time correction factor
+ *
+ * @param pRaw The raw spectrum
+ * @param factor The correction factor
+ * @param numBins The number of bins in the spectrum
+ * @param pCorrected The corrected spectrum
+ */
+void xsp3Deadtime::correct(const u_int32_t *pRaw, double factor, int numBins, double *pCorrected)
+{
+    for (int i=0; i<numBins; i++) {
+        pCorrected[i] = static_cast<double>(pRaw[i]) * factor;
+    }
+}
+
+void xsp3Deadtime::correct(const u_int32_t *pRaw, double factor, int numBins, float *pCorrected)
+{
+    const float floatFactor = static_cast<float>(factor);
+    for (int i=0; i<numBins; i++) {
+        pCorrected[i] = static_cast<float>(pRaw[i]) * floatFactor;
+    }
+}
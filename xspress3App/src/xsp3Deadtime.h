@@ -0,0 +1,86 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @brief Dead time calculation from the Xspress3 scalers
+ *
+ * Holds the event width of every channel, so it does not have to be read
+ * from the parameter library for every frame, and works out the dead time
+ * percent and correction factor for all the channels of one or more frames.
+ *
+ * The scalers arrive as [frame][channel][XSP3_SW_NUM_SCALERS]. The three
+ * that are needed are first gathered into contiguous arrays so the
+ * calculation itself is a straight loop the compiler can vectorise.
+ * When only some channels are read out, the channel map says which
+ * detector channel each slot of a frame holds. A channel with too few
+ * clock ticks in a frame for a dead time keeps the values of its last
+ * frame that had enough, which carry over from one calculation to the
+ * next.
+ *
+ * It also has the kernels used to apply a dead time correction factor to
+ * raw spectra in the driver, rather than with xsp3_hist_dtc_read4d.
+ */
+#ifndef XSP3DEADTIME_H
+#define XSP3DEADTIME_H
+
+#include <vector>
+#include <sys/types.h>
+
+class xsp3Deadtime {
+public:
+    xsp3Deadtime(int numChannels);
+
+    void setEventWidth(int chan, double eventWidth);
+    double getEventWidth(int chan) const;
+    void setChannelMap(const std::vector<int> &chanMap);
+    void copySettings(const xsp3Deadtime &other);
+
+    void calculate(const double *pSCA, int numChannels, int numFrames);
+    void calculate(const u_int32_t *pSCA, int numChannels, int numFrames);
+
+    /** The dead time percent for each [frame][channel] of the last calculation */
+    const double *getDTPercent() const { return &dtPercent_[0]; }
+    /** The dead time correction factor for each [frame][channel] of the last calculation */
+    const double *getDTFactor() const { return &dtFactor_[0]; }
+
+    static void correct(const u_int32_t *pRaw, double factor, int numBins, double *pCorrected);
+    static void correct(const u_int32_t *pRaw, double factor, int numBins, float *pCorrected);
+
+    /** Below this many clock ticks there is too little data for a dead time */
+    static const double minClockTicks;
+
+private:
+    template <typename T> void gather(const T *pSCA, int numValues);
+    void calculate(int numChannels, int numFrames);
+
+    std::vector<double> eventWidth_;
+    std::vector<int> chanMap_;
+    std::vector<double> slotWidth_;
+    std::vector<double> lastPercent_; //The last valid dead time percent of each detector channel
+    std::vector<double> lastFactor_; //The last valid correction factor of each detector channel
+    std::vector<double> slotPercent_;
+    std::vector<double> slotFactor_;
+    std::vector<double> clockTicks_;
+    std::vector<double> resetTicks_;
+    std::vector<double> allEvent_;
+    std::vector<double> dtPercent_;
+    std::vector<double> dtFactor_;
+};
+
+#endif /* XSP3DEADTIME_H */
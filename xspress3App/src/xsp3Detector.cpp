@@ -88,6 +88,13 @@ int xsp3Detector::xsp3Api_histogram_clear(int path, int first_chan, int num_chan
     return status;
 }
 
+int xsp3Detector::xsp3Api_histogram_circ_ack(int path, int chan, int frame, int num_chan, int num_frames)
+{
+    int status;
+    status = xsp3_histogram_circ_ack( path, chan, frame, num_chan, num_frames);
+    return status;
+}
+
 int xsp3Detector::xsp3Api_histogram_continue(int path, int card)
 {
     int status;
@@ -254,3 +261,34 @@ int xsp3Detector::xsp3Api_get_generation(int path, int card)
     return xsp3_get_generation(path, card);
 }
 
+int xsp3Detector::xsp3Api_histogram_set_new_frame_callback(int path, int chan, xsp3NewFrameCallback new_frame, void *user_ptr, int late)
+{
+    int status;
+    status = xsp3_histogram_set_new_frame_callback(path, chan, new_frame, user_ptr, late);
+    return status;
+}
+
+int xsp3Detector::xsp3Api_has_get_data_ptr(int path)
+{
+    return xsp3_has_get_data_ptr(path);
+}
+
+u_int32_t* xsp3Detector::xsp3Api_histogram_get_data_ptr(int path, unsigned eng, unsigned aux, unsigned chan, unsigned tf)
+{
+    return xsp3_histogram_get_data_ptr(path, eng, aux, chan, tf);
+}
+
+int xsp3Detector::xsp3Api_has_roi(int path, int chan)
+{
+    return xsp3_has_roi(path, chan);
+}
+
+int xsp3Detector::xsp3Api_set_roi(int path, int chan, int num_roi, XSP3Roi *roi)
+{
+    return xsp3_set_roi(path, chan, num_roi, roi);
+}
+
+int xsp3Detector::xsp3Api_init_roi(int path, int chan)
+{
+    return xsp3_init_roi(path, chan);
+}
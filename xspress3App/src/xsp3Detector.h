@@ -47,6 +47,7 @@ protected:
     virtual int xsp3Api_hist_dtc_read4d(int path, double *hist_buff, double *scal_buff, unsigned eng, unsigned aux, unsigned chan, unsigned tf,
                                      unsigned num_eng, unsigned num_aux, unsigned num_chan, unsigned num_tf);
     virtual int xsp3Api_histogram_clear(int path, int first_chan, int num_chan, int first_frame, int num_frames);
+    virtual int xsp3Api_histogram_circ_ack(int path, int chan, int frame, int num_chan, int num_frames);
     virtual int xsp3Api_histogram_continue(int path, int card);
     virtual int xsp3Api_histogram_pause(int path, int card);
     virtual int xsp3Api_histogram_arm(int path, int card);
@@ -71,6 +72,12 @@ protected:
     virtual int xsp3Api_get_trigger_b(int path, unsigned chan, Xspress3_TriggerB *trig_b);
     virtual int xsp3Api_get_dtcfactor(int path, u_int32_t *scaData, double *dtcFactor, double *dtcAllEvent, unsigned chan);
     virtual int xsp3Api_get_generation(int path, int card);
+    virtual int xsp3Api_histogram_set_new_frame_callback(int path, int chan, xsp3NewFrameCallback new_frame, void *user_ptr, int late);
+    virtual int xsp3Api_has_get_data_ptr(int path);
+    virtual u_int32_t* xsp3Api_histogram_get_data_ptr(int path, unsigned eng, unsigned aux, unsigned chan, unsigned tf);
+    virtual int xsp3Api_has_roi(int path, int chan);
+    virtual int xsp3Api_set_roi(int path, int chan, int num_roi, XSP3Roi *roi);
+    virtual int xsp3Api_init_roi(int path, int chan);
 };
 
 #endif /* XSP3DETECTOR_H */
@@ -0,0 +1,111 @@
+#include "xsp3Roi.h"
+#include <algorithm>
+
+xsp3Roi::xsp3Roi(int numChannels, int numRois) :
+    numChannels_(numChannels), numRois_(numRois),
+    llm_(numChannels * numRois, 0), hlm_(numChannels * numRois, 0),
+    first_(numChannels * numRois, 0), last_(numChannels * numRois, 0),
+    numSums_(numChannels, 0), sums_(numChannels * numRois, 0.0)
+{
+}
+
+/**
+ * Set the limits of an ROI. setWindow must be called before the next
+ * calculation for them to be used.
+ *
+ * @param chan The channel, as it is ordered in the spectra passed to calculate
+ * @param roi The ROI, from 0
+ * @param llm The first detector bin in the ROI
+ * @param hlm One more than the last detector bin in the ROI
+ */
+void xsp3Roi::setLimits(int chan, int roi, int llm, int hlm)
+{
+    if ((chan >= 0) && (chan < numChannels_) && (roi >= 0) && (roi < numRois_)) {
+        llm_[chan*numRois_ + roi] = llm;
+        hlm_[chan*numRois_ + roi] = hlm;
+    }
+}
+
+/**
+ * Map the ROI limits onto the bins of the spectra that will be passed to
+ * calculate, which hold numBins bins of rebin detector bins each from
+ * firstBin.
+ *
+ * @param firstBin The first detector bin in the spectra
+ * @param numBins The number of bins in each spectrum
+ * @param rebin The number of detector bins in each bin
+ */
+void xsp3Roi::setWindow(int firstBin, int numBins, int rebin)
+{
+    rebin = std::max(rebin, 1);
+    for (int chan=0; chan<numChannels_; chan++) {
+        numSums_[chan] = 0;
+        for (int roi=0; roi<numRois_; roi++) {
+            const int i = chan*numRois_ + roi;
+            // The bins whose first detector bin is in [llm, hlm)
+            int first = std::max(llm_[i] - firstBin + rebin - 1, 0) / rebin;
+            int last = std::max(hlm_[i] - firstBin + rebin - 1, 0) / rebin;
+            first_[i] = std::min(first, numBins);
+            last_[i] = this->isDefined(chan, roi) ? std::max(std::min(last, numBins), first_[i]) : first_[i];
+            numSums_[chan] = std::max(numSums_[chan], last_[i]);
+        }
+    }
+}
+
+/**
+ * @return true if the high limit of the ROI is above its low limit
+ */
+bool xsp3Roi::isDefined(int chan, int roi) const
+{
+    return hlm_[chan*numRois_ + roi] > llm_[chan*numRois_ + roi];
+}
+
+/**
+ * Sum the ROIs of every channel of a frame
+ *
+ * @param pMCA The spectra as [numChannels][numBins]
+ * @param numChannels The number of channels in pMCA
+ * @param numBins The number of bins in each spectrum, as passed to setWindow
+ */
+void xsp3Roi::calculate(const u_int32_t *pMCA, int numChannels, int numBins)
+{
+    this->sum(pMCA, numChannels, numBins);
+}
+
+void xsp3Roi::calculate(const epicsUInt16 *pMCA, int numChannels, int numBins)
+{
+    this->sum(pMCA, numChannels, numBins);
+}
+
+void xsp3Roi::calculate(const double *pMCA, int numChannels, int numBins)
+{
+    this->sum(pMCA, numChannels, numBins);
+}
+
+void xsp3Roi::calculate(const float *pMCA, int numChannels, int numBins)
+{
+    this->sum(pMCA, numChannels, numBins);
+}
+
+template <typename T> void xsp3Roi::sum(const T *pMCA, int numChannels, int numBins)
+{
+    numChannels = std::min(numChannels, numChannels_);
+    if (static_cast<int>(prefix_.size()) < numBins + 1) {
+        prefix_.resize(numBins + 1);
+    }
+    double *prefix = &prefix_[0];
+    prefix[0] = 0.0;
+    for (int chan=0; chan<numChannels; chan++) {
+        const T *pSpectrum = pMCA + chan*numBins;
+        const int numSums = std::min(numSums_[chan], numBins);
+        for (int bin=0; bin<numSums; bin++) {
+            prefix[bin+1] = prefix[bin] + static_cast<double>(pSpectrum[bin]);
+        }
+        const int *first = &first_[chan*numRois_];
+        const int *last = &last_[chan*numRois_];
+        double *sums = &sums_[chan*numRois_];
+        for (int roi=0; roi<numRois_; roi++) {
+            sums[roi] = prefix[std::min(last[roi], numSums)] - prefix[std::min(first[roi], numSums)];
+        }
+    }
+}
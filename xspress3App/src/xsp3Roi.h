@@ -0,0 +1,73 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @brief MCA ROI sums for every channel of a frame
+ *
+ * Each channel has up to a fixed number of ROIs, set in detector bins as
+ * [low limit, high limit). An ROI with a high limit no greater than its
+ * low limit is not defined and always sums to 0.
+ *
+ * The spectra passed to calculate may only hold an energy window of the
+ * detector bins, rebinned, so the limits are first mapped onto the bins
+ * of the spectra by setWindow. A bin is in an ROI if the first detector
+ * bin it holds is. The sums are then worked out with one pass over each
+ * spectrum to make its prefix sums, up to the highest bin any ROI of the
+ * channel needs, after which every ROI is a single subtraction.
+ */
+#ifndef XSP3ROI_H
+#define XSP3ROI_H
+
+#include <vector>
+#include <sys/types.h>
+#include <epicsTypes.h>
+
+class xsp3Roi {
+public:
+    xsp3Roi(int numChannels, int numRois);
+
+    void setLimits(int chan, int roi, int llm, int hlm);
+    void setWindow(int firstBin, int numBins, int rebin);
+    bool isDefined(int chan, int roi) const;
+    /** The number of ROIs of each channel */
+    int getNumRois() const { return numRois_; }
+
+    void calculate(const u_int32_t *pMCA, int numChannels, int numBins);
+    void calculate(const epicsUInt16 *pMCA, int numChannels, int numBins);
+    void calculate(const double *pMCA, int numChannels, int numBins);
+    void calculate(const float *pMCA, int numChannels, int numBins);
+
+    /** The sum of each [channel][ROI] of the last calculation */
+    const double *getSums() const { return &sums_[0]; }
+
+private:
+    template <typename T> void sum(const T *pMCA, int numChannels, int numBins);
+
+    int numChannels_;
+    int numRois_;
+    std::vector<int> llm_; //[channel][ROI] in detector bins
+    std::vector<int> hlm_;
+    std::vector<int> first_; //[channel][ROI] in the bins of the spectra
+    std::vector<int> last_;
+    std::vector<int> numSums_; //[channel] the number of prefix sums the ROIs need
+    std::vector<double> prefix_;
+    std::vector<double> sums_;
+};
+
+#endif /* XSP3ROI_H */
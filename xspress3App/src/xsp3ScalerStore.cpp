@@ -0,0 +1,100 @@
+#include "xsp3ScalerStore.h"
+#include <algorithm>
+#include <epicsAtomic.h>
+
+/**
+ * @param numChannels The number of channels in each frame
+ * @param numScalers The number of scalers of each channel in each frame
+ */
+xsp3ScalerStore::xsp3ScalerStore(int numChannels, int numScalers) :
+    numChannels_(numChannels), numScalers_(numScalers), numValues_(numScalers + 2),
+    maxFrames_(0), numFrames_(0)
+{
+}
+
+/**
+ * Make room for maxFrames frames, and clear the store. The memory is only
+ * reallocated if the number of frames has changed.
+ *
+ * @param maxFrames The number of frames to keep
+ */
+void xsp3ScalerStore::resize(int maxFrames)
+{
+    if (maxFrames != maxFrames_) {
+        maxFrames_ = 0;
+        values_.assign(static_cast<size_t>(numValues_) * numChannels_ * maxFrames, 0.0);
+        maxFrames_ = maxFrames;
+    }
+    this->clear();
+}
+
+/**
+ * Forget the frames stored, ready for the next acquisition
+ */
+void xsp3ScalerStore::clear()
+{
+    epicsAtomicSetIntT(&numFrames_, 0);
+}
+
+/**
+ * Store the scalers of a frame. Frames with no room are ignored, and any
+ * frames skipped since the last one stored, eg. because they were dropped,
+ * are set to 0.
+ *
+ * @param frame The (0 based) index of the frame
+ * @param pSca The scalers, as [channel][numScalers]
+ * @param pDTPercent The dead time percent of each channel
+ * @param pDTFactor The dead time correction factor of each channel
+ * @param numChannels The number of channels in the frame
+ */
+void xsp3ScalerStore::store(int frame, const double *pSca, const double *pDTPercent, const double *pDTFactor, int numChannels)
+{
+    if ((frame < 0) || (frame >= maxFrames_)) {
+        return;
+    }
+    if (numChannels > numChannels_) {
+        numChannels = numChannels_;
+    }
+    const size_t valueStride = static_cast<size_t>(numChannels_) * maxFrames_;
+    const int numFrames = epicsAtomicGetIntT(&numFrames_);
+    if (frame > numFrames) {
+        for (size_t row=0; row<static_cast<size_t>(numValues_)*numChannels_; row++) {
+            std::fill(&values_[row*maxFrames_ + numFrames], &values_[row*maxFrames_ + frame], 0.0);
+        }
+    }
+    double *pOut = &values_[frame];
+    for (int chan=0; chan<numChannels; chan++) {
+        const double *pChanSca = pSca + chan*numScalers_;
+        for (int value=0; value<numScalers_; value++) {
+            pOut[value*valueStride] = pChanSca[value];
+        }
+        pOut[numScalers_*valueStride] = pDTPercent[chan];
+        pOut[(numScalers_ + 1)*valueStride] = pDTFactor[chan];
+        pOut += maxFrames_;
+    }
+    if (frame >= numFrames) {
+        epicsAtomicSetIntT(&numFrames_, frame + 1);
+    }
+}
+
+/**
+ * @return The number of frames stored, up to the highest one
+ */
+int xsp3ScalerStore::getNumFrames() const
+{
+    return epicsAtomicGetIntT(&numFrames_);
+}
+
+/**
+ * @param value The value, from 0 to getNumValues()-1
+ * @param chan The channel, as it is ordered in the frames stored
+ *
+ * @return The value of the channel for every frame, or NULL if they are out of range
+ */
+const double *xsp3ScalerStore::getWaveform(int value, int chan) const
+{
+    if ((value < 0) || (value >= numValues_) || (chan < 0) || (chan >= numChannels_) || (maxFrames_ == 0)) {
+        return NULL;
+    }
+    return &values_[(static_cast<size_t>(value)*numChannels_ + chan) * maxFrames_];
+}
@@ -0,0 +1,62 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @brief The scalers of every frame of an acquisition, by frame
+ *
+ * Holds a number of values (the SCAs, dead time percent and correction
+ * factor) for each channel of every frame, stored as [value][channel][frame]
+ * so the history of one value of one channel is a contiguous waveform.
+ * The store is allocated for a maximum number of frames before the
+ * acquisition starts, and frames beyond that are not kept.
+ *
+ * One thread stores the frames, in order, while others read the waveforms.
+ * Only the frames up to getNumFrames are complete, so readers should not
+ * look beyond it, and clear and resize should only be called when nothing
+ * is being stored or read.
+ */
+#ifndef XSP3SCALERSTORE_H
+#define XSP3SCALERSTORE_H
+
+#include <vector>
+
+class xsp3ScalerStore {
+public:
+    xsp3ScalerStore(int numChannels, int numScalers);
+
+    void resize(int maxFrames);
+    void clear();
+    void store(int frame, const double *pSca, const double *pDTPercent, const double *pDTFactor, int numChannels);
+    int getNumFrames() const;
+    /** The number of frames there is room for */
+    int getMaxFrames() const { return maxFrames_; }
+    /** The number of values of each channel, numScalers then the dead time percent and factor */
+    int getNumValues() const { return numValues_; }
+    const double *getWaveform(int value, int chan) const;
+
+private:
+    int numChannels_;
+    int numScalers_;
+    int numValues_;
+    int maxFrames_;
+    int numFrames_; //Every frame below this has been stored
+    std::vector<double> values_; //[value][channel][frame]
+};
+
+#endif /* XSP3SCALERSTORE_H */
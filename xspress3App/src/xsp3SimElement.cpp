@@ -5,14 +5,93 @@
  *      Author: npr78
  */
 #include "xsp3SimElement.h"
+#include "xspress3.h"
 #include <cmath>
 #include <cstdlib>
 
 
 static int num_detectors=0;
 
+// Detector timing, in the units the scalers count in
+static const double clockRate = 80E6;
+static const double resetRate = 1000.0;
+static const uint32_t ticksPerReset = 160;
+static const double pileupTime = 0.4E-6;
+
+// Scaler indexes, as read by xsp3_scaler_read
+enum { scalerTime, scalerResetTicks, scalerResetCount, scalerAllEvent, scalerAllGood,
+       scalerInWindow0, scalerInWindow1, scalerPileup, scalerTotalTicks };
+
+// Simulated fluorescence lines, as fractions of the spectrum, and the
+// share of the counts that land in the flat background
+struct xsp3SimPeak
+{
+    double centre;
+    double sigma;
+    double weight;
+};
+static const xsp3SimPeak peaks[] = {
+    { 0.160, 0.0040, 1.00 },
+    { 0.176, 0.0045, 0.17 },
+    { 0.320, 0.0060, 0.50 },
+    { 0.352, 0.0065, 0.09 }
+};
+static const int num_peaks = sizeof(peaks)/sizeof(peaks[0]);
+static const double background = 0.2;
+
+uint64_t xsp3SimMix( uint64_t x )
+{
+    // splitmix64 finaliser
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Uniform in (0, 1], advancing the state
+static double uniform( uint64_t &state )
+{
+    state = xsp3SimMix(state);
+    return (static_cast<double>(state >> 11) + 1.0) / 9007199254740992.0;
+}
+
+static uint64_t seed( int detector, unsigned int frame, unsigned int stream )
+{
+    return xsp3SimMix(xsp3SimMix((static_cast<uint64_t>(frame) << 32) | static_cast<uint32_t>(detector)) ^ stream);
+}
+
+/**
+ * A Poisson distributed count. Small means use Knuth's method, which needs
+ * exp(-mean), large means the normal approximation.
+ */
+static uint32_t poisson( double mean, double expMean, uint64_t &state )
+{
+    if (mean <= 0.0)
+        return 0;
+    if (mean < 30.0)
+    {
+        double p = uniform(state);
+        uint32_t k = 0;
+        while (p > expMean)
+        {
+            p *= uniform(state);
+            k++;
+        }
+        return k;
+    }
+    double u1 = uniform(state);
+    double u2 = uniform(state);
+    double n = mean + sqrt(mean) * sqrt(-2.0*log(u1)) * cos(6.283185307179586*u2) + 0.5;
+    if (n < 0.0) return 0;
+    if (n > 4294967295.0) return 4294967295U;
+    return static_cast<uint32_t>(n);
+}
+
 xsp3SimElement::xsp3SimElement( int nspectra )
-: threshold(0),
+: countRate(0.0),
+  frameTime(0.0),
+  cachedFrame(-1),
+  threshold(0),
   num_spectra(nspectra),
   processDeadTimeAllEventGradient(0),
   processDeadTimeAllEventOffset(0),
@@ -20,92 +99,237 @@ xsp3SimElement::xsp3SimElement( int nspectra )
   processDeadTimeInWindowGradient(0)
 {
     detector = num_detectors++;
+    window[0].low = window[0].high = 0;
+    window[1].low = window[1].high = 0;
+    frameCounts.resize(num_spectra);
+    prefixSums.resize(num_spectra+1);
+    buildTemplate();
 }
 
 xsp3SimElement::~xsp3SimElement( void )
 {
 }
 
-void xsp3SimElement::generateRawSpectra( int frame, unsigned int start, unsigned int n_pts, uint32_t * buffer )
+/**
+ * Set the input count rate
+ *
+ * @param rate Counts/s, 0 for the test patterns
+ */
+void xsp3SimElement::setCountRate( double rate )
 {
-    if ( start+n_pts > num_spectra ) n_pts = num_spectra-start;
+    if (rate != countRate)
+    {
+        countRate = rate;
+        buildTemplate();
+    }
+}
 
-    switch (detector%3)
+/**
+ * Set the frame time, which scales the counts when there is a count rate
+ *
+ * @param time The frame time in seconds
+ */
+void xsp3SimElement::setFrameTime( double time )
+{
+    if (time != frameTime)
     {
-    case 1:
+        frameTime = time;
+        buildTemplate();
+    }
+}
+
+/**
+ * Work out everything about a frame that does not depend on the frame
+ * number, and forget the cached frame.
+ */
+void xsp3SimElement::buildTemplate( void )
+{
+    cachedFrame = -1;
+    meanCounts.clear();
+    expMeanCounts.clear();
+    sinTable.clear();
+    cosTable.clear();
+    if ( countRate > 0.0 )
     {
-        // Delta functions
-        for (unsigned int i=0; i < n_pts; i++)
+        double goodEvents = countRate * exp(-countRate * pileupTime) * frameTime;
+        double total = background;
+        for (int i=0; i < num_peaks; i++)
+            total += peaks[i].weight;
+        meanCounts.assign(num_spectra, goodEvents * background / (num_spectra * total));
+        for (int i=0; i < num_peaks; i++)
         {
-            if ((start+i+frame)%100 ==0)
-                buffer[i]=100;
-            else
-                buffer[i]=0;
+            double sigma = peaks[i].sigma * num_spectra;
+            if (sigma < 1.0) sigma = 1.0;
+            double scale = goodEvents * peaks[i].weight / (sigma * 2.5066282746310002 * total);
+            for (unsigned int bin=0; bin < num_spectra; bin++)
+            {
+                double x = (bin - peaks[i].centre * num_spectra) / sigma;
+                meanCounts[bin] += scale * exp(-0.5*x*x);
+            }
         }
-        break;
+        expMeanCounts.resize(num_spectra);
+        for (unsigned int bin=0; bin < num_spectra; bin++)
+            expMeanCounts[bin] = exp(-meanCounts[bin]);
     }
-    case 2:
+    else if ( detector%3 == 0 )
     {
-        // Saw tooth
-        for (unsigned int i=0; i < n_pts; i++)
+        // sin((frame+bin)/90) = sin(frame/90)cos(bin/90) + cos(frame/90)sin(bin/90)
+        sinTable.resize(num_spectra);
+        cosTable.resize(num_spectra);
+        for (unsigned int bin=0; bin < num_spectra; bin++)
         {
-            buffer[i]=(start+i+frame)%100;
+            sinTable[bin] = sin(static_cast<double>(bin)/90);
+            cosTable[bin] = cos(static_cast<double>(bin)/90);
         }
-        break;
     }
-    default:
-        // Sine wave with noise
-        for (unsigned int i=0; i < n_pts; i++)
+}
+
+/**
+ * Get the whole spectrum of a frame, generating it from the template if it
+ * is not the one already cached.
+ */
+const uint32_t *xsp3SimElement::frameSpectrum( int frame )
+{
+    if (frame == cachedFrame)
+        return &frameCounts[0];
+
+    if ( countRate > 0.0 )
+    {
+        uint64_t state = seed(detector, frame, 0);
+        for (unsigned int bin=0; bin < num_spectra; bin++)
+            frameCounts[bin] = poisson( meanCounts[bin], expMeanCounts[bin], state );
+    }
+    else
+    {
+        switch (detector%3)
+        {
+        case 1:
+            // Delta functions
+            for (unsigned int bin=0; bin < num_spectra; bin++)
+                frameCounts[bin] = ((bin+frame)%100 == 0) ? 100 : 0;
+            break;
+        case 2:
+            // Saw tooth
+            for (unsigned int bin=0; bin < num_spectra; bin++)
+                frameCounts[bin] = (bin+frame)%100;
+            break;
+        default:
         {
-            buffer[i] = (sin(static_cast<double>(start+i+frame)/90)+1)*100;
+            // Sine wave
+            double sinFrame = sin(static_cast<double>(frame)/90);
+            double cosFrame = cos(static_cast<double>(frame)/90);
+            for (unsigned int bin=0; bin < num_spectra; bin++)
+                frameCounts[bin] = (sinFrame*cosTable[bin] + cosFrame*sinTable[bin] + 1)*100;
+        }
         }
     }
-}
-void xsp3SimElement::generateDTCSpectra( int frame, unsigned int start, unsigned int n_pts, double * buffer )
-{
-    if ( start+n_pts > num_spectra ) n_pts = num_spectra-start;
 
-    uint32_t ibuffer[n_pts];
+    prefixSums[0] = 0;
+    for (unsigned int bin=0; bin < num_spectra; bin++)
+        prefixSums[bin+1] = prefixSums[bin] + frameCounts[bin];
+    if ( !roiLut.empty() )
+    {
+        roiCounts.assign(num_spectra, 0);
+        for (unsigned int bin=0; bin < num_spectra; bin++)
+            roiCounts[roiLut[bin]] += frameCounts[bin];
+    }
+    cachedFrame = frame;
+    return &frameCounts[0];
+}
 
-    generateRawSpectra( frame, start, n_pts, ibuffer );
+/**
+ * Get the spectrum of a frame as it is read out, which is the ROI bins if
+ * hardware ROIs are set.
+ */
+const uint32_t *xsp3SimElement::outputSpectrum( int frame )
+{
+    const uint32_t *spectrum = frameSpectrum( frame );
+    return roiLut.empty() ? spectrum : &roiCounts[0];
+}
 
-    for (unsigned int i=0; i < n_pts; i++)
-        buffer[i] = ibuffer[i];
+/**
+ * Set the hardware ROIs
+ *
+ * @param lut The ROI bin, less than num_spectra, of each bin of the spectrum.
+ *            Empty to read out the whole spectrum.
+ */
+void xsp3SimElement::setRoiLut( const std::vector<int> &lut )
+{
+    roiLut = lut;
+    cachedFrame = -1;
 }
 
-uint32_t xsp3SimElement::generateRawROI( int frame, int win )
+/**
+ * The sum of a frame over a window, from the prefix sums
+ */
+uint64_t xsp3SimElement::windowSum( int frame, int win )
 {
-    int result=0;
-    unsigned int start=window[win].low;
-    unsigned int n_pts =window[win].high-window[win].low+1;
+    int low = window[win].low;
+    int high = window[win].high;
+    if (low < 0) low = 0;
+    if (high >= static_cast<int>(num_spectra)) high = num_spectra-1;
+    if (high < low)
+        return 0;
+    frameSpectrum( frame );
+    return prefixSums[high+1] - prefixSums[low];
+}
 
+void xsp3SimElement::generateRawSpectra( int frame, unsigned int start, unsigned int n_pts, uint32_t * buffer )
+{
+    if ( start >= num_spectra ) return;
     if ( start+n_pts > num_spectra ) n_pts = num_spectra-start;
 
-    uint32_t buffer[n_pts];
-    generateRawSpectra( frame, start, n_pts, buffer );
-
+    const uint32_t *spectrum = outputSpectrum( frame );
     for (unsigned int i=0; i < n_pts; i++)
-        result+=buffer[i];
-
-    return result;
+        buffer[i] = spectrum[start+i];
 }
 
-double xsp3SimElement::generateDTCROI( int frame, int win )
+void xsp3SimElement::generateDTCSpectra( int frame, unsigned int start, unsigned int n_pts, double * buffer )
 {
-    double result=0;
-    unsigned int start=window[win].low;
-    unsigned int n_pts =window[win].high-window[win].low+1;
-
+    if ( start >= num_spectra ) return;
     if ( start+n_pts > num_spectra ) n_pts = num_spectra-start;
 
-    double buffer[n_pts];
-    generateDTCSpectra( frame, start, n_pts, buffer );
-
+    const uint32_t *spectrum = outputSpectrum( frame );
     for (unsigned int i=0; i < n_pts; i++)
-        result+=buffer[i];
+        buffer[i] = spectrum[start+i];
+}
+
+uint32_t xsp3SimElement::generateRawROI( int frame, int win )
+{
+    return static_cast<uint32_t>(windowSum( frame, win ));
+}
 
-    return result;
+double xsp3SimElement::generateDTCROI( int frame, int win )
+{
+    return static_cast<double>(windowSum( frame, win ));
 }
 
+/**
+ * Fill in the XSP3_SW_NUM_SCALERS scalers for a frame. With a count rate
+ * the all event, reset and pileup counts follow from it, and the window
+ * scalers are the sums of the simulated spectrum.
+ */
+void xsp3SimElement::generateScalers( int frame, uint32_t * scalers )
+{
+    for (int i=0; i < XSP3_SW_NUM_SCALERS; i++)
+        scalers[i] = 0;
 
+    scalers[scalerTime] = static_cast<uint32_t>(frameTime * clockRate + 0.5);
+    scalers[scalerTotalTicks] = scalers[scalerTime];
+    scalers[scalerInWindow0] = generateRawROI( frame, 0 );
+    scalers[scalerInWindow1] = generateRawROI( frame, 1 );
 
+    if ( countRate > 0.0 )
+    {
+        uint64_t state = seed(detector, frame, 1);
+        double allEventMean = countRate * frameTime;
+        double resetMean = resetRate * frameTime;
+        uint32_t allEvent = poisson( allEventMean, exp(-allEventMean), state );
+        uint32_t pileup = static_cast<uint32_t>(allEvent * (1.0 - exp(-countRate * pileupTime)) + 0.5);
+        scalers[scalerResetCount] = poisson( resetMean, exp(-resetMean), state );
+        scalers[scalerResetTicks] = scalers[scalerResetCount] * ticksPerReset;
+        scalers[scalerAllEvent] = allEvent;
+        scalers[scalerPileup] = pileup;
+        scalers[scalerAllGood] = allEvent - pileup;
+    }
+}
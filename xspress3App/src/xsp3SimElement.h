@@ -9,6 +9,7 @@
 #define XSP3SIMDATA_H_
 
 #include <stdint.h>
+#include <vector>
 
 typedef struct xsp3Window
 {
@@ -16,19 +17,66 @@ typedef struct xsp3Window
     int high;
 } xsp3Window_t;
 
+/**
+ * Hash a 64 bit value, used to seed the simulated data from frame numbers
+ */
+uint64_t xsp3SimMix( uint64_t x );
+
+/**
+ * A simulated detector element.
+ *
+ * With a count rate of 0 the spectra are fixed test patterns. Otherwise the
+ * spectra are Poisson distributed around a few fluorescence peaks on a flat
+ * background, with the number of counts set by the count rate and frame
+ * time, and the scalers are worked out from the same events.
+ *
+ * Everything that does not change from frame to frame (the mean counts of
+ * each bin, or the test pattern) is built into a template when the count
+ * rate or frame time is set. The spectrum of the last frame asked for is
+ * kept with its prefix sums, so the MCA, the window scalers and the ROIs
+ * of a frame only generate it once. Each frame is seeded from the element
+ * and frame number, so reading a frame again gives the same counts.
+ *
+ * With hardware ROIs set the spectra read out are the ROI bins, made from
+ * the spectrum of the frame with a lookup table of the output bin of each
+ * of its bins. The window scalers still count the whole spectrum.
+ */
 class xsp3SimElement
 {
 private:
     int detector;
+    double countRate;
+    double frameTime;
+
+    std::vector<double> meanCounts;   // Mean counts of each bin
+    std::vector<double> expMeanCounts;// exp(-meanCounts) for the Poisson sampling
+    std::vector<double> sinTable;     // Per-bin sine and cosine for the sine pattern
+    std::vector<double> cosTable;
+    std::vector<uint32_t> frameCounts;// The spectrum of cachedFrame
+    std::vector<uint64_t> prefixSums; // prefixSums[i] is the sum of frameCounts[0..i-1]
+    std::vector<int> roiLut;          // The ROI bin of each bin, empty without hardware ROIs
+    std::vector<uint32_t> roiCounts;  // The ROI bins of cachedFrame
+    int cachedFrame;
+
+    void buildTemplate( void );
+    const uint32_t *frameSpectrum( int frame );
+    const uint32_t *outputSpectrum( int frame );
+    uint64_t windowSum( int frame, int win );
 
 public:
     xsp3SimElement( int numSpectra );
     ~xsp3SimElement( void );
 
+    void setCountRate( double rate );
+    double getCountRate( void ) const { return countRate; }
+    void setFrameTime( double time );
+    void setRoiLut( const std::vector<int> &lut );
+
     void generateRawSpectra( int frame, unsigned int start, unsigned int stop, uint32_t * buffer );
     void generateDTCSpectra( int frame, unsigned int start, unsigned int stop, double * buffer );
     uint32_t generateRawROI( int frame, int win );
     double generateDTCROI( int frame, int win );
+    void generateScalers( int frame, uint32_t * scalers );
 
     uint32_t threshold;
     xsp3Window_t window[2];
@@ -1,5 +1,18 @@
 #include "xsp3Simulator.h"
 #include "xsp3SimElement.h"
+#include <string.h>
+#include <algorithm>
+
+static void xsp3SimWorkerTaskC(void *worker)
+{
+    xsp3SimWorker *pWorker = static_cast<xsp3SimWorker*>(worker);
+    pWorker->sim->workerTask(pWorker);
+}
+
+static void xsp3SimRingTaskC(void *sim)
+{
+    static_cast<xsp3Simulator*>(sim)->ringTask();
+}
 
 xsp3Simulator::xsp3Simulator( asynUser * user, int max_detectors, int max_spectra ) :
     xsp3Api(user),
@@ -7,17 +20,478 @@ xsp3Simulator::xsp3Simulator( asynUser * user, int max_detectors, int max_spectr
     runFlags(0),
     frame_time(0.0),
     num_frames(0),
-    current_frame(0)
-{
+    current_frame(0),
+    running(false),
+    rate_driven(false),
+    num_threads(1),
+    exiting(false),
+    workers_exiting(false),
+    ring_frames(0),
+    ring_next(0),
+    read_next(0),
+    num_spectra(max_spectra),
+    circ_buffer(false),
+    circ_frames(0),
+    circ_oldest(0),
+    circ_max_lag(0),
+    circ_overruns(0),
+    circ_acks(0),
+    new_frame(max_detectors, static_cast<xsp3NewFrameCallback>(NULL)),
+    new_frame_ptr(max_detectors, static_cast<void*>(NULL)),
+    has_callbacks(false),
+    frames_called_back(0)
+{
+    memset(&faults, 0, sizeof(faults));
+    faults.burst_frames = 1;
+    error_state = 0;
     detectors.reserve(max_detectors);
     for (int i=0; i< max_detectors; i++)
         detectors.push_back(xsp3SimElement(max_spectra));
 
     scanStart = epicsTime::getCurrent();
+    busyStart = scanStart;
     this->handle=314158;
+
+    generate_lock = epicsMutexMustCreate();
+    ring_lock = epicsMutexMustCreate();
+    ring_event = epicsEventMustCreate(epicsEventEmpty);
+    ring_exited = epicsEventMustCreate(epicsEventEmpty);
+    circ_lock = epicsMutexMustCreate();
+    mem_lock = epicsMutexMustCreate();
+    callback_lock = epicsMutexMustCreate();
+    workers.reserve(maxThreads);
+    epicsThreadCreate("XSP3SimRing", epicsThreadPriorityMedium,
+                      epicsThreadGetStackSize(epicsThreadStackMedium),
+                      (EPICSTHREADFUNC)xsp3SimRingTaskC, this);
 }
 xsp3Simulator::~xsp3Simulator()
 {
+    // Wait for the ring thread first, as it may be using the workers
+    exiting = true;
+    epicsEventSignal(ring_event);
+    epicsEventWait(ring_exited);
+    epicsMutexLock(generate_lock);
+    workers_exiting = true;
+    for (unsigned int w = 0; w < workers.size(); w++)
+    {
+        epicsEventSignal(workers[w].start);
+        epicsEventWait(workers[w].done);
+        epicsEventDestroy(workers[w].start);
+        epicsEventDestroy(workers[w].done);
+    }
+    epicsMutexUnlock(generate_lock);
+    epicsEventDestroy(ring_event);
+    epicsEventDestroy(ring_exited);
+    epicsMutexDestroy(ring_lock);
+    epicsMutexDestroy(circ_lock);
+    epicsMutexDestroy(mem_lock);
+    epicsMutexDestroy(callback_lock);
+    epicsMutexDestroy(generate_lock);
+}
+
+/**
+ * Set how many threads generate the channels of each read in parallel.
+ * With 1 the data is generated on the thread that reads it.
+ *
+ * @param threads The number of threads, up to maxThreads
+ */
+void xsp3Simulator::setNumThreads(int threads)
+{
+    if (threads < 1) threads = 1;
+    if (threads > maxThreads) threads = maxThreads;
+    epicsMutexLock(generate_lock);
+    while (static_cast<int>(workers.size()) < threads)
+    {
+        xsp3SimWorker worker;
+        worker.sim = this;
+        worker.index = workers.size();
+        worker.start = epicsEventMustCreate(epicsEventEmpty);
+        worker.done = epicsEventMustCreate(epicsEventEmpty);
+        workers.push_back(worker);
+        epicsThreadCreate("XSP3SimWorker", epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)xsp3SimWorkerTaskC, &workers.back());
+    }
+    num_threads = threads;
+    epicsMutexUnlock(generate_lock);
+}
+
+/**
+ * Set how many frames the background thread may generate ahead of the
+ * last frame read. Reads of frames that are not in the ring yet are
+ * generated on demand, so 0 turns the ring off.
+ *
+ * @param frames The number of frames in the ring
+ */
+void xsp3Simulator::setRingFrames(int frames)
+{
+    if (frames < 0) frames = 0;
+    epicsMutexLock(generate_lock);
+    epicsMutexLock(ring_lock);
+    ring_frames = frames;
+    ring_hist.assign(static_cast<size_t>(frames) * num_detectors * num_spectra, 0);
+    ring_scal.assign(static_cast<size_t>(frames) * num_detectors * XSP3_SW_NUM_SCALERS, 0);
+    ring_frame.assign(frames, -1);
+    epicsMutexUnlock(ring_lock);
+    epicsMutexUnlock(generate_lock);
+    epicsEventSignal(ring_event);
+}
+
+/**
+ * Set the faults to inject. All zero (and burst_frames 1) is a well
+ * behaved detector. The faults can be changed while the histogram is running.
+ *
+ * @param newFaults The faults
+ */
+void xsp3Simulator::setFaults(const xsp3SimFaults &newFaults)
+{
+    epicsMutexLock(generate_lock);
+    epicsMutexLock(circ_lock);
+    faults = newFaults;
+    if (faults.burst_frames < 1) faults.burst_frames = 1;
+    epicsMutexUnlock(circ_lock);
+    epicsMutexUnlock(generate_lock);
+}
+
+/**
+ * Get the state of the circular buffer in the current, or last, run.
+ *
+ * @param lag The number of completed frames waiting to be acknowledged
+ * @param max_lag The most frames that have been waiting at once
+ * @param overruns The number of frames overwritten before they were acknowledged
+ */
+void xsp3Simulator::getCircStatus(int *lag, int *max_lag, int *overruns)
+{
+    epicsMutexLock(circ_lock);
+    *lag = circ_buffer ? current_frame - circ_oldest : 0;
+    *max_lag = circ_max_lag;
+    *overruns = circ_overruns;
+    epicsMutexUnlock(circ_lock);
+}
+
+/**
+ * Get the number of frames acknowledged in the current, or last, run. A
+ * frame acknowledged twice is counted twice, so this can be compared with
+ * the frames read to check each was only acknowledged once.
+ *
+ * @return The frames acknowledged
+ */
+int xsp3Simulator::getCircAcks()
+{
+    epicsMutexLock(circ_lock);
+    int acks = circ_acks;
+    epicsMutexUnlock(circ_lock);
+    return acks;
+}
+
+/**
+ * Bring the circular buffer up to date with the frames that have completed.
+ * If the driver has fallen more than circ_frames behind, the oldest frames
+ * have been overwritten so they can no longer be acknowledged.
+ */
+void xsp3Simulator::updateCirc()
+{
+    if (!circ_buffer || circ_frames <= 0) return;
+    epicsMutexLock(circ_lock);
+    int lost = current_frame - circ_frames - circ_oldest;
+    if (lost > 0)
+    {
+        circ_overruns += lost;
+        if (lost >= circ_frames)
+            circ_acked.assign(circ_frames, 0);
+        else
+            for (int frame = circ_oldest; frame < circ_oldest + lost; frame++)
+                circ_acked[frame % circ_frames] = 0;
+        circ_oldest += lost;
+        while (circ_oldest < current_frame && circ_acked[circ_oldest % circ_frames])
+            circ_acked[circ_oldest++ % circ_frames] = 0;
+    }
+    if (current_frame - circ_oldest > circ_max_lag)
+        circ_max_lag = current_frame - circ_oldest;
+    epicsMutexUnlock(circ_lock);
+}
+
+/**
+ * Decide whether a fault happens to a frame. The same frame always gets
+ * the same answer, so a dropped frame stays dropped however it is read.
+ */
+bool xsp3Simulator::frameChance(unsigned frame, unsigned salt, double rate)
+{
+    if (rate <= 0.0) return false;
+    uint64_t hash = xsp3SimMix((static_cast<uint64_t>(salt) << 32) | frame);
+    return (hash >> 11) * (1.0/9007199254740992.0) < rate;
+}
+
+/**
+ * Decide whether a read call fails
+ */
+bool xsp3Simulator::readFails()
+{
+    bool fails = false;
+    epicsMutexLock(circ_lock);
+    if (faults.error_rate > 0.0)
+    {
+        error_state = xsp3SimMix(error_state);
+        fails = (error_state >> 11) * (1.0/9007199254740992.0) < faults.error_rate;
+    }
+    epicsMutexUnlock(circ_lock);
+    return fails;
+}
+
+/**
+ * Forget the frames in the ring and start generating from frame 0
+ */
+void xsp3Simulator::clearRing()
+{
+    epicsMutexLock(generate_lock);
+    epicsMutexLock(ring_lock);
+    ring_frame.assign(ring_frames, -1);
+    ring_next = 0;
+    read_next = 0;
+    epicsMutexUnlock(ring_lock);
+    epicsMutexUnlock(generate_lock);
+    epicsEventSignal(ring_event);
+}
+
+void xsp3Simulator::workerTask(xsp3SimWorker *worker)
+{
+    while (1)
+    {
+        epicsEventWait(worker->start);
+        if (workers_exiting) break;
+        generateChannels(current_job, worker->index, num_threads);
+        epicsEventSignal(worker->done);
+    }
+    epicsEventSignal(worker->done);
+}
+
+/**
+ * Generate a job, splitting the channels between the worker threads.
+ * This must be called with generate_lock held.
+ */
+void xsp3Simulator::generate(const xsp3SimJob &job)
+{
+    if (num_threads <= 1 || job.num_chan <= 1)
+    {
+        generateChannels(job, 0, 1);
+    }
+    else
+    {
+        current_job = job;
+        for (int w = 0; w < num_threads; w++)
+            epicsEventSignal(workers[w].start);
+        for (int w = 0; w < num_threads; w++)
+            epicsEventWait(workers[w].done);
+    }
+}
+
+/**
+ * Generate every step'th channel of a job, starting at first. Each channel
+ * does all its frames in turn so the element only makes each frame once.
+ */
+void xsp3Simulator::generateChannels(const xsp3SimJob &job, int first, int step)
+{
+    uint32_t scalers[XSP3_SW_NUM_SCALERS];
+    for (unsigned int i = first; i < job.num_chan; i += step)
+    {
+        xsp3SimElement &det = detectors[job.chan + i];
+        for (unsigned int f = 0; f < job.num_tf; f++)
+        {
+            unsigned int row = f*job.num_chan + i;
+            if (frameChance(job.tf+f, 1, faults.drop_rate))
+            {
+                if (job.hist != NULL)
+                    memset(job.hist + row*job.num_eng, 0, job.num_eng*sizeof(uint32_t));
+                if (job.dtc_hist != NULL)
+                    memset(job.dtc_hist + row*job.num_eng, 0, job.num_eng*sizeof(double));
+                if (job.scal != NULL)
+                    memset(job.scal + row*XSP3_SW_NUM_SCALERS, 0, XSP3_SW_NUM_SCALERS*sizeof(uint32_t));
+                if (job.dtc_scal != NULL)
+                    memset(job.dtc_scal + row*XSP3_SW_NUM_SCALERS, 0, XSP3_SW_NUM_SCALERS*sizeof(double));
+                continue;
+            }
+            if (job.hist != NULL)
+                det.generateRawSpectra( job.tf+f, job.eng, job.num_eng, job.hist + row*job.num_eng );
+            if (job.dtc_hist != NULL)
+                det.generateDTCSpectra( job.tf+f, job.eng, job.num_eng, job.dtc_hist + row*job.num_eng );
+            if (job.scal != NULL)
+                det.generateScalers( job.tf+f, job.scal + row*XSP3_SW_NUM_SCALERS );
+            if (job.dtc_scal != NULL)
+            {
+                det.generateScalers( job.tf+f, scalers );
+                for (int scaler = 0; scaler < XSP3_SW_NUM_SCALERS; scaler++ )
+                    job.dtc_scal[row*XSP3_SW_NUM_SCALERS + scaler] = scalers[scaler];
+            }
+        }
+    }
+}
+
+/**
+ * Copy one frame of a job out of the ring, if it is there
+ *
+ * @return true if the frame was in the ring
+ */
+bool xsp3Simulator::readRing(const xsp3SimJob &job, unsigned frame)
+{
+    bool found = false;
+    epicsMutexLock(ring_lock);
+    if (ring_frames > 0 && ring_frame[frame % ring_frames] == static_cast<int>(frame))
+    {
+        size_t slot = frame % ring_frames;
+        unsigned int f = frame - job.tf;
+        for (unsigned int i = 0; i < job.num_chan; i++)
+        {
+            unsigned int row = f*job.num_chan + i;
+            const uint32_t *hist = &ring_hist[(slot*num_detectors + job.chan + i)*num_spectra + job.eng];
+            const uint32_t *scal = &ring_scal[(slot*num_detectors + job.chan + i)*XSP3_SW_NUM_SCALERS];
+            if (job.hist != NULL)
+                memcpy(job.hist + row*job.num_eng, hist, job.num_eng*sizeof(uint32_t));
+            if (job.dtc_hist != NULL)
+                for (unsigned int bin = 0; bin < job.num_eng; bin++)
+                    job.dtc_hist[row*job.num_eng + bin] = hist[bin];
+            if (job.scal != NULL)
+                memcpy(job.scal + row*XSP3_SW_NUM_SCALERS, scal, XSP3_SW_NUM_SCALERS*sizeof(uint32_t));
+            if (job.dtc_scal != NULL)
+                for (int scaler = 0; scaler < XSP3_SW_NUM_SCALERS; scaler++)
+                    job.dtc_scal[row*XSP3_SW_NUM_SCALERS + scaler] = scal[scaler];
+        }
+        found = true;
+    }
+    epicsMutexUnlock(ring_lock);
+    return found;
+}
+
+/**
+ * Fill in a job, taking frames from the ring while they are there and
+ * generating the rest, then let the ring move on past them.
+ */
+void xsp3Simulator::read(const xsp3SimJob &job)
+{
+    unsigned int f = 0;
+    while (f < job.num_tf && readRing(job, job.tf + f))
+        f++;
+    if (f < job.num_tf)
+    {
+        // The rest are generated directly. They come out the same as the
+        // ring would have had them, so there is no need to look again.
+        xsp3SimJob rest = job;
+        unsigned int skip = f*job.num_chan;
+        rest.tf = job.tf + f;
+        rest.num_tf = job.num_tf - f;
+        if (rest.hist != NULL) rest.hist += skip*job.num_eng;
+        if (rest.dtc_hist != NULL) rest.dtc_hist += skip*job.num_eng;
+        if (rest.scal != NULL) rest.scal += skip*XSP3_SW_NUM_SCALERS;
+        if (rest.dtc_scal != NULL) rest.dtc_scal += skip*XSP3_SW_NUM_SCALERS;
+        epicsMutexLock(generate_lock);
+        generate(rest);
+        epicsMutexUnlock(generate_lock);
+    }
+    epicsMutexLock(ring_lock);
+    if (static_cast<int>(job.tf + job.num_tf) > read_next)
+        read_next = job.tf + job.num_tf;
+    epicsMutexUnlock(ring_lock);
+    epicsEventSignal(ring_event);
+}
+
+/**
+ * When there are new frame callbacks and frames complete in real time, bring
+ * the frames up to date and call back for any that have completed, as the
+ * receive threads of the real API would. Otherwise frames only complete when
+ * the progress is checked.
+ */
+void xsp3Simulator::checkCallbacks()
+{
+    epicsMutexLock(callback_lock);
+    bool callbacks = has_callbacks;
+    epicsMutexUnlock(callback_lock);
+    if (!callbacks || !running || !timedFrames()) return;
+    epicsMutexLock(circ_lock);
+    completeFrames();
+    updateCirc();
+    epicsMutexUnlock(circ_lock);
+    callBackFrames();
+}
+
+/**
+ * Generate frames into the ring while the histogram is running, staying
+ * no more than ring_frames ahead of the reader.
+ */
+void xsp3Simulator::ringTask()
+{
+    xsp3SimJob job;
+    while (!exiting)
+    {
+        epicsEventWaitWithTimeout(ring_event, 0.01);
+        while (!exiting && running)
+        {
+            checkCallbacks();
+            epicsMutexLock(generate_lock);
+            epicsMutexLock(ring_lock);
+            // Frames the reader has already got past are not worth generating
+            int frame = std::max(ring_next, read_next);
+            bool ahead = (ring_frames == 0) || (frame >= read_next + ring_frames) ||
+                         (num_frames > 0 && frame >= num_frames);
+            size_t slot = ahead ? 0 : frame % ring_frames;
+            if (!ahead)
+                ring_frame[slot] = -1;
+            epicsMutexUnlock(ring_lock);
+            if (ahead)
+            {
+                epicsMutexUnlock(generate_lock);
+                break;
+            }
+
+            memset(&job, 0, sizeof(job));
+            job.tf = frame;
+            job.num_eng = num_spectra;
+            job.num_chan = num_detectors;
+            job.num_tf = 1;
+            job.hist = &ring_hist[slot*num_detectors*num_spectra];
+            job.scal = &ring_scal[slot*num_detectors*XSP3_SW_NUM_SCALERS];
+            generate(job);
+
+            epicsMutexLock(ring_lock);
+            ring_frame[slot] = frame;
+            ring_next = frame + 1;
+            epicsMutexUnlock(ring_lock);
+            epicsMutexUnlock(generate_lock);
+        }
+    }
+    epicsEventSignal(ring_exited);
+}
+
+/**
+ * Set the input count rate of a simulated channel. Once any channel has a
+ * count rate the spectra and scalers are generated from the rates, and the
+ * frames complete in real time at the frame time set up with the ITFG,
+ * whatever the trigger mode. The element is rebuilt with generate_lock held,
+ * so the rate can be changed while the histogram is running.
+ *
+ * @param chan The channel
+ * @param rate The input count rate in counts/s, 0 for the test patterns
+ */
+void xsp3Simulator::setCountRate(int chan, double rate)
+{
+    if ((chan < 0) || (chan >= static_cast<int>(detectors.size()))) return;
+    epicsMutexLock(generate_lock);
+    detectors[chan].setCountRate(rate);
+    rate_driven = false;
+    for (unsigned int i = 0; i < detectors.size(); i++)
+        rate_driven = rate_driven || (detectors[i].getCountRate() > 0.0);
+    epicsMutexUnlock(generate_lock);
+}
+
+/**
+ * Set the frame time of every element, which rebuilds them, so it is done
+ * with generate_lock held.
+ */
+void xsp3Simulator::setFrameTime(double time)
+{
+    epicsMutexLock(generate_lock);
+    frame_time = time;
+    for (unsigned int i = 0; i < detectors.size(); i++)
+        detectors[i].setFrameTime(frame_time);
+    epicsMutexUnlock(generate_lock);
 }
 
 int xsp3Simulator::xsp3Api_clocks_setup(int path, int card, int clk_src, int flags, int tp_type)
@@ -33,6 +507,11 @@ int xsp3Simulator::xsp3Api_close(int path)
 
 int xsp3Simulator::xsp3Api_config(int ncards, int num_tf, char* baseIPaddress, int basePort, char* baseMACaddress, int nchan, int createmodule, char* modname, int debug, int card_index)
 {
+    // The frames configured are the size of the circular buffer
+    epicsMutexLock(circ_lock);
+    circ_frames = num_tf;
+    circ_acked.assign(num_tf > 0 ? num_tf : 0, 0);
+    epicsMutexUnlock(circ_lock);
     return this->handle;
 }
 
@@ -77,26 +556,15 @@ int xsp3Simulator::xsp3Api_hist_dtc_read4d(int path, double *hist_buff, double *
                                            unsigned eng, unsigned aux, unsigned chan, unsigned tf,
                                            unsigned num_eng, unsigned num_aux, unsigned num_chan, unsigned num_tf)
 {
-    for (unsigned int frame = tf; frame < tf + num_tf; frame++ )
-    {
-        for (unsigned int i = chan; i < chan + num_chan; i++)
-        {
-            detectors[i].generateDTCSpectra( frame, eng, num_eng, hist_buff );
-            hist_buff += num_eng;
-
-            if (scal_buff != NULL)
-            {
-                for (int scaler = 0; scaler < XSP3_SW_NUM_SCALERS; scaler++ )
-                    scal_buff[scaler] = 0.0;
-
-                scal_buff[5]=detectors[i].generateDTCROI(frame, 0 );
-                scal_buff[6]=detectors[i].generateDTCROI(frame, 1 );
-
-                scal_buff += XSP3_SW_NUM_SCALERS;
-            }
-        }
-    }
-
+    xsp3SimJob job;
+    memset(&job, 0, sizeof(job));
+    if (chan + num_chan > detectors.size()) return XSP3_RANGE_CHECK;
+    job.eng = eng; job.chan = chan; job.tf = tf;
+    job.num_eng = num_eng; job.num_chan = num_chan; job.num_tf = num_tf;
+    job.dtc_hist = hist_buff;
+    job.dtc_scal = scal_buff;
+    if (readFails()) return XSP3_ERROR;
+    read(job);
     return XSP3_OK;
 }
 
@@ -105,6 +573,24 @@ int xsp3Simulator::xsp3Api_histogram_clear(int path, int first_chan, int num_cha
     return XSP3_OK;
 }
 
+int xsp3Simulator::xsp3Api_histogram_circ_ack(int path, int chan, int frame, int num_chan, int num_frames)
+{
+    if (!circ_buffer || circ_frames <= 0) return XSP3_OK;
+    if (chan < 0 || num_chan < 0 || static_cast<unsigned>(chan + num_chan) > detectors.size()) return XSP3_RANGE_CHECK;
+    // Every channel is acknowledged together, so only the frames are tracked.
+    // Frames that are already acknowledged, or have been overwritten, are ignored.
+    epicsMutexLock(circ_lock);
+    circ_acks += std::max(num_frames, 0);
+    int first = std::max(frame, circ_oldest);
+    int last = std::min(frame + num_frames, circ_oldest + circ_frames);
+    for (int f = first; f < last; f++)
+        circ_acked[f % circ_frames] = 1;
+    while (circ_oldest < current_frame && circ_acked[circ_oldest % circ_frames])
+        circ_acked[circ_oldest++ % circ_frames] = 0;
+    epicsMutexUnlock(circ_lock);
+    return XSP3_OK;
+}
+
 int xsp3Simulator::xsp3Api_histogram_continue(int path, int card)
 {
     return XSP3_OK;
@@ -122,32 +608,56 @@ int xsp3Simulator::xsp3Api_histogram_arm(int path, int card)
 
 int xsp3Simulator::xsp3Api_histogram_is_any_busy(int path)
 {
-    //TODO: Occasionally return busy (1).
-    return 0;
+    epicsMutexLock(circ_lock);
+    double busy_time = faults.busy_time;
+    epicsMutexUnlock(circ_lock);
+    return (epicsTime::getCurrent() - busyStart) < busy_time ? 1 : 0;
 }
 
 int xsp3Simulator::xsp3Api_histogram_read4d(int path, uint32_t *buffer, unsigned eng, unsigned aux, unsigned chan, unsigned tf, unsigned num_eng, unsigned num_aux, unsigned num_chan, unsigned num_tf)
 {
-    for (unsigned int frame = tf; frame < tf + num_tf; frame++ )
-    {
-        for (unsigned int i = chan; i < chan + num_chan; i++)
-        {
-            detectors[i].generateRawSpectra( frame, eng, num_eng, buffer );
-            buffer += num_eng;
-        }
-    }
+    xsp3SimJob job;
+    memset(&job, 0, sizeof(job));
+    if (chan + num_chan > detectors.size()) return XSP3_RANGE_CHECK;
+    job.eng = eng; job.chan = chan; job.tf = tf;
+    job.num_eng = num_eng; job.num_chan = num_chan; job.num_tf = num_tf;
+    job.hist = buffer;
+    if (readFails()) return XSP3_ERROR;
+    read(job);
     return XSP3_OK;
 }
 
 int xsp3Simulator::xsp3Api_histogram_start(int path, int card)
 {
-    scanStart = epicsTime::getCurrent();
+    clearRing();
+    epicsMutexLock(circ_lock);
+    circ_buffer = (runFlags & XSP3_RUN_FLAGS_CIRCULAR_BUFFER) != 0;
+    circ_acked.assign(circ_frames > 0 ? circ_frames : 0, 0);
+    circ_oldest = 0;
+    circ_max_lag = 0;
+    circ_overruns = 0;
+    circ_acks = 0;
     current_frame=0;
+    epicsMutexUnlock(circ_lock);
+    epicsMutexLock(mem_lock);
+    mem_frame.assign(mem_frame.size(), -1);
+    epicsMutexUnlock(mem_lock);
+    epicsMutexLock(callback_lock);
+    frames_called_back = 0;
+    epicsMutexUnlock(callback_lock);
+    scanStart = epicsTime::getCurrent();
+    busyStart = scanStart;
+    running = true;
+    epicsEventSignal(ring_event);
     return XSP3_OK;
 }
 
 int xsp3Simulator::xsp3Api_histogram_stop(int path, int card)
 {
+    // Frames stop completing, so the frame counter holds where it is
+    xsp3Api_scaler_check_progress(path);
+    running = false;
+    busyStart = epicsTime::getCurrent();
     return XSP3_OK;
 }
 
@@ -163,14 +673,78 @@ int xsp3Simulator::xsp3Api_save_settings(int path, char *dir_name)
 
 int xsp3Simulator::xsp3Api_scaler_check_progress(int path)
 {
-    if ( timeRegister.trigger == xsp3TimeRegister::Internal )
-    {
-        current_frame = (epicsTime::getCurrent() - scanStart)/frame_time ;
-        if (current_frame > num_frames) current_frame = num_frames;
-    } else {
+    int frames;
+    epicsMutexLock(circ_lock);
+    if (timedFrames())
+        completeFrames();
+    else
         current_frame+= ((current_frame+1)%10);
+    updateCirc();
+    frames = current_frame;
+    epicsMutexUnlock(circ_lock);
+    callBackFrames();
+    return frames;
+}
+
+/**
+ * Whether frames complete in real time, at the frame time set up with the
+ * ITFG, rather than each time the progress is checked
+ */
+bool xsp3Simulator::timedFrames()
+{
+    return timeRegister.trigger == xsp3TimeRegister::Internal || (rate_driven && frame_time > 0.0);
+}
+
+/**
+ * Move current_frame on to the last frame that has completed in real time.
+ * This must be called with circ_lock held.
+ */
+void xsp3Simulator::completeFrames()
+{
+    if (!running) return;
+    // A frame is available once it and every frame before it has
+    // completed, so one late frame holds back the ones after it
+    // and they then all arrive together.
+    double elapsed = epicsTime::getCurrent() - scanStart;
+    int frame = current_frame;
+    while (frame < num_frames)
+    {
+        double complete = (frame + 1) * frame_time;
+        if (frameChance(frame, 2, faults.delay_rate))
+            complete += faults.delay_time;
+        if (complete > elapsed) break;
+        frame++;
+    }
+    if (frame < num_frames)
+        frame -= frame % faults.burst_frames;
+    if (frame > current_frame) current_frame = frame;
+}
+
+/**
+ * Make the new frame callbacks for the frames that have completed since
+ * the last ones. In circular buffer mode tf is the frame's place in the
+ * buffer and tf_ext counts every frame of the run. The frames are only
+ * generated into histogram memory when xsp3_histogram_get_data_ptr asks
+ * for them, so the buffer passed is always NULL.
+ */
+void xsp3Simulator::callBackFrames()
+{
+    epicsMutexLock(callback_lock);
+    if (has_callbacks)
+    {
+        epicsMutexLock(circ_lock);
+        int frames = current_frame;
+        int buffer_frames = circ_buffer ? circ_frames : 0;
+        epicsMutexUnlock(circ_lock);
+        for (; frames_called_back < frames; frames_called_back++)
+        {
+            int tf = (buffer_frames > 0) ? frames_called_back % buffer_frames : frames_called_back;
+            for (unsigned int chan = 0; chan < num_detectors; chan++)
+                if (new_frame[chan] != NULL)
+                    new_frame[chan](handle, chan, tf, frames_called_back, NULL, new_frame_ptr[chan]);
+        }
     }
-    return current_frame;
+    epicsMutexUnlock(callback_lock);
 }
 
 int xsp3Simulator::xsp3Api_set_glob_timeA(int path, int card, uint32_t time)
@@ -192,6 +766,7 @@ int xsp3Simulator::xsp3Api_set_good_thres(int path, int chan, uint32_t good_thre
 
 int xsp3Simulator::xsp3Api_set_run_flags(int path, int flags)
 {
+    runFlags = flags;
     return XSP3_OK;
 }
 
@@ -204,15 +779,15 @@ int xsp3Simulator::xsp3Api_set_window(int path, int chan, int win, int low, int
 
 int xsp3Simulator::xsp3Api_itfg_setup(int path, int card, int num_tf, uint32_t col_time, int trig_mode, int gap_mode)
 {
-    frame_time = (double) col_time/80E6;
     num_frames = num_tf;
+    setFrameTime((double) col_time/80E6);
     return XSP3_OK;
 }
 
 int xsp3Simulator::xsp3Api_itfg_setup2(int path, int card, int num_tf, uint32_t col_time, int trig_mode, int gap_mode, int acq_in_pause, int marker_period, int marker_frame)
 {
-    frame_time = (double) col_time/80E6;
     num_frames = num_tf;
+    setFrameTime((double) col_time/80E6);
     return XSP3_OK;
 }
 
@@ -233,6 +808,24 @@ int xsp3Simulator::xsp3Api_has_itfg(int path, int card )
 
 int xsp3Simulator::xsp3Api_scaler_read(int path, uint32_t *dest, unsigned scaler, unsigned chan, unsigned t, unsigned n_scalers, unsigned n_chan, unsigned dt)
 {
+    if (scaler + n_scalers > XSP3_SW_NUM_SCALERS || chan + n_chan > detectors.size()) return XSP3_RANGE_CHECK;
+    if (readFails()) return XSP3_ERROR;
+    xsp3SimJob job;
+    memset(&job, 0, sizeof(job));
+    job.chan = chan; job.tf = t;
+    job.num_chan = n_chan; job.num_tf = dt;
+    if (scaler == 0 && n_scalers == XSP3_SW_NUM_SCALERS)
+    {
+        job.scal = dest;
+        read(job);
+        return XSP3_OK;
+    }
+    std::vector<uint32_t> scalers(static_cast<size_t>(dt) * n_chan * XSP3_SW_NUM_SCALERS);
+    job.scal = &scalers[0];
+    read(job);
+    for (size_t row = 0; row < static_cast<size_t>(dt) * n_chan; row++)
+        for (unsigned int j = 0; j < n_scalers; j++)
+            *dest++ = scalers[row*XSP3_SW_NUM_SCALERS + scaler + j];
     return XSP3_OK;
 }
 
@@ -243,6 +836,9 @@ int xsp3Simulator::xsp3Api_get_trigger_b(int path, unsigned chan, Xspress3_Trigg
 
 int xsp3Simulator::xsp3Api_get_dtcfactor(int path, u_int32_t *scaData, double *dtcFactor, double *dtcAllEvent, unsigned chan)
 {
+    // The simulated DTC spectra are the raw spectra, so there is nothing to correct.
+    *dtcFactor = 1.0;
+    *dtcAllEvent = scaData[3];
     return XSP3_OK;
 }
 
@@ -250,3 +846,132 @@ int xsp3Simulator::xsp3Api_get_generation(int path, int card)
 {
     return 0;
 }
+
+/**
+ * Set the callback for each frame that completes on a channel, or on all of
+ * them if chan is negative. NULL removes the callback. The callbacks are
+ * made from the ring thread, so there is no difference between early and
+ * late callbacks.
+ */
+int xsp3Simulator::xsp3Api_histogram_set_new_frame_callback(int path, int chan, xsp3NewFrameCallback callback, void *user_ptr, int late)
+{
+    if (chan >= static_cast<int>(num_detectors))
+        return XSP3_RANGE_CHECK;
+    epicsMutexLock(callback_lock);
+    has_callbacks = false;
+    for (unsigned int c = 0; c < num_detectors; c++)
+    {
+        if (chan < 0 || static_cast<int>(c) == chan)
+        {
+            new_frame[c] = callback;
+            new_frame_ptr[c] = user_ptr;
+        }
+        has_callbacks = has_callbacks || (new_frame[c] != NULL);
+    }
+    epicsMutexUnlock(callback_lock);
+    return XSP3_OK;
+}
+
+int xsp3Simulator::xsp3Api_has_get_data_ptr(int path)
+{
+    return 1;
+}
+
+/**
+ * Point at a frame of a channel in the simulated histogram memory,
+ * generating the frame into it if it is not there already. The channels
+ * of a frame are contiguous, as they are in the hardware. In circular
+ * buffer mode the frame wraps round the buffer, otherwise only the frames
+ * configured are in memory.
+ *
+ * @return The spectrum from bin eng, or NULL if the frame is not in memory
+ */
+u_int32_t* xsp3Simulator::xsp3Api_histogram_get_data_ptr(int path, unsigned eng, unsigned aux, unsigned chan, unsigned tf)
+{
+    if (path != this->handle || chan >= num_detectors || eng >= num_spectra) return NULL;
+    epicsMutexLock(circ_lock);
+    int frames = circ_frames;
+    bool wraps = circ_buffer;
+    epicsMutexUnlock(circ_lock);
+    if (frames <= 0 || (!wraps && tf >= static_cast<unsigned>(frames))) return NULL;
+
+    epicsMutexLock(mem_lock);
+    if (static_cast<int>(mem_frame.size()) != frames)
+    {
+        mem_hist.assign(frames, std::vector<uint32_t>());
+        mem_frame.assign(frames, -1);
+    }
+    size_t slot = tf % frames;
+    std::vector<uint32_t> &hist = mem_hist[slot];
+    if (mem_frame[slot] != static_cast<int>(tf))
+    {
+        xsp3SimJob job;
+        memset(&job, 0, sizeof(job));
+        hist.resize(static_cast<size_t>(num_detectors) * num_spectra);
+        job.tf = tf;
+        job.num_eng = num_spectra;
+        job.num_chan = num_detectors;
+        job.num_tf = 1;
+        job.hist = &hist[0];
+        read(job);
+        mem_frame[slot] = tf;
+    }
+    u_int32_t *data = &hist[static_cast<size_t>(chan) * num_spectra + eng];
+    epicsMutexUnlock(mem_lock);
+    return data;
+}
+
+int xsp3Simulator::xsp3Api_has_roi(int path, int chan)
+{
+    return 1;
+}
+
+/**
+ * Set the hardware ROIs of a channel, or all of them if chan is negative.
+ * The bins from lhs up to rhs of each ROI are spread over its out_bins in
+ * turn, and everything outside the ROIs goes in the bin after them.
+ *
+ * @return The number of bins used, or XSP3_RANGE_CHECK
+ */
+int xsp3Simulator::xsp3Api_set_roi(int path, int chan, int num_roi, XSP3Roi *roi)
+{
+    int total = 0;
+    if (chan >= static_cast<int>(num_detectors) || num_roi < 0)
+        return XSP3_RANGE_CHECK;
+    for (int r = 0; r < num_roi; r++)
+    {
+        if (roi[r].lhs < 0 || roi[r].rhs <= roi[r].lhs || roi[r].rhs > static_cast<int>(num_spectra) || roi[r].out_bins < 1)
+            return XSP3_RANGE_CHECK;
+        total += roi[r].out_bins;
+    }
+    if (total >= static_cast<int>(num_spectra))
+        return XSP3_RANGE_CHECK;
+
+    std::vector<int> lut(num_spectra, total);
+    int out = 0;
+    for (int r = 0; r < num_roi; r++)
+    {
+        int width = roi[r].rhs - roi[r].lhs;
+        for (int bin = roi[r].lhs; bin < roi[r].rhs; bin++)
+            lut[bin] = out + (bin - roi[r].lhs) * roi[r].out_bins / width;
+        out += roi[r].out_bins;
+    }
+    epicsMutexLock(generate_lock);
+    for (unsigned int c = 0; c < num_detectors; c++)
+        if (chan < 0 || static_cast<int>(c) == chan)
+            detectors[c].setRoiLut(lut);
+    epicsMutexUnlock(generate_lock);
+    return total + 1;
+}
+
+int xsp3Simulator::xsp3Api_init_roi(int path, int chan)
+{
+    if (chan >= static_cast<int>(num_detectors))
+        return XSP3_RANGE_CHECK;
+    epicsMutexLock(generate_lock);
+    for (unsigned int c = 0; c < num_detectors; c++)
+        if (chan < 0 || static_cast<int>(c) == chan)
+            detectors[c].setRoiLut(std::vector<int>());
+    epicsMutexUnlock(generate_lock);
+    return XSP3_OK;
+}
@@ -31,6 +31,52 @@
 #include "xsp3TimeRegister.h"
 #include <vector>
 #include "epicsTime.h"
+#include "epicsMutex.h"
+#include "epicsEvent.h"
+#include "epicsThread.h"
+
+class xsp3Simulator;
+
+/**
+ * A block of frames and channels for the simulator to generate. Any of
+ * the destinations can be NULL. They are laid out [num_tf][num_chan][...]
+ * as the read4d and scaler_read calls return them.
+ */
+struct xsp3SimJob
+{
+    unsigned eng, chan, tf;
+    unsigned num_eng, num_chan, num_tf;
+    uint32_t *hist;
+    double *dtc_hist;
+    uint32_t *scal;
+    double *dtc_scal;
+};
+
+/**
+ * Faults for the simulator to inject. Rates are fractions (0 to 1) of
+ * frames or calls, times are in seconds.
+ */
+struct xsp3SimFaults
+{
+    double busy_time;       // Report busy for this long after a start or stop
+    double delay_rate;      // Fraction of frames that complete late...
+    double delay_time;      // ...by this long, holding back the frames after them
+    int burst_frames;       // Frames only become available this many at a time
+    double drop_rate;       // Fraction of frames whose data is lost, reading as 0
+    double error_rate;      // Fraction of read calls that return XSP3_ERROR
+};
+
+/**
+ * A simulator worker thread, which generates every step'th channel of
+ * the current job.
+ */
+struct xsp3SimWorker
+{
+    xsp3Simulator *sim;
+    int index;
+    epicsEventId start;
+    epicsEventId done;
+};
 
 class xsp3Simulator: public xsp3Api {
 // Construction
@@ -38,6 +84,19 @@ public:
     xsp3Simulator( asynUser * user, int max_detectors, int max_spectra);
     virtual ~xsp3Simulator();
 
+    void setCountRate(int chan, double rate);
+    void setNumThreads(int threads);
+    void setRingFrames(int frames);
+    void setFaults(const xsp3SimFaults &faults);
+    void getCircStatus(int *lag, int *max_lag, int *overruns);
+    int getCircAcks();
+
+    void workerTask(xsp3SimWorker *worker);
+    void ringTask();
+
+    /** The most worker threads that can generate data in parallel */
+    static const int maxThreads = 16;
+
 protected:
     virtual int xsp3Api_clocks_setup(int path, int card, int clk_src, int flags, int tp_type);
     virtual int xsp3Api_close(int path);
@@ -52,6 +111,7 @@ protected:
                                         unsigned eng, unsigned aux, unsigned chan, unsigned tf,
                                         unsigned num_eng, unsigned num_aux, unsigned num_chan, unsigned num_tf);
     virtual int xsp3Api_histogram_clear(int path, int first_chan, int num_chan, int first_frame, int num_frames);
+    virtual int xsp3Api_histogram_circ_ack(int path, int chan, int frame, int num_chan, int num_frames);
     virtual int xsp3Api_histogram_continue(int path, int card);
     virtual int xsp3Api_histogram_pause(int path, int card);
     virtual int xsp3Api_histogram_arm(int path, int card);
@@ -78,6 +138,12 @@ protected:
     virtual int xsp3Api_get_trigger_b(int path, unsigned chan, Xspress3_TriggerB *trig_b);
     virtual int xsp3Api_get_dtcfactor(int path, u_int32_t *scaData, double *dtcFactor, double *dtcAllEvent, unsigned chan);
     virtual int xsp3Api_get_generation(int path, int card);
+    virtual int xsp3Api_histogram_set_new_frame_callback(int path, int chan, xsp3NewFrameCallback new_frame, void *user_ptr, int late);
+    virtual int xsp3Api_has_get_data_ptr(int path);
+    virtual u_int32_t* xsp3Api_histogram_get_data_ptr(int path, unsigned eng, unsigned aux, unsigned chan, unsigned tf);
+    virtual int xsp3Api_has_roi(int path, int chan);
+    virtual int xsp3Api_set_roi(int path, int chan, int num_roi, XSP3Roi *roi);
+    virtual int xsp3Api_init_roi(int path, int chan);
 
 private:
     std::vector<xsp3SimElement> detectors;
@@ -88,7 +154,84 @@ private:
     int num_frames;
     xsp3TimeRegister timeRegister;
     int current_frame;
+    bool running;
+    bool rate_driven;
     epicsTime scanStart;
+
+    void generate(const xsp3SimJob &job);
+    void generateChannels(const xsp3SimJob &job, int first, int step);
+    bool readRing(const xsp3SimJob &job, unsigned frame);
+    void read(const xsp3SimJob &job);
+    void clearRing();
+    bool frameChance(unsigned frame, unsigned salt, double rate);
+    bool readFails();
+    void updateCirc();
+    void setFrameTime(double time);
+    bool timedFrames();
+    void completeFrames();
+    void callBackFrames();
+    void checkCallbacks();
+
+    xsp3SimFaults faults;               // Written with generate_lock and circ_lock held, so either can be held to read them
+    epicsTime busyStart;
+    uint64_t error_state;
+
+    // Parallel generation. generate_lock is held while the workers, or
+    // anything else, generate data so the element frame caches are only
+    // used by one thread at a time. Lock order is generate_lock, ring_lock.
+    epicsMutexId generate_lock;
+    std::vector<xsp3SimWorker> workers;
+    int num_threads;
+    xsp3SimJob current_job;
+    bool exiting;                       // Tells the ring thread to exit
+    bool workers_exiting;               // Tells the workers to exit, once the ring thread has
+
+    // Frames generated ahead on a background thread, like the DMA engine
+    // filling histogram memory, up to ring_frames past the last frame read.
+    epicsMutexId ring_lock;
+    epicsEventId ring_event;
+    epicsEventId ring_exited;           // Signalled by the ring thread as it exits
+    int ring_frames;
+    std::vector<uint32_t> ring_hist;    // [slot][detector][num_spectra]
+    std::vector<uint32_t> ring_scal;    // [slot][detector][XSP3_SW_NUM_SCALERS]
+    std::vector<int> ring_frame;        // The frame in each slot, -1 if none
+    int ring_next;                      // The next frame to pre-generate
+    int read_next;                      // The first frame not read yet
+    unsigned int num_spectra;
+
+    // Circular buffer mode, with the XSP3_RUN_FLAGS_CIRCULAR_BUFFER run flag.
+    // The detector memory holds circ_frames frames and a frame's memory can
+    // only be reused once it has been acknowledged. Frames that complete
+    // while the oldest unacknowledged frame still holds their memory
+    // overwrite it and are counted as overruns.
+    epicsMutexId circ_lock;
+    bool circ_buffer;
+    int circ_frames;
+    std::vector<char> circ_acked;       // [circ_frames] frames acked out of order
+    int circ_oldest;                    // The first frame not acknowledged yet
+    int circ_max_lag;                   // The most frames waiting to be acknowledged
+    int circ_overruns;                  // The number of frames overwritten
+    int circ_acks;                      // The number of frames acknowledged, counting repeats
+
+    // Histogram memory for xsp3_histogram_get_data_ptr, one frame of every
+    // detector per slot, laid out [detector][num_spectra] like the hardware.
+    // There is a slot for each frame configured, which in circular buffer
+    // mode is the buffer, and each is only allocated when a pointer into it
+    // is first asked for. A frame is generated into its slot the first time
+    // it is pointed at and stays there until another frame reuses the slot.
+    // Lock order is mem_lock, generate_lock.
+    epicsMutexId mem_lock;
+    std::vector<std::vector<uint32_t> > mem_hist;   // [slot][detector][num_spectra]
+    std::vector<int> mem_frame;         // The frame in each slot, -1 if none
+
+    // New frame callbacks, made from the ring thread as the frames complete,
+    // or from whichever thread checks the progress. callback_lock is held
+    // while they are made, so each frame is only called back once and in order.
+    epicsMutexId callback_lock;
+    std::vector<xsp3NewFrameCallback> new_frame;    // [detector], NULL for no callback
+    std::vector<void*> new_frame_ptr;               // [detector] The user_ptr for new_frame
+    bool has_callbacks;                 // Any detector has a callback
+    int frames_called_back;             // The first frame not called back yet
 };
 
 #endif /* XSP3SIMULATOR_H */
@@ -0,0 +1,97 @@
+#include "xsp3Spectrum.h"
+
+/**
+ * Pack a raw spectrum into 16 bits, clipping any bin that does not fit.
+ *
+ * @param pRaw The raw spectrum
+ * @param numBins The number of bins in the spectrum
+ * @param pCompact The 16 bit spectrum
+ *
+ * @return The number of bins that were clipped
+ */
+int xsp3Spectrum::saturate(const u_int32_t *pRaw, int numBins, epicsUInt16 *pCompact)
+{
+    const u_int32_t maxCount = 0xFFFF;
+    int overflows = 0;
+    for (int i=0; i<numBins; i++) {
+        u_int32_t count = pRaw[i];
+        overflows += (count > maxCount);
+        pCompact[i] = static_cast<epicsUInt16>((count > maxCount) ? maxCount : count);
+    }
+    return overflows;
+}
+
+/**
+ * Sum each group of factor adjacent bins into one bin, in place. The
+ * result is packed at the start of pSpectra. As the channels of a frame
+ * are contiguous a whole frame can be rebinned in one call, provided the
+ * number of bins per channel is a multiple of factor.
+ *
+ * @param pSpectra The spectra, numBins*factor bins on entry and numBins on return
+ * @param numBins The number of bins after rebinning
+ * @param factor The number of bins to sum into each bin
+ */
+template <typename T> static void rebinInPlace(T *pSpectra, int numBins, int factor)
+{
+    if (factor == 2) {
+        // The usual case, written so the compiler can vectorise it
+        for (int i=0; i<numBins; i++) {
+            pSpectra[i] = pSpectra[2*i] + pSpectra[2*i+1];
+        }
+        return;
+    }
+    for (int i=0; i<numBins; i++) {
+        const T *pIn = pSpectra + i*factor;
+        T sum = 0;
+        for (int j=0; j<factor; j++) {
+            sum += pIn[j];
+        }
+        pSpectra[i] = sum;
+    }
+}
+
+void xsp3Spectrum::rebin(u_int32_t *pSpectra, int numBins, int factor)
+{
+    rebinInPlace(pSpectra, numBins, factor);
+}
+
+void xsp3Spectrum::rebin(double *pSpectra, int numBins, int factor)
+{
+    rebinInPlace(pSpectra, numBins, factor);
+}
+
+/**
+ * Add spectra to a running sum, bin by bin. As the channels of a frame are
+ * contiguous a whole frame can be added in one call. The sum is double so
+ * it holds every type exactly, up to 2^53 counts in a bin.
+ *
+ * @param pSpectra The spectra to add
+ * @param numBins The number of bins in pSpectra and pSum
+ * @param pSum The running sum
+ */
+template <typename T> static void addInto(const T *pSpectra, int numBins, double *pSum)
+{
+    for (int i=0; i<numBins; i++) {
+        pSum[i] += static_cast<double>(pSpectra[i]);
+    }
+}
+
+void xsp3Spectrum::accumulate(const u_int32_t *pSpectra, int numBins, double *pSum)
+{
+    addInto(pSpectra, numBins, pSum);
+}
+
+void xsp3Spectrum::accumulate(const epicsUInt16 *pSpectra, int numBins, double *pSum)
+{
+    addInto(pSpectra, numBins, pSum);
+}
+
+void xsp3Spectrum::accumulate(const double *pSpectra, int numBins, double *pSum)
+{
+    addInto(pSpectra, numBins, pSum);
+}
+
+void xsp3Spectrum::accumulate(const float *pSpectra, int numBins, double *pSum)
+{
+    addInto(pSpectra, numBins, pSum);
+}
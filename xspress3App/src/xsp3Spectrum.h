@@ -0,0 +1,44 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @brief Kernels that reshape or repack raw Xspress3 spectra in the driver
+ *
+ * These are plain loops over contiguous arrays with no branches that the
+ * compiler cannot turn into selects, so they vectorise.
+ */
+#ifndef XSP3SPECTRUM_H
+#define XSP3SPECTRUM_H
+
+#include <sys/types.h>
+#include <epicsTypes.h>
+
+class xsp3Spectrum {
+public:
+    static int saturate(const u_int32_t *pRaw, int numBins, epicsUInt16 *pCompact);
+    static void rebin(u_int32_t *pSpectra, int numBins, int factor);
+    static void rebin(double *pSpectra, int numBins, int factor);
+    static void accumulate(const u_int32_t *pSpectra, int numBins, double *pSum);
+    static void accumulate(const epicsUInt16 *pSpectra, int numBins, double *pSum);
+    static void accumulate(const double *pSpectra, int numBins, double *pSum);
+    static void accumulate(const float *pSpectra, int numBins, double *pSum);
+};
+
+#endif /* XSP3SPECTRUM_H */
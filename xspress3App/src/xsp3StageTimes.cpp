@@ -0,0 +1,139 @@
+#include "xsp3StageTimes.h"
+#include <string.h>
+
+static const char *stageNames[xsp3StageTimes::NumStages] = {
+    "Read", "Process", "Queue", "Lock", "Scas", "Attributes", "Params", "Plugins"
+};
+
+xsp3StageTimes::xsp3StageTimes()
+{
+    lock_ = epicsMutexMustCreate();
+    this->reset();
+}
+
+xsp3StageTimes::~xsp3StageTimes()
+{
+    epicsMutexDestroy(lock_);
+}
+
+/**
+ * Record the time a stage took.
+ *
+ * @param stage The xsp3StageTimes::Stage
+ * @param start The monotonic time the stage started, from now()
+ *
+ * @return The monotonic time the stage finished, to start the next one from
+ */
+epicsUInt64 xsp3StageTimes::record(int stage, epicsUInt64 start)
+{
+    epicsUInt64 end = now();
+    epicsUInt64 time = (end > start) ? end - start : 0;
+    histogram &hist = current_[stage];
+
+    epicsMutexLock(lock_);
+    if ((hist.count == 0) || (time < hist.min)) hist.min = time;
+    if (time > hist.max) hist.max = time;
+    hist.count++;
+    hist.sum += time;
+    hist.buckets[bucket(time)]++;
+    epicsMutexUnlock(lock_);
+    return end;
+}
+
+/**
+ * Finish the current window, so its statistics are the ones returned by
+ * getStats, and start a new one.
+ */
+void xsp3StageTimes::roll()
+{
+    epicsMutexLock(lock_);
+    memcpy(last_, current_, sizeof(last_));
+    for (int stage=0; stage<NumStages; stage++) {
+        clear(current_[stage]);
+    }
+    epicsMutexUnlock(lock_);
+}
+
+/**
+ * Forget all the times recorded
+ */
+void xsp3StageTimes::reset()
+{
+    epicsMutexLock(lock_);
+    for (int stage=0; stage<NumStages; stage++) {
+        clear(current_[stage]);
+        clear(last_[stage]);
+    }
+    epicsMutexUnlock(lock_);
+}
+
+/**
+ * Get the statistics of a stage over the last window that was rolled.
+ * The 99th percentile is the upper limit of the bucket it falls in, so
+ * it can be up to 25% high, but is never more than the maximum.
+ *
+ * @param stage The xsp3StageTimes::Stage
+ * @param stats The statistics, all 0 if nothing was recorded
+ */
+void xsp3StageTimes::getStats(int stage, xsp3StageStats &stats)
+{
+    epicsUInt64 p99 = 0;
+    epicsMutexLock(lock_);
+    const histogram &hist = last_[stage];
+    stats.count = hist.count;
+    if (hist.count > 0) {
+        // The first bucket that takes the cumulative count to 99%
+        epicsUInt64 target = (hist.count * 99 + 99) / 100;
+        epicsUInt64 total = 0;
+        for (int i=0; i<numBuckets; i++) {
+            total += hist.buckets[i];
+            if (total >= target) {
+                p99 = bucketLimit(i);
+                break;
+            }
+        }
+        if (p99 > hist.max) p99 = hist.max;
+        stats.min = hist.min * 1e-9;
+        stats.mean = (static_cast<double>(hist.sum) / hist.count) * 1e-9;
+        stats.p99 = p99 * 1e-9;
+        stats.max = hist.max * 1e-9;
+    } else {
+        stats.min = stats.mean = stats.p99 = stats.max = 0.0;
+    }
+    epicsMutexUnlock(lock_);
+}
+
+/**
+ * @return The name of a stage, for reports
+ */
+const char *xsp3StageTimes::stageName(int stage)
+{
+    return ((stage >= 0) && (stage < NumStages)) ? stageNames[stage] : "Unknown";
+}
+
+/**
+ * The bucket of a time. Times below 4 ns have a bucket each, above that
+ * there are four per power of two, picked by the two bits after the top one.
+ */
+int xsp3StageTimes::bucket(epicsUInt64 time)
+{
+    if (time < 4) return static_cast<int>(time);
+    int msb = 63 - __builtin_clzll(time);
+    return (msb - 1) * 4 + static_cast<int>((time >> (msb - 2)) & 3);
+}
+
+/**
+ * The largest time that goes in a bucket
+ */
+epicsUInt64 xsp3StageTimes::bucketLimit(int index)
+{
+    if (index < 4) return index;
+    int msb = index / 4 + 1;
+    epicsUInt64 width = 1ULL << (msb - 2);
+    return (4 + (index % 4)) * width + width - 1;
+}
+
+void xsp3StageTimes::clear(histogram &hist)
+{
+    memset(&hist, 0, sizeof(hist));
+}
@@ -0,0 +1,99 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @brief Timing of each stage of the frame readout
+ *
+ * The data and publish tasks time each stage of every frame with the
+ * monotonic clock and record the times here. Each stage keeps a histogram
+ * with four logarithmic buckets per power of two nanoseconds, so recording
+ * a time is a few integer operations and the 99th percentile is known to
+ * within 25% without keeping the samples.
+ *
+ * The times are collected over a window. When the window is rolled the
+ * histograms of the window just finished become the ones the statistics
+ * are worked out from, and a new window is started.
+ */
+#ifndef XSP3STAGETIMES_H
+#define XSP3STAGETIMES_H
+
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsTypes.h>
+
+/**
+ * The statistics of one stage over a window, in seconds
+ */
+struct xsp3StageStats
+{
+    epicsUInt64 count;
+    double min;
+    double mean;
+    double p99;
+    double max;
+};
+
+class xsp3StageTimes {
+public:
+    /** The stages of the readout of a frame, in the order they happen */
+    enum Stage {
+        Read,       //!< Reading a frame, or batch, from the API
+        Process,    //!< Copying, converting and queueing the frames read
+        Queue,      //!< Waiting in the publish queue
+        Lock,       //!< Waiting for the driver lock in the publish task, only if PARAM attributes read the SCAs
+        Scas,       //!< sumRois if the MCA ROIs are enabled, accumulate if XSP3_ACCUMULATE is, storeScas, and writeOutScas if PARAM attributes read the SCAs
+        Attributes, //!< setNDArrayAttributes
+        Params,     //!< Parameter callbacks in the parameter update task
+        Plugins,    //!< NDArray callbacks to the plugins
+        NumStages
+    };
+
+    xsp3StageTimes();
+    ~xsp3StageTimes();
+
+    /** The current time of the monotonic clock, in nanoseconds */
+    static epicsUInt64 now() { return epicsMonotonicGet(); }
+    epicsUInt64 record(int stage, epicsUInt64 start);
+    void roll();
+    void reset();
+    void getStats(int stage, xsp3StageStats &stats);
+    static const char *stageName(int stage);
+
+private:
+    /** Four buckets per power of two up to 2^64 ns */
+    static const int numBuckets = 256;
+
+    struct histogram {
+        epicsUInt64 count;
+        epicsUInt64 sum;
+        epicsUInt64 min;
+        epicsUInt64 max;
+        epicsUInt32 buckets[numBuckets];
+    };
+
+    static int bucket(epicsUInt64 time);
+    static epicsUInt64 bucketLimit(int index);
+    static void clear(histogram &hist);
+
+    epicsMutexId lock_;
+    histogram current_[NumStages];
+    histogram last_[NumStages];
+};
+
+#endif /* XSP3STAGETIMES_H */
@@ -0,0 +1,66 @@
+#include <string>
+#include "xsp3ZeroCopyPool.h"
+#include "xspress3Epics.h"
+
+xsp3ZeroCopyPool::xsp3ZeroCopyPool(Xspress3 *pDriver) :
+    NDArrayPool(pDriver, 0),
+    pDriver_(pDriver)
+{
+    framesLock_ = epicsMutexMustCreate();
+}
+
+xsp3ZeroCopyPool::~xsp3ZeroCopyPool()
+{
+    epicsMutexDestroy(framesLock_);
+}
+
+/**
+ * Allocate an NDUInt32 NDArray that points at a frame of API histogram memory.
+ *
+ * @param dims [maximum number of spectral bins, number of channels]
+ * @param pData The histogram memory for channel 0 of the frame. The other channels must follow contiguously.
+ * @param frameNumber The frame in the current capture that pData belongs to
+ *
+ * @return The NDArray, or NULL if one could not be allocated
+ */
+NDArray *xsp3ZeroCopyPool::wrap(size_t dims[2], u_int32_t *pData, int frameNumber)
+{
+    NDArray *pArray = this->alloc(2, dims, NDUInt32, dims[0] * dims[1] * sizeof(u_int32_t), pData);
+    if (pArray != NULL) {
+        epicsMutexLock(framesLock_);
+        frames_[pArray] = frameNumber;
+        epicsMutexUnlock(framesLock_);
+    }
+    return pArray;
+}
+
+/**
+ * Called by NDArrayPool every time an array is released. Once the last user
+ * has finished with an array made by wrap() the frame it wraps is given back
+ * to the driver, and pData is cleared so the pool never frees or reuses the
+ * API memory. Arrays the pool allocated itself, with copy() for instance,
+ * are left alone.
+ */
+void xsp3ZeroCopyPool::onReleaseArray(NDArray *pArray)
+{
+    std::map<NDArray*, int>::iterator it;
+    bool wrapped = false;
+    int frameNumber = 0;
+
+    if (pArray->getReferenceCount() > 0) return;
+
+    epicsMutexLock(framesLock_);
+    it = frames_.find(pArray);
+    if (it != frames_.end()) {
+        wrapped = true;
+        frameNumber = it->second;
+        frames_.erase(it);
+    }
+    epicsMutexUnlock(framesLock_);
+
+    if (wrapped) {
+        pArray->pData = NULL;
+        pArray->dataSize = 0;
+        pDriver_->ackFrames(frameNumber, 1);
+    }
+}
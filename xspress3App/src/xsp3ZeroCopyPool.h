@@ -0,0 +1,54 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @brief NDArrayPool that wraps the Xspress3 API histogram memory
+ *
+ * NDArrays allocated from this pool point straight at the histogram memory
+ * returned by xsp3_histogram_get_data_ptr rather than at a copy of it. When
+ * the last user releases an array the frame is handed back to the driver,
+ * which acknowledges it in circular buffer mode.
+ */
+#ifndef XSP3ZEROCOPYPOOL_H
+#define XSP3ZEROCOPYPOOL_H
+
+#include <map>
+#include <sys/types.h>
+#include <epicsMutex.h>
+#include "NDArray.h"
+
+class Xspress3;
+
+class xsp3ZeroCopyPool : public NDArrayPool {
+public:
+    xsp3ZeroCopyPool(Xspress3 *pDriver);
+    virtual ~xsp3ZeroCopyPool();
+
+    NDArray *wrap(size_t dims[2], u_int32_t *pData, int frameNumber);
+
+protected:
+    virtual void onReleaseArray(NDArray *pArray);
+
+private:
+    Xspress3 *pDriver_;
+    epicsMutexId framesLock_;
+    std::map<NDArray*, int> frames_; //The hardware frame wrapped by each array in use
+};
+
+#endif /* XSP3ZEROCOPYPOOL_H */
@@ -0,0 +1,359 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @brief Readout throughput benchmark for the Xspress3 driver.
+ *
+ * Runs acquisitions through the whole driver, data task and publish task,
+ * against the simulator and measures what comes out of the NDArray
+ * callbacks, as a plugin would see it. It sweeps the number of channels,
+ * maxSpectra, the data type and the frame rate, and for each combination
+ * reports the sustained frames/s and MB/s, the per-frame latency
+ * percentiles and the CPU used by the process.
+ *
+ * The latency of a frame is from when the simulator completes it (the
+ * start of the acquisition plus frame number times the exposure time) to
+ * when its NDArray callback is made.
+ *
+ * Usage: xspress3Bench [-c channels] [-s spectra] [-t types] [-r rates]
+ *                      [-n frames] [-R count rate]
+ * where channels, spectra, types and rates are comma separated lists,
+ * types are uint32 and/or double and rates are in frames/s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <dbAccess.h>
+#include <asynDriver.h>
+#include <asynDrvUser.h>
+#include <asynGenericPointer.h>
+#include <asynInt32SyncIO.h>
+#include <asynFloat64SyncIO.h>
+
+#include "xspress3Epics.h"
+
+#define BENCH_TIMEOUT 5.0
+
+/**
+ * The frames received by the NDArray callback in one acquisition
+ */
+struct benchResult
+{
+    epicsTime start;
+    double frameTime;
+    int numFrames;
+    int received;
+    double bytes;
+    epicsTime last;
+    std::vector<double> latency;
+    epicsEventId done;
+};
+
+/**
+ * A registration for the NDArray callbacks of a port
+ */
+struct benchArrays
+{
+    asynUser *pasynUser;
+    asynInterface *pGenericPointer;
+    void *interruptPvt;
+};
+
+static void benchArrayCallback(void *userPvt, asynUser *, void *pointer)
+{
+    benchResult *pResult = static_cast<benchResult*>(userPvt);
+    NDArray *pArray = static_cast<NDArray*>(pointer);
+    NDArrayInfo_t arrayInfo;
+    epicsTime now = epicsTime::getCurrent();
+
+    pArray->getInfo(&arrayInfo);
+    pResult->bytes += arrayInfo.totalBytes;
+    pResult->latency.push_back((now - pResult->start) - pArray->uniqueId * pResult->frameTime);
+    pResult->last = now;
+    if (++pResult->received >= pResult->numFrames) {
+        epicsEventSignal(pResult->done);
+    }
+}
+
+/**
+ * Split a comma separated list of numbers
+ */
+static std::vector<double> benchParseList(const char *list)
+{
+    std::vector<double> values;
+    std::string str(list);
+    size_t pos = 0;
+    while (pos <= str.size()) {
+        size_t comma = str.find(',', pos);
+        if (comma == std::string::npos) comma = str.size();
+        if (comma > pos) values.push_back(atof(str.substr(pos, comma - pos).c_str()));
+        pos = comma + 1;
+    }
+    return values;
+}
+
+static double benchCpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+}
+
+static double benchPercentile(const std::vector<double> &sorted, double percent)
+{
+    if (sorted.empty()) return 0.0;
+    size_t index = static_cast<size_t>(percent/100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static asynStatus benchWriteInt32(const char *port, int addr, const char *drvInfo, int value)
+{
+    asynUser *pasynUser;
+    asynStatus status = pasynInt32SyncIO->connect(port, addr, &pasynUser, drvInfo);
+    if (status == asynSuccess) {
+        status = pasynInt32SyncIO->write(pasynUser, value, BENCH_TIMEOUT);
+        pasynInt32SyncIO->disconnect(pasynUser);
+    }
+    if (status != asynSuccess) {
+        fprintf(stderr, "xspress3Bench: failed to write %d to %s on %s\n", value, drvInfo, port);
+    }
+    return status;
+}
+
+static asynStatus benchWriteFloat64(const char *port, int addr, const char *drvInfo, double value)
+{
+    asynUser *pasynUser;
+    asynStatus status = pasynFloat64SyncIO->connect(port, addr, &pasynUser, drvInfo);
+    if (status == asynSuccess) {
+        status = pasynFloat64SyncIO->write(pasynUser, value, BENCH_TIMEOUT);
+        pasynFloat64SyncIO->disconnect(pasynUser);
+    }
+    if (status != asynSuccess) {
+        fprintf(stderr, "xspress3Bench: failed to write %g to %s on %s\n", value, drvInfo, port);
+    }
+    return status;
+}
+
+static int benchReadInt32(const char *port, const char *drvInfo)
+{
+    asynUser *pasynUser;
+    epicsInt32 value = 0;
+    if (pasynInt32SyncIO->connect(port, 0, &pasynUser, drvInfo) == asynSuccess) {
+        pasynInt32SyncIO->read(pasynUser, &value, BENCH_TIMEOUT);
+        pasynInt32SyncIO->disconnect(pasynUser);
+    }
+    return value;
+}
+
+/**
+ * Register for the NDArray callbacks of a port, like a plugin does
+ */
+static asynStatus benchRegisterArrays(const char *port, benchResult *pResult, benchArrays *pArrays)
+{
+    asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+    asynInterface *pDrvUser = NULL, *pGenericPointer = NULL;
+    asynStatus status = pasynManager->connectDevice(pasynUser, port, 0);
+
+    if (status == asynSuccess) {
+        pDrvUser = pasynManager->findInterface(pasynUser, asynDrvUserType, 1);
+        pGenericPointer = pasynManager->findInterface(pasynUser, asynGenericPointerType, 1);
+        if ((pDrvUser == NULL) || (pGenericPointer == NULL)) status = asynError;
+    }
+    if (status == asynSuccess) {
+        status = static_cast<asynDrvUser*>(pDrvUser->pinterface)->create(pDrvUser->drvPvt, pasynUser, NDArrayDataString, NULL, NULL);
+    }
+    if (status == asynSuccess) {
+        status = static_cast<asynGenericPointer*>(pGenericPointer->pinterface)->registerInterruptUser(
+            pGenericPointer->drvPvt, pasynUser, benchArrayCallback, pResult, &pArrays->interruptPvt);
+    }
+    if (status != asynSuccess) {
+        pasynManager->freeAsynUser(pasynUser);
+        return status;
+    }
+    pArrays->pasynUser = pasynUser;
+    pArrays->pGenericPointer = pGenericPointer;
+    return asynSuccess;
+}
+
+/**
+ * Stop the NDArray callbacks registered by benchRegisterArrays, so none
+ * arrive after the results they are counted in have gone
+ */
+static void benchCancelArrays(benchArrays *pArrays)
+{
+    static_cast<asynGenericPointer*>(pArrays->pGenericPointer->pinterface)->cancelInterruptUser(
+        pArrays->pGenericPointer->drvPvt, pArrays->pasynUser, pArrays->interruptPvt);
+    pasynManager->freeAsynUser(pArrays->pasynUser);
+}
+
+/**
+ * Set up the driver on a port for a run, up to but not including starting it
+ */
+static asynStatus benchSetup(const char *port, int numChannels, bool dtc, int numFrames, double frameTime, double countRate)
+{
+    if ((benchWriteInt32(port, 0, xsp3ConnectParamString, 1) != asynSuccess) ||
+        (benchWriteInt32(port, 0, xsp3TriggerModeParamString, 1) != asynSuccess) ||
+        (benchWriteInt32(port, 0, xsp3DtcEnableParamString, dtc ? 1 : 0) != asynSuccess) ||
+        (benchWriteInt32(port, 0, NDArrayCallbacksString, 1) != asynSuccess) ||
+        (benchWriteInt32(port, 0, ADNumImagesString, numFrames) != asynSuccess) ||
+        (benchWriteFloat64(port, 0, ADAcquireTimeString, frameTime) != asynSuccess)) {
+        return asynError;
+    }
+    for (int chan=0; chan<numChannels; chan++) {
+        if (benchWriteFloat64(port, chan, xsp3ChanSimRateParamString, countRate) != asynSuccess) return asynError;
+    }
+    return asynSuccess;
+}
+
+/**
+ * Run one acquisition and print a line of results. Each run gets its own
+ * driver, and asyn port, because ports cannot be deleted.
+ */
+static bool benchRun(int run, int numChannels, int maxSpectra, bool dtc, double rate, int numFrames, double countRate)
+{
+    char port[32];
+    benchResult result;
+    benchArrays arrays;
+    double cpuStart, wall, cpu;
+    int dropped;
+    bool timedOut = false;
+    asynStatus status;
+
+    epicsSnprintf(port, sizeof(port), "BENCH%d", run);
+    new Xspress3(port, numChannels, 1, "127.0.0.1", numFrames, numFrames, maxSpectra, -1, 0, 0, 1, 0);
+
+    result.frameTime = 1.0/rate;
+    result.numFrames = numFrames;
+    result.received = 0;
+    result.bytes = 0.0;
+    result.latency.reserve(numFrames);
+    result.done = epicsEventMustCreate(epicsEventEmpty);
+    if (benchRegisterArrays(port, &result, &arrays) != asynSuccess) {
+        fprintf(stderr, "xspress3Bench: failed to register for arrays on %s\n", port);
+        epicsEventDestroy(result.done);
+        return false;
+    }
+
+    status = benchSetup(port, numChannels, dtc, numFrames, result.frameTime, countRate);
+    cpuStart = benchCpuSeconds();
+    result.start = epicsTime::getCurrent();
+    result.last = result.start;
+    if (status == asynSuccess) {
+        status = benchWriteInt32(port, 0, ADAcquireString, 1);
+    }
+    if (status != asynSuccess) {
+        benchCancelArrays(&arrays);
+        epicsEventDestroy(result.done);
+        return false;
+    }
+    if (epicsEventWaitWithTimeout(result.done, numFrames*result.frameTime + 10*BENCH_TIMEOUT) != epicsEventWaitOK) {
+        timedOut = true;
+    }
+    wall = result.last - result.start;
+    cpu = benchCpuSeconds() - cpuStart;
+    dropped = benchReadInt32(port, xsp3DroppedFramesParamString);
+    if (timedOut) {
+        benchWriteInt32(port, 0, ADAcquireString, 0);
+    }
+    benchCancelArrays(&arrays);
+    epicsEventDestroy(result.done);
+
+    std::sort(result.latency.begin(), result.latency.end());
+    printf("%8d %8d %6s %10.1f %10.1f %10.2f %9.3f %9.3f %9.3f %9.3f %6.1f %8d%s\n",
+           numChannels, maxSpectra, dtc ? "double" : "uint32", rate,
+           wall > 0.0 ? result.received/wall : 0.0,
+           wall > 0.0 ? result.bytes/wall/1e6 : 0.0,
+           benchPercentile(result.latency, 50)*1e3, benchPercentile(result.latency, 90)*1e3,
+           benchPercentile(result.latency, 99)*1e3, benchPercentile(result.latency, 100)*1e3,
+           wall > 0.0 ? 100.0*cpu/wall : 0.0, dropped, timedOut ? " (timed out)" : "");
+    fflush(stdout);
+    return !timedOut;
+}
+
+static void benchUsage()
+{
+    fprintf(stderr, "Usage: xspress3Bench [-c channels] [-s spectra] [-t types] [-r rates] [-n frames] [-R count rate]\n"
+                    "  -c  Comma separated numbers of channels (default 4)\n"
+                    "  -s  Comma separated numbers of spectral bins, maxSpectra (default 4096)\n"
+                    "  -t  Comma separated data types, uint32 and/or double (default uint32)\n"
+                    "  -r  Comma separated frame rates in frames/s (default 1000)\n"
+                    "  -n  Frames per acquisition (default 10000)\n"
+                    "  -R  Simulated count rate per channel in counts/s (default 100000)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<double> channels(1, 4), spectra(1, 4096), rates(1, 1000);
+    std::vector<bool> types(1, false);
+    int numFrames = 10000;
+    double countRate = 1e5;
+    int opt, run = 0;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "c:s:t:r:n:R:h")) != -1) {
+        switch (opt) {
+        case 'c': channels = benchParseList(optarg); break;
+        case 's': spectra = benchParseList(optarg); break;
+        case 'r': rates = benchParseList(optarg); break;
+        case 'n': numFrames = atoi(optarg); break;
+        case 'R': countRate = atof(optarg); break;
+        case 't':
+            types.clear();
+            if (strstr(optarg, "uint32")) types.push_back(false);
+            if (strstr(optarg, "double")) types.push_back(true);
+            break;
+        default:
+            benchUsage();
+            return 1;
+        }
+    }
+    if (channels.empty() || spectra.empty() || rates.empty() || types.empty() || (numFrames < 1)) {
+        benchUsage();
+        return 1;
+    }
+
+    // There is no IOC database, so let the driver callbacks through
+    interruptAccept = 1;
+
+    printf("%8s %8s %6s %10s %10s %10s %9s %9s %9s %9s %6s %8s\n",
+           "channels", "spectra", "type", "rate", "frames/s", "MB/s",
+           "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)", "CPU%", "dropped");
+    for (size_t c=0; c<channels.size(); c++) {
+        for (size_t s=0; s<spectra.size(); s++) {
+            for (size_t t=0; t<types.size(); t++) {
+                for (size_t r=0; r<rates.size(); r++) {
+                    ok = benchRun(++run, static_cast<int>(channels[c]), static_cast<int>(spectra[s]),
+                                  types[t], rates[r], numFrames, countRate) && ok;
+                }
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
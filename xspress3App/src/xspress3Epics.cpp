@@ -26,6 +26,8 @@
 
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <limits>
 //needs c++11 #include <chrono>
 //needs c++11 #include <unistd.h>
 #include <stdexcept>
@@ -39,6 +41,7 @@
 #include <epicsThread.h>
 #include <epicsExport.h>
 #include <epicsString.h>
+#include <epicsAtomic.h>
 #include <iocsh.h>
 #include <drvSup.h>
 #include <registryFunction.h>
@@ -47,6 +50,7 @@
 #include "xspress3.h"
 
 #include "xspress3Epics.h"
+#include "xsp3ZeroCopyPool.h"
 
 using std::cout;
 using std::endl;
@@ -56,9 +60,24 @@ const epicsInt32 Xspress3::ctrlDisable_ = 0;
 const epicsInt32 Xspress3::ctrlEnable_ = 1;
 const epicsInt32 Xspress3::runFlag_MCA_SPECTRA_ = 0;
 const epicsInt32 Xspress3::runFlag_PLAYB_MCA_SPECTRA_ = 1;
-const epicsInt32 Xspress3::maxNumRoi_ = 16;
+const epicsInt32 Xspress3::maxNumRoi_ = XSP3_MAX_NUM_ROI;
 const epicsInt32 Xspress3::maxStringSize_ = 256;
 const epicsInt32 Xspress3::maxCheckHistPolls_ = 20;
+const epicsInt32 Xspress3::maxBatchFrames_ = 256;
+const epicsInt32 Xspress3::maxQueueDepth_ = 64;
+const double Xspress3::queueWaitTimeout_ = 0.1;
+const epicsInt32 Xspress3::dtcModeAPI_ = 0;
+const epicsInt32 Xspress3::dtcModeDriverFloat64_ = 1;
+const epicsInt32 Xspress3::dtcModeDriverFloat32_ = 2;
+const epicsInt32 Xspress3::rawDataTypeUInt32_ = 0;
+const epicsInt32 Xspress3::rawDataTypeUInt16_ = 1;
+const epicsInt32 Xspress3::maxRebin_ = 64;
+const epicsInt32 Xspress3::roiReadoutOff_ = 0;
+const epicsInt32 Xspress3::roiReadoutHardware_ = 1;
+const epicsInt32 Xspress3::roiReadoutSoftware_ = 2;
+const epicsInt32 Xspress3::fullSpectraBits_ = 12;
+const epicsInt32 Xspress3::accumulateAddr_ = 1;
+const epicsInt32 Xspress3::scaStreamAddr_ = 2;
 const epicsInt32 Xspress3::mbboTriggerFIXED_ = 0;
 const epicsInt32 Xspress3::mbboTriggerINTERNAL_ = 1;
 const epicsInt32 Xspress3::mbboTriggerIDC_ = 2;
@@ -74,6 +93,9 @@ const int INTERRUPT_MASK = asynInt32Mask | asynInt32ArrayMask | asynFloat64Mask
 
 //C Function prototypes to tie in with EPICS
 static void xsp3DataTaskC(void *drvPvt);
+static void xsp3PublishTaskC(void *drvPvt);
+static void xsp3ParamUpdateTaskC(void *drvPvt);
+static void xsp3NewFrameCallbackC(int path, int chan, int tf, int64_t tf_ext, u_int32_t *buffer, void *drvPvt);
 
 /**
  * Constructor for Xspress3::Xspress3.
@@ -92,7 +114,7 @@ static void xsp3DataTaskC(void *drvPvt);
  */
 Xspress3::Xspress3(const char *portName, int numChannels, int numCards, const char *baseIP, int maxFrames, int maxDriverFrames, int maxSpectra, int maxBuffers, size_t maxMemory, int debug, int simTest, int circBuffer)
   : ADDriver(portName,
-	     numChannels, /* maxAddr - channels use different param lists*/
+	     std::max(numChannels, scaStreamAddr_ + 1), /* maxAddr - channels use different param lists, and NDArrays other than the MCA are published on accumulateAddr_ and scaStreamAddr_ */
 	     NUM_DRIVER_PARAMS,
 	     maxBuffers,
 	     maxMemory,
@@ -102,7 +124,11 @@ Xspress3::Xspress3(const char *portName, int numChannels, int numCards, const ch
 	     1, /* Autoconnect */
 	     0, /* default priority */
 	     0), /* Default stack size*/
-    debug_(debug), numChannels_(numChannels), simTest_(simTest), baseIP_(baseIP), circBuffer_(circBuffer)
+    debug_(debug), numChannels_(numChannels), simTest_(simTest), baseIP_(baseIP), circBuffer_(circBuffer),
+    chanFrames_(numChannels, 0), deadtime_(numChannels), stageWindowStart_(0),
+    readoutStart_(0), readoutUpdate_(0), readoutAcquired_(0), readoutFrames_(0), peakBacklog_(0), hwRoiBins_(0),
+    acqDeadtime_(numChannels), roi_(numChannels, XSP3_MAX_NUM_ROI), accumFrames_(0), accumPublished_(0), accumLastFrame_(0), accumReset_(1),
+    scalerStore_(numChannels, XSP3_SW_NUM_SCALERS), scalerArraysUpdate_(0), pScaStream_(NULL), scaStreamFilled_(0), resultsFront_(0), resultsFresh_(false), framesAcquired_(0), droppedFrames_(0)
 {
   int status = asynSuccess;
   const char *functionName = "Xspress3::Xspress3";
@@ -122,10 +148,25 @@ Xspress3::Xspress3(const char *portName, int numChannels, int numCards, const ch
     asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s epicsEventCreate failure for start event.\n", functionName);
     return;
   }
+  frameEvent_ = epicsEventMustCreate(epicsEventEmpty);
+  if (!frameEvent_) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s epicsEventCreate failure for frame event.\n", functionName);
+    return;
+  }
+  pZeroCopyPool_ = new xsp3ZeroCopyPool(this);
+  if (this->createPublishQueue()) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s failed to create the publish queue.\n", functionName);
+    return;
+  }
+  if (this->createFrameResults()) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s failed to create the frame results.\n", functionName);
+    return;
+  }
   this->createInitialParameters();
   //Initialize non static, non const, data members
   xsp3_handle_ = 0;
   bool paramStatus = this->setInitialParameters(maxFrames, maxDriverFrames, numCards, maxSpectra);
+  this->setChannelMap();
   paramStatus = ((eraseSCAMCAROI() == asynSuccess) && paramStatus);
   //Create the thread that readouts the data
   status = (epicsThreadCreate("GeDataTask",
@@ -137,13 +178,35 @@ Xspress3::Xspress3(const char *portName, int numChannels, int numCards, const ch
     asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s epicsThreadCreate failure for data task.\n", functionName);
     return;
   }
+  //Create the thread that publishes the frames read out by the data task
+  status = (epicsThreadCreate("GePublishTask",
+                              epicsThreadPriorityMedium,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              (EPICSTHREADFUNC)xsp3PublishTaskC,
+                              this) == NULL);
+  if (status) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s epicsThreadCreate failure for publish task.\n", functionName);
+    return;
+  }
+  //Create the thread that writes the results of the readout to the parameter library
+  status = (epicsThreadCreate("GeParamTask",
+                              epicsThreadPriorityLow,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              (EPICSTHREADFUNC)xsp3ParamUpdateTaskC,
+                              this) == NULL);
+  if (status) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s epicsThreadCreate failure for parameter update task.\n", functionName);
+    return;
+  }
 
   printf( "Simulation: %d\n", simTest_ );
   if (simTest_) {
     paramStatus = ((setStringParam(ADStatusMessage, "Init. Simulation Mode.") == asynSuccess) && paramStatus);
-    xsp3 = new xsp3Simulator(this->pasynUserSelf,numChannels,maxSpectra);
+    simulator_ = new xsp3Simulator(this->pasynUserSelf,numChannels,maxSpectra);
+    xsp3 = simulator_;
   } else {
     paramStatus = ((setStringParam(ADStatusMessage, "Init. System Disconnected.") == asynSuccess) && paramStatus);
+    simulator_ = NULL;
     xsp3 = new xsp3Detector(this->pasynUserSelf);
   }
 
@@ -164,9 +227,13 @@ Xspress3::Xspress3(const char *portName, int numChannels, int numCards, const ch
  *
  * @param portName The asyn port name, this must be unique to each instance.
  * @param numChannels The number of channels to simulate.
+ * @param circBuffer 1 to acknowledge frames as if in circular buffer mode.
  *
  */
-Xspress3::Xspress3(const char *portName, int numChannels) : ADDriver(portName, numChannels, NUM_DRIVER_PARAMS, -1, -1, INTERFACE_MASK, INTERRUPT_MASK, ASYN_CANBLOCK | ASYN_MULTIDEVICE, 1, 0, 0), debug_(1), numChannels_(numChannels), simTest_(1), baseIP_("127.0.0.1"), circBuffer_(0)
+Xspress3::Xspress3(const char *portName, int numChannels, int circBuffer) : ADDriver(portName, std::max(numChannels, scaStreamAddr_ + 1), NUM_DRIVER_PARAMS, -1, -1, INTERFACE_MASK, INTERRUPT_MASK, ASYN_CANBLOCK | ASYN_MULTIDEVICE, 1, 0, 0), debug_(1), numChannels_(numChannels), simTest_(1), baseIP_("127.0.0.1"), circBuffer_(circBuffer), chanFrames_(numChannels, 0), deadtime_(numChannels), stageWindowStart_(0),
+    readoutStart_(0), readoutUpdate_(0), readoutAcquired_(0), readoutFrames_(0), peakBacklog_(0), hwRoiBins_(0),
+    acqDeadtime_(numChannels), roi_(numChannels, XSP3_MAX_NUM_ROI), accumFrames_(0), accumPublished_(0), accumLastFrame_(0), accumReset_(1),
+    scalerStore_(numChannels, XSP3_SW_NUM_SCALERS), scalerArraysUpdate_(0), pScaStream_(NULL), scaStreamFilled_(0), resultsFront_(0), resultsFresh_(false), framesAcquired_(0), droppedFrames_(0)
 {
     const char *functionName = "Xspress3::Xspress3";
     const int maxFrames = 1000;
@@ -174,17 +241,24 @@ Xspress3::Xspress3(const char *portName, int numChannels) : ADDriver(portName, n
     const int maxSpectra = 4096;
     const int numCards = 1;
     const int simTest = 1;
+    frameEvent_ = epicsEventMustCreate(epicsEventEmpty);
+    pZeroCopyPool_ = new xsp3ZeroCopyPool(this);
+    this->createPublishQueue();
+    this->createFrameResults();
     this->lock();
     this->createInitialParameters();
     //Initialize non static, non const, data members
     xsp3_handle_ = 0;
     bool paramStatus = this->setInitialParameters(maxFrames, maxDriverFrames, numCards, maxSpectra);
+    this->setChannelMap();
     paramStatus = ((eraseSCAMCAROI() == asynSuccess) && paramStatus);
     if (simTest) {
         paramStatus = ((setStringParam(ADStatusMessage, "Init. Simulation Mode.") == asynSuccess) && paramStatus);
-        xsp3 = new xsp3Simulator(this->pasynUserSelf,numChannels,maxSpectra);
+        simulator_ = new xsp3Simulator(this->pasynUserSelf,numChannels,maxSpectra);
+        xsp3 = simulator_;
     } else {
         paramStatus = ((setStringParam(ADStatusMessage, "Init. System Disconnected.") == asynSuccess) && paramStatus);
+        simulator_ = NULL;
         xsp3 = new xsp3Detector(this->pasynUserSelf);
     }
 
@@ -264,6 +338,80 @@ void Xspress3::createInitialParameters()
     createParam(xsp3EventWidthParamString, asynParamFloat64, &xsp3EventWidthParam);
     createParam(xsp3ChanDTPercentParamString, asynParamFloat64, &xsp3ChanDTPercentParam);
     createParam(xsp3ChanDTFactorParamString, asynParamFloat64, &xsp3ChanDTFactorParam);
+    //MCA ROIs
+    for (int roi=0; roi<maxNumRoi_; roi++) {
+        char paramName[64];
+        epicsSnprintf(paramName, sizeof(paramName), xsp3ChanRoiLlmParamString, roi+1);
+        createParam(paramName, asynParamInt32, &xsp3ChanRoiLlmParam[roi]);
+        epicsSnprintf(paramName, sizeof(paramName), xsp3ChanRoiHlmParamString, roi+1);
+        createParam(paramName, asynParamInt32, &xsp3ChanRoiHlmParam[roi]);
+        epicsSnprintf(paramName, sizeof(paramName), xsp3ChanRoiValueParamString, roi+1);
+        createParam(paramName, asynParamFloat64, &xsp3ChanRoiValueParam[roi]);
+    }
+    //Readout tuning
+    createParam(xsp3BatchReadoutParamString, asynParamInt32, &xsp3BatchReadoutParam);
+    createParam(xsp3PushReadoutParamString, asynParamInt32, &xsp3PushReadoutParam);
+    createParam(xsp3ZeroCopyParamString, asynParamInt32, &xsp3ZeroCopyParam);
+    createParam(xsp3RoiReadoutParamString, asynParamInt32, &xsp3RoiReadoutParam);
+    createParam(xsp3RoiReadoutModeParamString, asynParamInt32, &xsp3RoiReadoutModeParam);
+    createParam(xsp3AccumulateParamString, asynParamInt32, &xsp3AccumulateParam);
+    createParam(xsp3AccumulatePeriodParamString, asynParamInt32, &xsp3AccumulatePeriodParam);
+    createParam(xsp3AccumulateResetParamString, asynParamInt32, &xsp3AccumulateResetParam);
+    createParam(xsp3AccumulatedFramesParamString, asynParamInt32, &xsp3AccumulatedFramesParam);
+    createParam(xsp3ScalerArraysParamString, asynParamInt32, &xsp3ScalerArraysParam);
+    createParam(xsp3ScalerArraysPeriodParamString, asynParamFloat64, &xsp3ScalerArraysPeriodParam);
+    createParam(xsp3ScalerArraysUpdateParamString, asynParamInt32, &xsp3ScalerArraysUpdateParam);
+    createParam(xsp3ScalerArraysFramesParamString, asynParamInt32, &xsp3ScalerArraysFramesParam);
+    createParam(xsp3ScaStreamParamString, asynParamInt32, &xsp3ScaStreamParam);
+    createParam(xsp3ScaStreamFramesParamString, asynParamInt32, &xsp3ScaStreamFramesParam);
+    //Scaler history
+    for (int value=0; value<XSP3_NUM_SCALER_ARRAYS; value++) {
+        char paramName[64];
+        if (value < XSP3_SW_NUM_SCALERS) {
+            epicsSnprintf(paramName, sizeof(paramName), xsp3ChanScaArrayParamString, value);
+        } else if (value == XSP3_SW_NUM_SCALERS) {
+            epicsSnprintf(paramName, sizeof(paramName), "%s", xsp3ChanDTPercentArrayParamString);
+        } else {
+            epicsSnprintf(paramName, sizeof(paramName), "%s", xsp3ChanDTFactorArrayParamString);
+        }
+        createParam(paramName, asynParamFloat64Array, &xsp3ChanScalerArrayParam[value]);
+    }
+    createParam(xsp3QueueDepthParamString, asynParamInt32, &xsp3QueueDepthParam);
+    createParam(xsp3QueueUsedParamString, asynParamInt32, &xsp3QueueUsedParam);
+    createParam(xsp3DroppedFramesParamString, asynParamInt32, &xsp3DroppedFramesParam);
+    createParam(xsp3QueueDropParamString, asynParamInt32, &xsp3QueueDropParam);
+    createParam(xsp3BacklogParamString, asynParamInt32, &xsp3BacklogParam);
+    createParam(xsp3PeakBacklogParamString, asynParamInt32, &xsp3PeakBacklogParam);
+    createParam(xsp3TimeToOverflowParamString, asynParamFloat64, &xsp3TimeToOverflowParam);
+    createParam(xsp3FrameRateParamString, asynParamFloat64, &xsp3FrameRateParam);
+    createParam(xsp3ReadRateParamString, asynParamFloat64, &xsp3ReadRateParam);
+    createParam(xsp3ReadRateAvgParamString, asynParamFloat64, &xsp3ReadRateAvgParam);
+    createParam(xsp3ReadMBRateParamString, asynParamFloat64, &xsp3ReadMBRateParam);
+    createParam(xsp3ReadMBRateAvgParamString, asynParamFloat64, &xsp3ReadMBRateAvgParam);
+    createParam(xsp3ParamUpdatePeriodParamString, asynParamFloat64, &xsp3ParamUpdatePeriodParam);
+    createParam(xsp3StageWindowParamString, asynParamFloat64, &xsp3StageWindowParam);
+    createParam(xsp3StageMinParamString, asynParamFloat64Array, &xsp3StageMinParam);
+    createParam(xsp3StageMeanParamString, asynParamFloat64Array, &xsp3StageMeanParam);
+    createParam(xsp3StageP99ParamString, asynParamFloat64Array, &xsp3StageP99Param);
+    createParam(xsp3StageMaxParamString, asynParamFloat64Array, &xsp3StageMaxParam);
+    createParam(xsp3DtcModeParamString, asynParamInt32, &xsp3DtcModeParam);
+    createParam(xsp3RawDataTypeParamString, asynParamInt32, &xsp3RawDataTypeParam);
+    createParam(xsp3EnergyStartParamString, asynParamInt32, &xsp3EnergyStartParam);
+    createParam(xsp3EnergyBinsParamString, asynParamInt32, &xsp3EnergyBinsParam);
+    createParam(xsp3RebinParamString, asynParamInt32, &xsp3RebinParam);
+    createParam(xsp3ChanEnableParamString, asynParamInt32, &xsp3ChanEnableParam);
+    createParam(xsp3ChanSimRateParamString, asynParamFloat64, &xsp3ChanSimRateParam);
+    createParam(xsp3SimThreadsParamString, asynParamInt32, &xsp3SimThreadsParam);
+    createParam(xsp3SimRingFramesParamString, asynParamInt32, &xsp3SimRingFramesParam);
+    createParam(xsp3SimBusyTimeParamString, asynParamFloat64, &xsp3SimBusyTimeParam);
+    createParam(xsp3SimDelayRateParamString, asynParamFloat64, &xsp3SimDelayRateParam);
+    createParam(xsp3SimDelayTimeParamString, asynParamFloat64, &xsp3SimDelayTimeParam);
+    createParam(xsp3SimBurstFramesParamString, asynParamInt32, &xsp3SimBurstFramesParam);
+    createParam(xsp3SimDropRateParamString, asynParamFloat64, &xsp3SimDropRateParam);
+    createParam(xsp3SimErrorRateParamString, asynParamFloat64, &xsp3SimErrorRateParam);
+    createParam(xsp3SimCircLagParamString, asynParamInt32, &xsp3SimCircLagParam);
+    createParam(xsp3SimCircMaxLagParamString, asynParamInt32, &xsp3SimCircMaxLagParam);
+    createParam(xsp3SimCircOverrunsParamString, asynParamInt32, &xsp3SimCircOverrunsParam);
     createParam(xsp3LastParamString, asynParamInt32, &xsp3LastParam);
 }
 
@@ -309,6 +457,52 @@ bool Xspress3::setInitialParameters(int maxFrames, int maxDriverFrames, int numC
     paramStatus = ((setIntegerParam(xsp3PulsePerTriggerParam, 0) == asynSuccess) && paramStatus);
     paramStatus = ((setIntegerParam(xsp3ITFGStartParam, 0) == asynSuccess) && paramStatus);
     paramStatus = ((setIntegerParam(xsp3ITFGStopParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3RoiEnableParam, ctrlDisable_) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3BatchReadoutParam, 1) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3PushReadoutParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3ZeroCopyParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3RoiReadoutParam, roiReadoutOff_) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3RoiReadoutModeParam, roiReadoutOff_) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3AccumulateParam, ctrlDisable_) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3AccumulatePeriodParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3AccumulateResetParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3AccumulatedFramesParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3ScalerArraysParam, ctrlDisable_) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3ScalerArraysPeriodParam, 1.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3ScalerArraysUpdateParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3ScalerArraysFramesParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3ScaStreamParam, ctrlDisable_) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3ScaStreamFramesParam, 1) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3QueueDepthParam, 16) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3QueueUsedParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3DroppedFramesParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3QueueDropParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3BacklogParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3PeakBacklogParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3TimeToOverflowParam, -1.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3FrameRateParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3ReadRateParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3ReadRateAvgParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3ReadMBRateParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3ReadMBRateAvgParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3ParamUpdatePeriodParam, 0.1) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3StageWindowParam, 10.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3DtcModeParam, dtcModeAPI_) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3RawDataTypeParam, rawDataTypeUInt32_) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3EnergyStartParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3EnergyBinsParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3RebinParam, 1) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3SimThreadsParam, 1) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3SimRingFramesParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3SimBusyTimeParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3SimDelayRateParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3SimDelayTimeParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3SimBurstFramesParam, 1) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3SimDropRateParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setDoubleParam(xsp3SimErrorRateParam, 0.0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3SimCircLagParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3SimCircMaxLagParam, 0) == asynSuccess) && paramStatus);
+    paramStatus = ((setIntegerParam(xsp3SimCircOverrunsParam, 0) == asynSuccess) && paramStatus);
 
     for (int chan=0; chan<numChannels_; chan++) {
         paramStatus = ((setIntegerParam(chan, xsp3ChanSca4ThresholdParam, 0) == asynSuccess) && paramStatus);
@@ -324,6 +518,13 @@ bool Xspress3::setInitialParameters(int maxFrames, int maxDriverFrames, int numC
         paramStatus = ((setDoubleParam(chan, xsp3EventWidthParam, 5.0) == asynSuccess) && paramStatus);
         paramStatus = ((setDoubleParam(chan, xsp3ChanDTPercentParam, 0.0) == asynSuccess) && paramStatus);
         paramStatus = ((setDoubleParam(chan, xsp3ChanDTFactorParam, 1.0) == asynSuccess) && paramStatus);
+        paramStatus = ((setIntegerParam(chan, xsp3ChanEnableParam, 1) == asynSuccess) && paramStatus);
+        paramStatus = ((setDoubleParam(chan, xsp3ChanSimRateParam, 0.0) == asynSuccess) && paramStatus);
+        for (int roi=0; roi<maxNumRoi_; roi++) {
+            paramStatus = ((setIntegerParam(chan, xsp3ChanRoiLlmParam[roi], 0) == asynSuccess) && paramStatus);
+            paramStatus = ((setIntegerParam(chan, xsp3ChanRoiHlmParam[roi], 0) == asynSuccess) && paramStatus);
+            paramStatus = ((setDoubleParam(chan, xsp3ChanRoiValueParam[roi], 0.0) == asynSuccess) && paramStatus);
+        }
     }
     return paramStatus;
 }
@@ -558,6 +759,7 @@ asynStatus Xspress3::readTrigB(void)
 	  double width = trig_b.enb_variable_width ? (trig_b.event_time-3.0) : 1.0*trig_b.event_time;
 	  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Channel %d Event Width: %.1f\n", functionName, chan, width);
 	  setDoubleParam(chan, xsp3EventWidthParam, width);
+	  deadtime_.setEventWidth(chan, width);
         }
         callParamCallbacks(chan);
     }
@@ -684,10 +886,14 @@ asynStatus Xspress3::restoreSettings(void)
   }
 
   //Can we do xsp3_format_run here? For normal user operation all the arguments seem to be set to zero.
+  //Any hardware ROIs are removed too, so the full spectra are histogrammed.
+  if (hwRoiBins_ > 0) {
+    clearHardwareRois();
+  }
   int xsp3_num_channels;
   getIntegerParam(xsp3NumChannelsParam, &xsp3_num_channels);
   for (int chan=0; chan<xsp3_num_channels; chan++) {
-    xsp3_status = xsp3->format_run(xsp3_handle_, chan, 0, 0, 0, 0, 0, 12);
+    xsp3_status = xsp3->format_run(xsp3_handle_, chan, 0, 0, 0, 0, 0, fullSpectraBits_);
     if (xsp3_status < XSP3_OK) {
       checkStatus(xsp3_status, "xsp3_format_run", functionName);
       status = asynError;
@@ -885,6 +1091,178 @@ asynStatus Xspress3::checkRoi(int channel, int roi, int llm, int hlm)
   return status;
 }
 
+/**
+ * Find which ROI a parameter is the limit or value of.
+ * @param function The parameter index
+ * @param params The parameter index of each ROI, eg. xsp3ChanRoiLlmParam
+ * @return The (0 based) ROI number, or -1 if function is not one of params
+ */
+int Xspress3::findRoiParam(int function, const int (&params)[XSP3_MAX_NUM_ROI])
+{
+  for (int roi=0; roi<maxNumRoi_; roi++) {
+    if (params[roi] == function) {
+      return roi;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Find which scaler waveform a parameter is.
+ * @param function The parameter index
+ * @return The index of the value in scalerStore_, or -1 if function is not a scaler waveform
+ */
+int Xspress3::findScalerArrayParam(int function)
+{
+  for (int value=0; value<XSP3_NUM_SCALER_ARRAYS; value++) {
+    if (xsp3ChanScalerArrayParam[value] == function) {
+      return value;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Work out how many ROI sums each channel publishes in ROI readout mode,
+ * which is up to the highest ROI defined on any of the channels.
+ * @param chanMap The channels that are read out
+ * @return The number of ROI sums, 0 if no ROIs are defined
+ */
+int Xspress3::getNumRoiBins(const std::vector<int> &chanMap)
+{
+  int llm, hlm, numRoiBins = 0;
+  for (size_t chan=0; chan<chanMap.size(); chan++) {
+    for (int roi=numRoiBins; roi<maxNumRoi_; roi++) {
+      getIntegerParam(chanMap[chan], xsp3ChanRoiLlmParam[roi], &llm);
+      getIntegerParam(chanMap[chan], xsp3ChanRoiHlmParam[roi], &hlm);
+      if (hlm > llm) {
+        numRoiBins = roi + 1;
+      }
+    }
+  }
+  return numRoiBins;
+}
+
+/**
+ * Set the hardware up for XSP3_ROI_READOUT before an acquisition starts.
+ * If the hardware can sum the ROIs it is given them, so only the ROI sums
+ * are read out, otherwise the full spectra are read and the driver sums
+ * them. XSP3_ROI_READOUT_MODE shows which is being done.
+ */
+void Xspress3::setupRoiReadout()
+{
+  const char *functionName = "Xspress3::setupRoiReadout";
+  int roiReadout, numRoiBins = 0, mode = roiReadoutOff_;
+  std::vector<int> chanMap;
+
+  getIntegerParam(xsp3RoiReadoutParam, &roiReadout);
+  getChannelMap(chanMap);
+  if (roiReadout != roiReadoutOff_) {
+    numRoiBins = getNumRoiBins(chanMap);
+    if (numRoiBins > 0) {
+      mode = roiReadoutSoftware_;
+    } else {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s No MCA ROIs are defined, so the spectra will be read out.\n", functionName);
+    }
+  }
+  if ((mode == roiReadoutSoftware_) && (roiReadout == roiReadoutHardware_) && setHardwareRois(chanMap, numRoiBins)) {
+    mode = roiReadoutHardware_;
+  }
+  if ((mode != roiReadoutHardware_) && (hwRoiBins_ > 0)) {
+    clearHardwareRois();
+  }
+  setIntegerParam(xsp3RoiReadoutModeParam, mode);
+}
+
+/**
+ * Give the hardware the ROIs of each channel, one bin each, so that the
+ * spectra it histograms are the ROI sums. Every ROI up to numRoiBins has
+ * to be defined on every channel, and they cannot overlap, as each bin
+ * of the spectrum can only go to one ROI bin.
+ * @param chanMap The channels that are read out
+ * @param numRoiBins The number of ROIs
+ * @return true if the hardware has the ROIs, false if the driver should sum them
+ */
+bool Xspress3::setHardwareRois(const std::vector<int> &chanMap, int numRoiBins)
+{
+  const char *functionName = "Xspress3::setHardwareRois";
+  XSP3Roi rois[XSP3_MAX_NUM_ROI];
+  int xsp3_status = 0;
+  int nbits = 1;
+
+  //The bins outside the ROIs go in one more bin after them
+  while ((1 << nbits) < numRoiBins + 1) {
+    nbits++;
+  }
+
+  for (size_t chan=0; chan<chanMap.size(); chan++) {
+    if (xsp3->has_roi(xsp3_handle_, chanMap[chan]) <= 0) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s No hardware ROI support on channel %d, the driver will sum the ROIs.\n", functionName, chanMap[chan]+1);
+      return false;
+    }
+    for (int roi=0; roi<numRoiBins; roi++) {
+      getIntegerParam(chanMap[chan], xsp3ChanRoiLlmParam[roi], &rois[roi].lhs);
+      getIntegerParam(chanMap[chan], xsp3ChanRoiHlmParam[roi], &rois[roi].rhs);
+      rois[roi].out_bins = 1;
+      if (rois[roi].rhs <= rois[roi].lhs) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ROI %d is not defined on channel %d, the driver will sum the ROIs.\n", functionName, roi+1, chanMap[chan]+1);
+        return false;
+      }
+      for (int other=0; other<roi; other++) {
+        if ((rois[roi].lhs < rois[other].rhs) && (rois[other].lhs < rois[roi].rhs)) {
+          asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ROIs %d and %d overlap on channel %d, the driver will sum the ROIs.\n", functionName, other+1, roi+1, chanMap[chan]+1);
+          return false;
+        }
+      }
+    }
+  }
+
+  //From here the hardware may have been changed, so it has to be cleared if this fails
+  hwRoiBins_ = numRoiBins;
+  for (size_t chan=0; chan<chanMap.size(); chan++) {
+    for (int roi=0; roi<numRoiBins; roi++) {
+      getIntegerParam(chanMap[chan], xsp3ChanRoiLlmParam[roi], &rois[roi].lhs);
+      getIntegerParam(chanMap[chan], xsp3ChanRoiHlmParam[roi], &rois[roi].rhs);
+      rois[roi].out_bins = 1;
+    }
+    xsp3_status = xsp3->format_run(xsp3_handle_, chanMap[chan], 0, 0, 0, 0, 0, nbits);
+    if (xsp3_status < XSP3_OK) {
+      checkStatus(xsp3_status, "xsp3_format_run", functionName);
+      return false;
+    }
+    xsp3_status = xsp3->set_roi(xsp3_handle_, chanMap[chan], numRoiBins, rois);
+    if (xsp3_status < XSP3_OK) {
+      checkStatus(xsp3_status, "xsp3_set_roi", functionName);
+      return false;
+    }
+  }
+  asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s The hardware is summing %d ROIs on each channel.\n", functionName, numRoiBins);
+  return true;
+}
+
+/**
+ * Remove the hardware ROIs from every configured channel, so the full
+ * spectra are histogrammed again.
+ */
+void Xspress3::clearHardwareRois()
+{
+  const char *functionName = "Xspress3::clearHardwareRois";
+  int xsp3_status = 0;
+  int xsp3_num_channels = 0;
+  getIntegerParam(xsp3NumChannelsParam, &xsp3_num_channels);
+  for (int chan=0; chan<xsp3_num_channels; chan++) {
+    xsp3_status = xsp3->init_roi(xsp3_handle_, chan);
+    if (xsp3_status < XSP3_OK) {
+      checkStatus(xsp3_status, "xsp3_init_roi", functionName);
+    }
+    xsp3_status = xsp3->format_run(xsp3_handle_, chan, 0, 0, 0, 0, 0, fullSpectraBits_);
+    if (xsp3_status < XSP3_OK) {
+      checkStatus(xsp3_status, "xsp3_format_run", functionName);
+    }
+  }
+  hwRoiBins_ = 0;
+}
+
 
 /**
  * Call xsp3_histogram_clear, and clear scalar data.
@@ -962,6 +1340,9 @@ asynStatus Xspress3::eraseSCAMCAROI(void)
     paramStatus = ((setDoubleParam(chan, xsp3ChanSca7Param, 0.0) == asynSuccess) && paramStatus);
     paramStatus = ((setDoubleParam(chan, xsp3ChanDTPercentParam, 0.0) == asynSuccess) && paramStatus);
     paramStatus = ((setDoubleParam(chan, xsp3ChanDTFactorParam, 1.0) == asynSuccess) && paramStatus);
+    for (int roi=0; roi<maxNumRoi_; roi++) {
+      paramStatus = ((setDoubleParam(chan, xsp3ChanRoiValueParam[roi], 0.0) == asynSuccess) && paramStatus);
+    }
 
     //callParamCallbacks(chan);
   }
@@ -1020,7 +1401,15 @@ void Xspress3::report(FILE *fp, int details)
 
   fprintf(fp, "Xspress3 port=%s\n", this->portName);
   if (details > 0) {
+    xsp3StageStats stats;
     fprintf(fp, "Xspress3 driver details...\n");
+    fprintf(fp, "  Readout stage times (us) over the last window:\n");
+    fprintf(fp, "  %-12s %10s %10s %10s %10s %10s\n", "Stage", "Count", "Min", "Mean", "P99", "Max");
+    for (int stage=0; stage<xsp3StageTimes::NumStages; stage++) {
+      stageTimes_.getStats(stage, stats);
+      fprintf(fp, "  %-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", xsp3StageTimes::stageName(stage),
+              static_cast<unsigned long long>(stats.count), stats.min*1e6, stats.mean*1e6, stats.p99*1e6, stats.max*1e6);
+    }
   }
 
   fprintf(fp, "Xspress3 finished.\n");
@@ -1172,6 +1561,8 @@ asynStatus Xspress3::writeInt32(asynUser *pasynUser, epicsInt32 value)
   int addr = 0;
   int xsp3_status = 0;
   int xsp3_sca_lim = 0;
+  int xsp3_roi = 0;
+  int xsp3_roi_lim = 0;
   int xsp3_time_frames = 0;
   int xsp3_time_frames2 =0;
   int adStatus = 0;
@@ -1221,6 +1612,7 @@ asynStatus Xspress3::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	  getIntegerParam(xsp3NumFramesDriverParam, &xsp3_time_frames);
 	  getIntegerParam(xsp3NumChannelsParam, &xsp3_num_channels);
 	  xsp3_status = xsp3->histogram_stop(xsp3_handle_, -1);
+	  setupRoiReadout();
 	  // MNewville Sept 2021, use EraseOnStart to control whether to Erase before Acquire
 	  getIntegerParam(xsp3EraseStartParam, &xsp3_erasestart);
 	  // printf(" erase on start %d\n", xsp3_erasestart);
@@ -1244,6 +1636,7 @@ asynStatus Xspress3::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	      status = asynError;
 	    }
 	    if (status == asynSuccess) {
+	      updateSimCircStatus();
 	      epicsEventSignal(this->startEvent_);
 	      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Started Data Collection.\n", functionName);
 	    } else {
@@ -1263,6 +1656,9 @@ asynStatus Xspress3::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	    }
 	    if (status == asynSuccess) {
 	      epicsEventSignal(this->stopEvent_);
+	      //Wake the data task if it is blocked waiting for a pushed frame or for space in the publish queue
+	      epicsEventSignal(this->frameEvent_);
+	      epicsEventSignal(this->queueSpaceEvent_);
 	    }
 	  }
       }
@@ -1397,6 +1793,16 @@ asynStatus Xspress3::writeInt32(asynUser *pasynUser, epicsInt32 value)
       asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Enabling ROI Calculations.\n", functionName);
     }
   }
+  else if ((xsp3_roi = findRoiParam(function, xsp3ChanRoiLlmParam)) >= 0) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The ROI%d Low Limit.\n", functionName, xsp3_roi+1);
+    getIntegerParam(addr, xsp3ChanRoiHlmParam[xsp3_roi], &xsp3_roi_lim);
+    status = checkRoi(addr, xsp3_roi+1, value, xsp3_roi_lim);
+  }
+  else if ((xsp3_roi = findRoiParam(function, xsp3ChanRoiHlmParam)) >= 0) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The ROI%d High Limit.\n", functionName, xsp3_roi+1);
+    getIntegerParam(addr, xsp3ChanRoiLlmParam[xsp3_roi], &xsp3_roi_lim);
+    status = checkRoi(addr, xsp3_roi+1, xsp3_roi_lim, value);
+  }
   else if (function == xsp3RunFlagsParam) {
     asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The Run Flags.\n", functionName);
   }
@@ -1438,6 +1844,188 @@ asynStatus Xspress3::writeInt32(asynUser *pasynUser, epicsInt32 value)
     getIntegerParam(xsp3EraseStartParam, &xsp3_erasestart);
   }
 
+  else if (function == xsp3PushReadoutParam) {
+    if (value == ctrlDisable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Polling For New Frames.\n", functionName);
+    } else if (value == ctrlEnable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Waiting For New Frame Callbacks.\n", functionName);
+    }
+  }
+
+  else if (function == xsp3ZeroCopyParam) {
+    if (value == ctrlDisable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Copying Frames Into NDArrays.\n", functionName);
+    } else if (value == ctrlEnable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Wrapping API Histogram Memory In NDArrays.\n", functionName);
+    }
+  }
+
+  else if (function == xsp3RoiReadoutParam) {
+    if (value == roiReadoutOff_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Publishing The MCA Spectra.\n", functionName);
+    } else if (value == roiReadoutHardware_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Publishing The MCA ROIs, Summed By The Hardware If It Can.\n", functionName);
+    } else if (value == roiReadoutSoftware_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Publishing The MCA ROIs, Summed By The Driver.\n", functionName);
+    } else {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Unknown ROI Readout Mode %d.\n", functionName, value);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3AccumulateParam) {
+    if (value == ctrlDisable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Not Accumulating The MCA Spectra.\n", functionName);
+    } else if (value == ctrlEnable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Accumulating The MCA Spectra.\n", functionName);
+    }
+  }
+
+  else if (function == xsp3AccumulatePeriodParam) {
+    if (value < 0) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: The accumulate period must be 0 or more frames.\n", functionName);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3AccumulateResetParam) {
+    // The publish task owns the accumulated spectra, so ask it to clear them
+    epicsAtomicSetIntT(&accumReset_, 1);
+    setIntegerParam(xsp3AccumulatedFramesParam, 0);
+    setIntegerParam(xsp3AccumulateResetParam, 0);
+  }
+
+  else if (function == xsp3ScalerArraysParam) {
+    if (value == ctrlDisable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Not Keeping The Scalers Of Each Frame.\n", functionName);
+    } else if (value == ctrlEnable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Keeping The Scalers Of Each Frame.\n", functionName);
+    }
+  }
+
+  else if (function == xsp3ScaStreamParam) {
+    if (value == ctrlDisable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Not Publishing The SCAs As NDArrays.\n", functionName);
+    } else if (value == ctrlEnable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Publishing The SCAs As NDArrays.\n", functionName);
+    }
+  }
+
+  else if (function == xsp3ScaStreamFramesParam) {
+    if ((value < 1) || (value > maxBatchFrames_)) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: The SCA stream must have 1 to %d frames in each NDArray.\n", functionName, maxBatchFrames_);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3ScalerArraysUpdateParam) {
+    exportScalerArrays(true);
+    setIntegerParam(xsp3ScalerArraysUpdateParam, 0);
+  }
+
+  else if (function == xsp3DtcModeParam) {
+    if (value == dtcModeAPI_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Dead Time Correction By The API.\n", functionName);
+    } else if (value == dtcModeDriverFloat64_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Dead Time Correction In The Driver, Float64 Output.\n", functionName);
+    } else if (value == dtcModeDriverFloat32_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Dead Time Correction In The Driver, Float32 Output.\n", functionName);
+    } else {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Unknown Dead Time Correction Mode %d.\n", functionName, value);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3RawDataTypeParam) {
+    if (value == rawDataTypeUInt32_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Raw Data Output As UInt32.\n", functionName);
+    } else if (value == rawDataTypeUInt16_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Raw Data Output As Saturating UInt16.\n", functionName);
+    } else {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Unknown Raw Data Type %d.\n", functionName, value);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3RebinParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The Rebin Factor.\n", functionName);
+    if ((value < 1) || (value > maxRebin_) || ((value & (value - 1)) != 0)) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Rebin Factor Must Be A Power Of 2 Up To %d.\n", functionName, maxRebin_);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3SimThreadsParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The Simulator Threads.\n", functionName);
+    if ((value < 1) || (value > xsp3Simulator::maxThreads)) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Simulator Threads Must Be Between 1 And %d.\n", functionName, xsp3Simulator::maxThreads);
+      status = asynError;
+    } else if (simulator_ != NULL) {
+      simulator_->setNumThreads(value);
+    }
+  }
+
+  else if (function == xsp3SimRingFramesParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The Simulator Pre-generated Frames.\n", functionName);
+    if (value < 0) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Simulator Ring Frames Must Not Be Negative.\n", functionName);
+      status = asynError;
+    } else if (simulator_ != NULL) {
+      simulator_->setRingFrames(value);
+    }
+  }
+
+  else if (function == xsp3SimBurstFramesParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The Simulator Burst Size.\n", functionName);
+    if (value < 1) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Simulator Burst Size Must Be At Least 1.\n", functionName);
+      status = asynError;
+    } else {
+      setIntegerParam(function, value);
+      setSimFaults();
+    }
+  }
+
+  else if (function == xsp3ChanEnableParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set Channel %d Readout Enable.\n", functionName, addr);
+    if ((adStatus == ADStatusAcquire) || (adStatus == ADStatusReadout)) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Cannot Change The Enabled Channels While Acquiring.\n", functionName);
+      status = asynError;
+    }
+  }
+
+  else if ((function == xsp3EnergyStartParam) || (function == xsp3EnergyBinsParam)) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The Energy Window.\n", functionName);
+    if (value < 0) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Energy Window Must Not Be Negative.\n", functionName);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3QueueDepthParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set Max Frames Waiting To Be Published.\n", functionName);
+    if ((value < 1) || (value > maxQueueDepth_)) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Queue Depth Must Be Between 1 And %d.\n", functionName, maxQueueDepth_);
+      status = asynError;
+    }
+  }
+
+  else if (function == xsp3QueueDropParam) {
+    if (value == ctrlDisable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Waiting For Space In A Full Publish Queue.\n", functionName);
+    } else if (value == ctrlEnable_) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Dropping Frames When The Publish Queue Is Full.\n", functionName);
+    }
+  }
+
+  else if (function == xsp3BatchReadoutParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set Max Frames Per Batch Readout.\n", functionName);
+    if ((value < 1) || (value > maxBatchFrames_)) {
+      asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s ERROR: Batch Readout Size Must Be Between 1 And %d.\n", functionName, maxBatchFrames_);
+      status = asynError;
+    }
+  }
+
   else {
     asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s No Matching Parameter In Xspress3 Driver.\n", functionName);
   }
@@ -1489,11 +2077,59 @@ asynStatus Xspress3::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
 
   //Set in param lib so the user sees a readback straight away. We might overwrite this in the
   //status task, depending on the parameter.
-  status = (asynStatus) setDoubleParam(function, value);
+  status = (asynStatus) setDoubleParam(addr, function, value);
+
+  if (function == xsp3EventWidthParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set Channel %d Event Width.\n", functionName, addr);
+    deadtime_.setEventWidth(addr, value);
+  }
+  else if (function == xsp3ChanSimRateParam) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set Channel %d Simulated Count Rate.\n", functionName, addr);
+    if (simulator_ != NULL) {
+      simulator_->setCountRate(addr, value);
+    }
+  }
+  else if ((function == xsp3SimBusyTimeParam) || (function == xsp3SimDelayRateParam) || (function == xsp3SimDelayTimeParam) ||
+           (function == xsp3SimDropRateParam) || (function == xsp3SimErrorRateParam)) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Set The Simulator Faults.\n", functionName);
+    setSimFaults();
+  }
 
   //Do callbacks so higher layers see any changes
-  callParamCallbacks();
+  callParamCallbacks(addr);
+
+  return status;
+}
+
+
+/**
+ * Reimplementing this function from ADDriver to read the scaler waveforms
+ * of a channel on request. Only the frames stored so far are returned.
+ */
+asynStatus Xspress3::readFloat64Array(asynUser *pasynUser, epicsFloat64 *value,
+                                      size_t nElements, size_t *nIn)
+{
+  int function = pasynUser->reason;
+  int addr = 0;
+  asynStatus status = asynSuccess;
+  int scalerValue = findScalerArrayParam(function);
 
+  if (scalerValue < 0) {
+    return ADDriver::readFloat64Array(pasynUser, value, nElements, nIn);
+  }
+  status = getAddress(pasynUser, &addr);
+  if (status!=asynSuccess) {
+    return(status);
+  }
+  *nIn = 0;
+  for (size_t chan=0; chan<chanMap_.size(); chan++) {
+    const double *pWaveform = scalerStore_.getWaveform(scalerValue, static_cast<int>(chan));
+    if ((chanMap_[chan] == addr) && (pWaveform != NULL) && acqConfig_.scalerArrays) {
+      *nIn = std::min(nElements, static_cast<size_t>(scalerStore_.getNumFrames()));
+      std::copy(pWaveform, pWaveform + *nIn, value);
+      break;
+    }
+  }
   return status;
 }
 
@@ -1659,12 +2295,89 @@ bool Xspress3::createSCAArray(void *&pSCA)
     }
 }
 
+/**
+ * Malloc staging arrays large enough to hold a batch of frames (MCA and SCA)
+ * read with a single read4d call. Any existing arrays are freed first, so this
+ * can be called again whenever the batch size or frame dimensions change.
+ *
+ * @param pSCABatch A reference to a pointer that will point to the SCA staging memory
+ * @param pMCABatch A reference to a pointer that will point to the MCA staging memory
+ * @param batchFrames The maximum number of frames in a batch
+ * @param dims [maximum number of spectral bins, number of channels]
+ *
+ * @return true if an allocation error occurs otherwise false
+ */
+bool Xspress3::createBatchArrays(void *&pSCABatch, void *&pMCABatch, int batchFrames, size_t dims[2])
+{
+    const char *functionName = "Xspress3::createBatchArrays";
+    free(pSCABatch);
+    free(pMCABatch);
+    pSCABatch = malloc(XSP3_SW_NUM_SCALERS * dims[1] * batchFrames * sizeof(double));
+    pMCABatch = malloc(dims[0] * dims[1] * batchFrames * sizeof(double));
+    if ((pSCABatch == NULL) || (pMCABatch == NULL)) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s: ERROR: batch staging malloc failed for %d frames.\n", functionName, batchFrames);
+        free(pSCABatch);
+        free(pMCABatch);
+        pSCABatch = pMCABatch = NULL;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+/**
+ * Create the queue between the data task and the publish task, and the
+ * slots that hold a copy of the SCAs and dead time for each queued frame.
+ * There is one more slot than the maximum queue depth, for the frame being
+ * published.
+ *
+ * @return true if an allocation error occurs otherwise false
+ */
+bool Xspress3::createPublishQueue()
+{
+    scaSlotBytes_ = (XSP3_SW_NUM_SCALERS + 2) * this->numChannels_ * sizeof(double);
+    scaSlot_ = 0;
+    pSCARing_ = static_cast<char*>(malloc((maxQueueDepth_+1) * scaSlotBytes_));
+    publishQueue_ = epicsMessageQueueCreate(maxQueueDepth_+1, sizeof(xsp3QueuedFrame));
+    publishDoneEvent_ = epicsEventMustCreate(epicsEventEmpty);
+    queueSpaceEvent_ = epicsEventMustCreate(epicsEventEmpty);
+    dropReported_ = 0;
+    dropsUnreported_ = 0;
+    return (pSCARing_ == NULL) || (publishQueue_ == NULL);
+}
+
+/**
+ * Create the double buffered frame results that the publish task stores
+ * the SCAs of each frame in and the parameter update task writes out.
+ *
+ * @return true if the lock or event could not be created
+ */
+bool Xspress3::createFrameResults()
+{
+    memset(&acqConfig_, 0, sizeof(acqConfig_));
+    for (int i=0; i<2; i++) {
+        results_[i].frameNumber = 0;
+        results_[i].numChannels = 0;
+        results_[i].sca.assign(XSP3_SW_NUM_SCALERS * this->numChannels_, 0.0);
+        results_[i].dtPercent.assign(this->numChannels_, 0.0);
+        results_[i].dtFactor.assign(this->numChannels_, 1.0);
+        results_[i].numRois = 0;
+        results_[i].roi.assign(maxNumRoi_ * this->numChannels_, 0.0);
+        results_[i].accumulated = -1;
+    }
+    accumDims_[0] = accumDims_[1] = 0;
+    resultsOut_ = results_[0];
+    resultsLock_ = epicsMutexCreate();
+    resultsEvent_ = epicsEventCreate(epicsEventEmpty);
+    return (resultsLock_ == NULL) || (resultsEvent_ == NULL);
+}
+
 /**
  * Allocate an NDArray to put a detector frame into
  *
  * @param dims [maximum number of spectral bins, number of channels]
  * @param pMCA Reference to a pointer to the NDArray that will be allocated
- * @param dataType The NDDataType_t of the NDArray (NDUInt32 or NDFloat64)
+ * @param dataType The NDDataType_t of the NDArray (NDUInt32, NDFloat64 or NDFloat32)
  *
  * @return true if an allocation error occurs otherwise false
  */
@@ -1693,50 +2406,164 @@ bool Xspress3::createMCAArray(size_t dims[2], NDArray *&pMCA, NDDataType_t dataT
  * @return true if an allocation error occurs otherwise false
  */
 bool Xspress3::readFrame(double* pSCA, double* pMCAData, int frameNumber, int maxSpectra)
+{
+    return this->readFrames(pSCA, pMCAData, frameNumber, 1, 0, maxSpectra);
+}
+
+bool Xspress3::readFrame(u_int32_t* pSCA, u_int32_t* pMCAData, int frameNumber, int maxSpectra)
+{
+    return this->readFrames(pSCA, pMCAData, frameNumber, 1, 0, maxSpectra);
+}
+
+/**
+ * Read a contiguous block of frames, of dead-time corrected data, from the
+ * hardware. The data is laid out frame by frame, each frame being
+ * [numChannels][numBins] for the MCA and [numChannels][XSP3_SW_NUM_SCALERS]
+ * for the SCAs, where the channels are the enabled ones in chanMap_.
+ *
+ * If the enabled channels are contiguous the whole block is read with a
+ * single xsp3_hist_dtc_read4d call, otherwise there is one call per frame
+ * for each contiguous run of enabled channels.
+ *
+ * @param pSCA A pointer to the array to hold numFrames frames of SCAs
+ * @param pMCAData A pointer to the array to hold numFrames frames of MCA
+ * @param frameNumber The first frame to read from the current capture
+ * @param numFrames The number of frames to read
+ * @param firstBin The first spectral bin to read
+ * @param numBins The number of spectral bins to read for each channel
+ *
+ * @return true if a read error occurs otherwise false
+ */
+bool Xspress3::readFrames(double* pSCA, double* pMCAData, int frameNumber, int numFrames, int firstBin, int numBins)
 {
     bool error = false;
     int xsp3Status = 0;
-    const char* functionName = "Xspress3::readFrame";
-    xsp3Status = xsp3->hist_dtc_read4d(this->xsp3_handle_, pMCAData, pSCA, 0, 0, 0, frameNumber, maxSpectra, 1, this->numChannels_, 1);
+    const char* functionName = "Xspress3::readFrames";
+    const int numEnabled = static_cast<int>(chanMap_.size());
+    const int framesPerRead = (chanRuns_.size() == 1) ? numFrames : 1;
+    for (int frame=0; (frame<numFrames) && (xsp3Status == XSP3_OK); frame+=framesPerRead) {
+        int row = frame*numEnabled;
+        for (size_t run=0; (run<chanRuns_.size()) && (xsp3Status == XSP3_OK); run++) {
+            xsp3Status = xsp3->hist_dtc_read4d(this->xsp3_handle_, pMCAData + row*numBins, pSCA + row*XSP3_SW_NUM_SCALERS, firstBin, 0, chanRuns_[run].first, frameNumber+frame, numBins, 1, chanRuns_[run].second, framesPerRead);
+            row += chanRuns_[run].second;
+        }
+    }
 
     if (xsp3Status != XSP3_OK) {
         checkStatus(xsp3Status, "xsp3_hist_dtc_read4d", functionName);
         error = true;
-    } else {
-        setIntegerParam(NDArrayCounter, frameNumber+1);
-    }
-    if (circBuffer_ == 1) {
-          xsp3_histogram_circ_ack(this->xsp3_handle_, 0, frameNumber, this->numChannels_, 1);
     }
+    this->ackFrames(frameNumber, numFrames);
     return error;
 }
 
-bool Xspress3::readFrame(u_int32_t* pSCA, u_int32_t* pMCAData, int frameNumber, int maxSpectra)
+/**
+ * Read a contiguous block of frames, of raw data, from the hardware. If the
+ * enabled channels are contiguous this is a single xsp3_histogram_read4d and
+ * a single xsp3_scaler_read call, otherwise there is a pair of calls per
+ * frame for each contiguous run of enabled channels.
+ *
+ * @param pSCA A pointer to the array to hold numFrames frames of SCAs
+ * @param pMCAData A pointer to the array to hold numFrames frames of MCA
+ * @param frameNumber The first frame to read from the current capture
+ * @param numFrames The number of frames to read
+ * @param firstBin The first spectral bin to read
+ * @param numBins The number of spectral bins to read for each channel
+ *
+ * @return true if a read error occurs otherwise false
+ */
+bool Xspress3::readFrames(u_int32_t* pSCA, u_int32_t* pMCAData, int frameNumber, int numFrames, int firstBin, int numBins)
 {
     bool error = false;
     int xsp3Status = 0;
-    const char* functionName = "Xspress3::readFrame";
-    xsp3Status = xsp3->histogram_read4d(this->xsp3_handle_, pMCAData, 0, 0, 0, frameNumber, maxSpectra, 1, this->numChannels_, 1);
+    const char* functionName = "Xspress3::readFrames";
+    const char* readFunction = "xsp3_histogram_read4d";
+    const int numEnabled = static_cast<int>(chanMap_.size());
+    const int framesPerRead = (chanRuns_.size() == 1) ? numFrames : 1;
+    for (int frame=0; (frame<numFrames) && (xsp3Status == XSP3_OK); frame+=framesPerRead) {
+        int row = frame*numEnabled;
+        for (size_t run=0; (run<chanRuns_.size()) && (xsp3Status == XSP3_OK); run++) {
+            readFunction = "xsp3_histogram_read4d";
+            xsp3Status = xsp3->histogram_read4d(this->xsp3_handle_, pMCAData + row*numBins, firstBin, 0, chanRuns_[run].first, frameNumber+frame, numBins, 1, chanRuns_[run].second, framesPerRead);
+            if (xsp3Status == XSP3_OK) {
+                readFunction = "xsp3_scaler_read";
+                xsp3Status = xsp3->scaler_read(this->xsp3_handle_, pSCA + row*XSP3_SW_NUM_SCALERS, 0, chanRuns_[run].first, frameNumber+frame, XSP3_SW_NUM_SCALERS, chanRuns_[run].second, framesPerRead);
+            }
+            row += chanRuns_[run].second;
+        }
+    }
     if (xsp3Status != XSP3_OK) {
-        checkStatus(xsp3Status, "xsp3_histogram_read4d", functionName);
+        checkStatus(xsp3Status, readFunction, functionName);
         error = true;
-    } else {
-        setIntegerParam(NDArrayCounter, frameNumber);
-        xsp3Status = xsp3->scaler_read(this->xsp3_handle_, pSCA, 0, 0, frameNumber, XSP3_SW_NUM_SCALERS, this->numChannels_, 1);
-        if (xsp3Status != XSP3_OK) {
-	  checkStatus(xsp3Status, "xsp3_scaler_read", functionName);
-	  error = true;
+    }
+    this->ackFrames(frameNumber, numFrames);
+    return error;
+}
+
+/**
+ * Read a frame, of raw data, without copying the MCA. pMCA is allocated from
+ * the zero copy pool and points straight at the API histogram memory, so the
+ * frame is only acknowledged (in circular buffer mode) when the last user
+ * releases the NDArray.
+ *
+ * This only works if the API keeps the channels of a frame contiguous in
+ * memory, [numChannels][maxSpectra], which is checked on every frame, and
+ * the enabled channels are a single contiguous run.
+ *
+ * @param pSCA A pointer to the array to hold the SCAs
+ * @param pMCA Reference to a pointer to the NDArray that will be allocated
+ * @param frameNumber The frame to read from the current capture
+ * @param dims [maximum number of spectral bins, number of channels]
+ *
+ * @return true if the frame cannot be wrapped, in which case it has not been
+ *         consumed and should be read with readFrame instead
+ */
+bool Xspress3::readFrameZeroCopy(u_int32_t* pSCA, NDArray *&pMCA, int frameNumber, size_t dims[2])
+{
+    int xsp3Status = 0;
+    const char* functionName = "Xspress3::readFrameZeroCopy";
+    u_int32_t *pData;
+
+    pMCA = NULL;
+    if (chanRuns_.size() != 1) {
+        return true;
+    }
+    const int firstChan = chanRuns_[0].first;
+    pData = xsp3->histogram_get_data_ptr(this->xsp3_handle_, 0, 0, firstChan, frameNumber);
+    if (pData == NULL) {
+        return true;
+    }
+    for (size_t chan=1; chan<dims[1]; chan++) {
+        if (xsp3->histogram_get_data_ptr(this->xsp3_handle_, 0, 0, firstChan+chan, frameNumber) != pData + chan*dims[0]) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "%s Channels are not contiguous, copying frame %d.\n", functionName, frameNumber);
+            return true;
         }
-        else
-        {
-        setIntegerParam(NDArrayCounter, frameNumber+1);
     }
+    xsp3Status = xsp3->scaler_read(this->xsp3_handle_, pSCA, 0, firstChan, frameNumber, XSP3_SW_NUM_SCALERS, chanRuns_[0].second, 1);
+    if (xsp3Status != XSP3_OK) {
+        checkStatus(xsp3Status, "xsp3_scaler_read", functionName);
+        return true;
+    }
+    pMCA = pZeroCopyPool_->wrap(dims, pData, frameNumber);
+    if (pMCA == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s: ERROR: zero copy pool alloc failed.\n", functionName);
+        return true;
     }
-//    xsp3_histogram_circ_ack(this->xsp3_handle_, 0, frameOffset, this->numChannels_, 1);
+    return false;
+}
+
+/**
+ * Tell the API that frames have been read, so that in circular buffer mode
+ * the histogram memory can be reused. Does nothing otherwise.
+ *
+ * @param frameNumber The first frame to acknowledge
+ * @param numFrames The number of frames to acknowledge
+ */
+void Xspress3::ackFrames(int frameNumber, int numFrames)
+{
     if (circBuffer_ == 1) {
-    	xsp3_histogram_circ_ack(this->xsp3_handle_, 0, frameNumber, this->numChannels_, 1);
+        xsp3->histogram_circ_ack(this->xsp3_handle_, 0, frameNumber, this->numChannels_, numFrames);
     }
-    return error;
 }
 
 /**
@@ -1775,118 +2602,777 @@ const int Xspress3::waitForStartEvent(const char *message)
 }
 
 /**
- * Write the SCAs to the AD parameters
+ * Work out the dead time of a block of frames read out together, with
+ * the event widths taken by snapshotAcqConfig. This should only be called
+ * from the data task, once for each block read.
+ *
+ * @param pSCA A pointer to numFrames frames of SCAs from the hardware
+ * @param numChannels The number of xspress3 channels in each frame
+ * @param dataType The NDDataType_t of the SCA data (NDUInt32 or NDFloat64)
+ * @param numFrames The number of frames
+ *
+ * @return The dead time calculation, holding the results for each [frame][channel]
+ */
+const xsp3Deadtime &Xspress3::calculateDeadtime(const void *pSCA, int numChannels, NDDataType_t dataType, int numFrames)
+{
+    if (dataType == NDFloat64) {
+      acqDeadtime_.calculate(static_cast<const double*>(pSCA), numChannels, numFrames);
+    } else {
+      acqDeadtime_.calculate(static_cast<const u_int32_t*>(pSCA), numChannels, numFrames);
+    }
+    return acqDeadtime_;
+}
+
+/**
+ * Store the SCAs and dead time of a frame for writeOutScas. This does not
+ * need the driver lock. The results go in the half of results_ that is not
+ * holding the latest frame, so it should only be called from one thread,
+ * normally the publish task. The frame is also added to the scaler store
+ * and the SCA stream if they are enabled.
  *
  * @param pSCA A pointer to an array of SCAs from the hardware
+ * @param pDTPercent The dead time percent of each channel, from calculateDeadtime
+ * @param pDTFactor The dead time correction factor of each channel, from calculateDeadtime
  * @param numChannels The number of xspress3 channels in the SCA array
+ * @param dataType The NDDataType_t of the SCA data (NDUInt32 or NDFloat64)
+ * @param frameNumber The (1 based) number of the frame
  */
-void Xspress3::writeOutScas(void *&pSCA, int numChannels, NDDataType_t dataType)
+void Xspress3::storeScas(const void *pSCA, const double *pDTPercent, const double *pDTFactor, int numChannels, NDDataType_t dataType, int frameNumber)
 {
-    double allevt, resets, evtwidth, ctime;
-    double dtperc=0.0;
-    double dtfact=1.0;
+    xsp3FrameResults &results = results_[1 - resultsFront_];
+    const int numValues = XSP3_SW_NUM_SCALERS * numChannels;
     if (dataType == NDFloat64) {
-      double *pScaData = static_cast<double*>(pSCA);
-      for (int chan=0; chan<numChannels; ++chan) {
-        this->setDoubleParam(chan, this->xsp3ChanSca0Param, static_cast<epicsFloat64>(pScaData[0]));
-        this->setDoubleParam(chan, this->xsp3ChanSca1Param, static_cast<epicsFloat64>(pScaData[1]));
-        this->setDoubleParam(chan, this->xsp3ChanSca2Param, static_cast<epicsFloat64>(pScaData[2]));
-        this->setDoubleParam(chan, this->xsp3ChanSca3Param, static_cast<epicsFloat64>(pScaData[3]));
-        this->setDoubleParam(chan, this->xsp3ChanSca4Param, static_cast<epicsFloat64>(pScaData[4]));
-        this->setDoubleParam(chan, this->xsp3ChanSca5Param, static_cast<epicsFloat64>(pScaData[5]));
-        this->setDoubleParam(chan, this->xsp3ChanSca6Param, static_cast<epicsFloat64>(pScaData[6]));
-        this->setDoubleParam(chan, this->xsp3ChanSca7Param, static_cast<epicsFloat64>(pScaData[7]));
-
-        // MN set percent deadtime and deadtime correction factor here
-        ctime  = pScaData[0];
-        if (ctime > 10) {
-          getDoubleParam(chan, xsp3EventWidthParam, &evtwidth);
-          resets = pScaData[1];
-          allevt = pScaData[3];
-          dtperc = 100.0*(allevt*(evtwidth+1) + resets)/ctime;
-          dtfact = ctime/(ctime - (allevt*(evtwidth+1) + resets));
-	  //printf(":D> chan=%i, event_width=%.1f DTpercent=%.3f, DTfactor=%.6f", chan, evtwidth, dtperc, dtfact);
-	  setDoubleParam(chan, xsp3ChanDTPercentParam, static_cast<epicsFloat64>(dtperc));
-	  setDoubleParam(chan, xsp3ChanDTFactorParam, static_cast<epicsFloat64>(dtfact));
+      const double *pScaData = static_cast<const double*>(pSCA);
+      std::copy(pScaData, pScaData + numValues, results.sca.begin());
+    } else {
+      const u_int32_t *pScaData = static_cast<const u_int32_t*>(pSCA);
+      std::copy(pScaData, pScaData + numValues, results.sca.begin());
+    }
+    std::copy(pDTPercent, pDTPercent + numChannels, results.dtPercent.begin());
+    std::copy(pDTFactor, pDTFactor + numChannels, results.dtFactor.begin());
+    if (acqConfig_.roiEnabled) {
+      std::copy(roi_.getSums(), roi_.getSums() + maxNumRoi_ * numChannels, results.roi.begin());
+      results.numRois = maxNumRoi_;
+    } else {
+      results.numRois = 0;
+    }
+    results.accumulated = acqConfig_.accumulate ? accumFrames_ : -1;
+    if (acqConfig_.scalerArrays) {
+      scalerStore_.store(frameNumber - 1, &results.sca[0], &results.dtPercent[0], &results.dtFactor[0], numChannels);
+    }
+    results.frameNumber = frameNumber;
+    results.numChannels = numChannels;
+    if (acqConfig_.scaStreamFrames > 0) {
+      this->streamScas(results);
+    }
+
+    epicsMutexLock(resultsLock_);
+    resultsFront_ = 1 - resultsFront_;
+    resultsFresh_ = true;
+    epicsMutexUnlock(resultsLock_);
+    epicsEventSignal(resultsEvent_);
+}
+
+/**
+ * Add the SCAs and dead time of a frame to the NDArray of SCAs being
+ * filled, and publish it on NDArray address scaStreamAddr_ once it holds
+ * XSP3_SCA_STREAM_FRAMES frames. The NDArray is Float64 with dims
+ * [XSP3_SW_NUM_SCALERS + 2, channel], or [XSP3_SW_NUM_SCALERS + 2, channel,
+ * frame] for more than one frame, holding the SCAs of each channel followed
+ * by its dead time percent and correction factor. This should only be
+ * called from the publish task.
+ *
+ * @param results The SCAs and dead time of the frame
+ */
+void Xspress3::streamScas(const xsp3FrameResults &results)
+{
+    const int numValues = XSP3_SW_NUM_SCALERS + 2;
+    const int numFrames = acqConfig_.scaStreamFrames;
+    if (pScaStream_ == NULL) {
+        size_t dims[3] = {static_cast<size_t>(numValues), static_cast<size_t>(results.numChannels), static_cast<size_t>(numFrames)};
+        pScaStream_ = this->pNDArrayPool->alloc((numFrames > 1) ? 3 : 2, dims, NDFloat64, 0, NULL);
+        if (pScaStream_ == NULL) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "Xspress3::streamScas ERROR: Could not allocate an NDArray for the SCAs of frame %d.\n", results.frameNumber);
+            return;
         }
+        scaStreamFilled_ = 0;
+        double firstFrame = results.frameNumber;
+        pScaStream_->pAttributeList->add("FIRST_FRAME", "Number of the first frame", NDAttrFloat64, &firstFrame);
+    }
+    double *pOut = static_cast<double*>(pScaStream_->pData) + scaStreamFilled_ * numValues * results.numChannels;
+    const double *pSca = &results.sca[0];
+    for (int chan=0; chan<results.numChannels; chan++) {
+        std::copy(pSca, pSca + XSP3_SW_NUM_SCALERS, pOut);
+        pOut[XSP3_SW_NUM_SCALERS] = results.dtPercent[chan];
+        pOut[XSP3_SW_NUM_SCALERS + 1] = results.dtFactor[chan];
+        pSca += XSP3_SW_NUM_SCALERS;
+        pOut += numValues;
+    }
+    scaStreamFilled_++;
+    pScaStream_->uniqueId = results.frameNumber;
+    if (scaStreamFilled_ >= numFrames) {
+        this->flushScaStream();
+    }
+}
 
-        pScaData += XSP3_SW_NUM_SCALERS;
-      }
+/**
+ * Publish the NDArray of SCAs being filled by streamScas, if there is
+ * one, even if it does not hold XSP3_SCA_STREAM_FRAMES frames yet. The
+ * frame dimension is cut down to the frames it does hold. The uniqueId is
+ * the number of the last frame. This should only be called from the
+ * publish task.
+ */
+void Xspress3::flushScaStream()
+{
+    epicsTimeStamp currentTime;
+    if (pScaStream_ == NULL) {
+        return;
     }
-    else {
-      u_int32_t *pScaData = static_cast<u_int32_t*>(pSCA);
-      for (int chan=0; chan<numChannels; ++chan) {
-        this->setDoubleParam(chan, this->xsp3ChanSca0Param, static_cast<epicsFloat64>(pScaData[0]));
-        this->setDoubleParam(chan, this->xsp3ChanSca1Param, static_cast<epicsFloat64>(pScaData[1]));
-        this->setDoubleParam(chan, this->xsp3ChanSca2Param, static_cast<epicsFloat64>(pScaData[2]));
-        this->setDoubleParam(chan, this->xsp3ChanSca3Param, static_cast<epicsFloat64>(pScaData[3]));
-        this->setDoubleParam(chan, this->xsp3ChanSca4Param, static_cast<epicsFloat64>(pScaData[4]));
-        this->setDoubleParam(chan, this->xsp3ChanSca5Param, static_cast<epicsFloat64>(pScaData[5]));
-        this->setDoubleParam(chan, this->xsp3ChanSca6Param, static_cast<epicsFloat64>(pScaData[6]));
-        this->setDoubleParam(chan, this->xsp3ChanSca7Param, static_cast<epicsFloat64>(pScaData[7]));
-
-        // MN set percent deadtime and deadtime correction factor here
-        ctime  = 1.0*pScaData[0];
-        if (ctime > 10) {
-          getDoubleParam(chan, xsp3EventWidthParam, &evtwidth);
-          resets = 1.0*pScaData[1];
-          allevt = 1.0*pScaData[3];
-          dtperc = 100.0*(allevt*(evtwidth+1) + resets)/ctime;
-          dtfact = ctime/(ctime - (allevt*(evtwidth+1) + resets));
-	  // printf(":I> chan=%i, event_width=%.1f DTpercent=%.3f, DTfactor=%.6f\n", chan, evtwidth, dtperc, dtfact);
-	  // setDoubleParam(chan, xsp3ChanDTPercentParam, static_cast<epicsFloat64>(dtperc));
-	  // setDoubleParam(chan, xsp3ChanDTFactorParam, static_cast<epicsFloat64>(dtfact));
-	  setDoubleParam(chan, xsp3ChanDTPercentParam, dtperc);
-	  setDoubleParam(chan, xsp3ChanDTFactorParam, dtfact);
-        }
-        pScaData += XSP3_SW_NUM_SCALERS;
+    if (pScaStream_->ndims > 2) {
+        pScaStream_->dims[2].size = scaStreamFilled_;
+    }
+    epicsTimeGetCurrent(&currentTime);
+    pScaStream_->timeStamp = currentTime.secPastEpoch + currentTime.nsec/1e9;
+    pScaStream_->pAttributeList->add("TIMESTAMP", "Host Timestamp", NDAttrFloat64, &(pScaStream_->timeStamp));
+    pScaStream_->pAttributeList->add("CHANNEL_MAP", "Detector channel of each row", NDAttrString, (void*)chanMapString_.c_str());
+    if (acqConfig_.arrayCallbacks) {
+        this->doCallbacksGenericPointer(pScaStream_, NDArrayData, scaStreamAddr_);
+    }
+    pScaStream_->release();
+    pScaStream_ = NULL;
+    scaStreamFilled_ = 0;
+}
+
+/**
+ * Write the SCAs and dead time of the latest frame stored by storeScas to
+ * the AD parameters, and set NDArrayCounter to its number. Each block of
+ * SCAs is written to the detector channel given by chanMap_. This should
+ * be called with the driver locked.
+ *
+ * @return true if there was a frame that had not been written out yet
+ */
+bool Xspress3::writeOutScas()
+{
+    bool fresh;
+    epicsMutexLock(resultsLock_);
+    fresh = resultsFresh_;
+    if (fresh) {
+      resultsOut_ = results_[resultsFront_];
+      resultsFresh_ = false;
+    }
+    epicsMutexUnlock(resultsLock_);
+    if (!fresh) {
+      return false;
+    }
+
+    const double *pScaData = &resultsOut_.sca[0];
+    for (int chan=0; chan<resultsOut_.numChannels; ++chan) {
+      const int addr = chanMap_[chan];
+      this->setDoubleParam(addr, this->xsp3ChanSca0Param, static_cast<epicsFloat64>(pScaData[0]));
+      this->setDoubleParam(addr, this->xsp3ChanSca1Param, static_cast<epicsFloat64>(pScaData[1]));
+      this->setDoubleParam(addr, this->xsp3ChanSca2Param, static_cast<epicsFloat64>(pScaData[2]));
+      this->setDoubleParam(addr, this->xsp3ChanSca3Param, static_cast<epicsFloat64>(pScaData[3]));
+      this->setDoubleParam(addr, this->xsp3ChanSca4Param, static_cast<epicsFloat64>(pScaData[4]));
+      this->setDoubleParam(addr, this->xsp3ChanSca5Param, static_cast<epicsFloat64>(pScaData[5]));
+      this->setDoubleParam(addr, this->xsp3ChanSca6Param, static_cast<epicsFloat64>(pScaData[6]));
+      this->setDoubleParam(addr, this->xsp3ChanSca7Param, static_cast<epicsFloat64>(pScaData[7]));
+
+      // MN set percent deadtime and deadtime correction factor here
+      // Frames with too few clock ticks carry the last dead time over, as acqDeadtime_ works it out
+      setDoubleParam(addr, xsp3ChanDTPercentParam, static_cast<epicsFloat64>(resultsOut_.dtPercent[chan]));
+      setDoubleParam(addr, xsp3ChanDTFactorParam, static_cast<epicsFloat64>(resultsOut_.dtFactor[chan]));
+      for (int roi=0; roi<resultsOut_.numRois; roi++) {
+        setDoubleParam(addr, xsp3ChanRoiValueParam[roi], static_cast<epicsFloat64>(resultsOut_.roi[chan*maxNumRoi_ + roi]));
       }
+      pScaData += XSP3_SW_NUM_SCALERS;
     }
+    if (resultsOut_.accumulated >= 0) {
+      this->setIntegerParam(xsp3AccumulatedFramesParam, resultsOut_.accumulated);
+    }
+    this->setIntegerParam(NDArrayCounter, resultsOut_.frameNumber);
+    return true;
 }
 
 /**
- * Set parameters as they should be at the start of an acquisition
+ * Set parameters as they should be at the start of an acquisition, and fix
+ * the channels to read out for it.
  *
  */
 void Xspress3::setStartingParameters()
 {
+    size_t dims[2];
+    this->setChannelMap();
+    this->getDims(dims);
+    this->setIntegerParam(this->NDArraySizeX, dims[0]);
+    this->setIntegerParam(this->NDArraySizeY, dims[1]);
     this->setIntegerParam(this->NDArrayCounter, 0);
     this->setIntegerParam(this->xsp3FrameCountParam, 0);
+    this->setIntegerParam(this->xsp3QueueUsedParam, 0);
+    this->setIntegerParam(this->xsp3DroppedFramesParam, 0);
+    this->setIntegerParam(this->xsp3AccumulatedFramesParam, 0);
+    epicsAtomicSetIntT(&accumReset_, 1);
+    epicsAtomicSetIntT(&framesAcquired_, 0);
+    epicsAtomicSetIntT(&droppedFrames_, 0);
+    this->stageTimes_.reset();
+    this->stageWindowStart_ = xsp3StageTimes::now();
+    this->readoutStart_ = this->readoutUpdate_ = this->stageWindowStart_;
+    this->readoutAcquired_ = this->readoutFrames_ = this->peakBacklog_ = 0;
+    this->setIntegerParam(this->xsp3BacklogParam, 0);
+    this->setIntegerParam(this->xsp3PeakBacklogParam, 0);
+    this->setDoubleParam(this->xsp3TimeToOverflowParam, -1.0);
+    this->setDoubleParam(this->xsp3FrameRateParam, 0.0);
+    this->setDoubleParam(this->xsp3ReadRateParam, 0.0);
+    this->setDoubleParam(this->xsp3ReadRateAvgParam, 0.0);
+    this->setDoubleParam(this->xsp3ReadMBRateParam, 0.0);
+    this->setDoubleParam(this->xsp3ReadMBRateAvgParam, 0.0);
     this->setIntegerParam(this->ADStatus, ADStatusAcquire);
     this->setStringParam(this->ADStatusMessage, "Acquiring Data");
     this->callParamCallbacks();
 }
 
 /**
- * Dead time corrected data is double precision floating point
- * uncorrected data is unsigned 32 bit integers so find out
- * which one and return it
+ * Take the configuration of the next acquisition from the parameter
+ * library, and a copy of the event widths for the dead time calculation,
+ * so nothing needs to be read from the parameter library while it runs.
+ * This should be called with the driver locked, and only by the data task
+ * when the publish task is idle.
+ *
+ * @return The configuration, which stays the same until the next call
+ */
+const xsp3AcqConfig &Xspress3::snapshotAcqConfig()
+{
+    int arrayCallbacks, roiEnable, roiReadoutMode, accumulate, scalerArrays, scaStream, queueDrop;
+    acqConfig_.dataType = this->getDataType();
+    acqConfig_.readType = this->getReadDataType();
+    acqConfig_.windowed = this->getEnergyWindow(acqConfig_.firstBin, acqConfig_.numBins, acqConfig_.rebin);
+    this->getDims(acqConfig_.dims);
+    acqConfig_.numFrames = this->getNumFramesToAcquire();
+    this->getIntegerParam(xsp3NumChannelsParam, &acqConfig_.numApiChannels);
+    acqConfig_.numApiChannels = std::max(1, std::min(acqConfig_.numApiChannels, this->numChannels_));
+    acqConfig_.batchSize = this->getBatchSize();
+    this->getIntegerParam(xsp3QueueDepthParam, &acqConfig_.queueDepth);
+    this->getIntegerParam(xsp3QueueDropParam, &queueDrop);
+    acqConfig_.queueDrop = (queueDrop != 0);
+    acqConfig_.pushReadout = (this->getPushReadout() != 0);
+    acqConfig_.zeroCopy = this->getZeroCopy();
+    this->getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    acqConfig_.arrayCallbacks = (arrayCallbacks != 0);
+    acqConfig_.scaAttributes = this->hasScaAttributes();
+    acqConfig_.paramUpdatePeriod = this->getParamUpdatePeriod();
+    this->getIntegerParam(xsp3RoiReadoutModeParam, &roiReadoutMode);
+    acqConfig_.hwRoi = (roiReadoutMode == roiReadoutHardware_) && (hwRoiBins_ > 0);
+    if (acqConfig_.hwRoi) {
+        // The spectra read are the ROI sums, so read them all and nothing else
+        acqConfig_.numRoiBins = hwRoiBins_;
+        acqConfig_.firstBin = 0;
+        acqConfig_.numBins = acqConfig_.numRoiBins;
+        acqConfig_.rebin = 1;
+        acqConfig_.windowed = true;
+        acqConfig_.dims[0] = acqConfig_.numRoiBins;
+        acqConfig_.zeroCopy = false;
+    } else if (roiReadoutMode == roiReadoutSoftware_) {
+        acqConfig_.numRoiBins = this->getNumRoiBins(chanMap_);
+    } else {
+        acqConfig_.numRoiBins = 0;
+    }
+    if (acqConfig_.numRoiBins > 0) {
+        this->setIntegerParam(this->NDArraySizeX, acqConfig_.numRoiBins);
+    }
+    this->getIntegerParam(xsp3RoiEnableParam, &roiEnable);
+    acqConfig_.roiEnabled = (roiEnable == ctrlEnable_) || (acqConfig_.numRoiBins > 0);
+    if (acqConfig_.roiEnabled) {
+        this->setRoiLimits();
+    }
+    this->getIntegerParam(xsp3AccumulateParam, &accumulate);
+    acqConfig_.accumulate = (accumulate == ctrlEnable_);
+    this->getIntegerParam(xsp3AccumulatePeriodParam, &acqConfig_.accumulatePeriod);
+    this->getIntegerParam(xsp3ScalerArraysParam, &scalerArrays);
+    acqConfig_.scalerArrays = (scalerArrays == ctrlEnable_);
+    this->getDoubleParam(xsp3ScalerArraysPeriodParam, &acqConfig_.scalerArraysPeriod);
+    this->getIntegerParam(xsp3ScaStreamParam, &scaStream);
+    this->getIntegerParam(xsp3ScaStreamFramesParam, &acqConfig_.scaStreamFrames);
+    if (scaStream == ctrlEnable_) {
+        acqConfig_.scaStreamFrames = std::min(std::max(acqConfig_.scaStreamFrames, 1), static_cast<int>(maxBatchFrames_));
+    } else {
+        acqConfig_.scaStreamFrames = 0;
+    }
+    // Allocated here, rather than as frames arrive, and freed when it is not used
+    scalerStore_.resize(acqConfig_.scalerArrays ? this->getMaxNumFrames() : 0);
+    this->setIntegerParam(xsp3ScalerArraysFramesParam, 0);
+    this->setIntegerParam(NDDataType, acqConfig_.dataType);
+    acqDeadtime_.copySettings(deadtime_);
+    return acqConfig_;
+}
+
+/**
+ * Change the configuration of the acquisition to read each frame straight
+ * into its NDArray, for when the staging arrays that batching, conversion
+ * and rebinning need could not be allocated. Without them all the bins of
+ * the energy window are read, raw data stays raw (UInt16 is published as
+ * the UInt32 read) and only a driver dead time correction falls back to the
+ * API doing it, as that is the only way to get corrected data unstaged. Each
+ * change is logged. Everything that depends on the type and geometry of the
+ * frames (the ROI limits, NDArraySizeX and NDDataType) is set up again to
+ * match. This should be called with the driver locked, by the data task
+ * after snapshotAcqConfig and before it queues any frames.
+ *
+ * @return The configuration, which stays the same until the next call
+ */
+const xsp3AcqConfig &Xspress3::unstageAcqConfig()
+{
+    const char *functionName = "Xspress3::unstageAcqConfig";
+    bool changed = false;
+    acqConfig_.batchSize = 1;
+    if (acqConfig_.dataType == NDUInt16) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s: Without staging arrays the raw frames are published as UInt32, not packed into UInt16.\n", functionName);
+        acqConfig_.dataType = NDUInt32;
+        changed = true;
+    } else if (acqConfig_.dataType != acqConfig_.readType) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s: Without staging arrays the dead time correction is done by the API, in Float64.\n", functionName);
+        acqConfig_.dataType = acqConfig_.readType = NDFloat64;
+        changed = true;
+    }
+    if (acqConfig_.rebin > 1) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s: Without staging arrays the frames are not rebinned.\n", functionName);
+        acqConfig_.rebin = 1;
+        acqConfig_.dims[0] = acqConfig_.numBins;
+        changed = true;
+    }
+    if (changed) {
+        if (acqConfig_.numRoiBins == 0) {
+            this->setIntegerParam(this->NDArraySizeX, acqConfig_.dims[0]);
+        }
+        this->setIntegerParam(NDDataType, acqConfig_.dataType);
+        if (acqConfig_.roiEnabled) {
+            this->setRoiLimits();
+        }
+    }
+    this->setStringParam(ADStatusMessage, "Acquiring Without Staging Memory. Check IOC Log.");
+    this->callParamCallbacks();
+    return acqConfig_;
+}
+
+/**
+ * Give roi_ the MCA ROI limits of each channel that is read out, mapped
+ * onto the energy window in acqConfig_, and name the NDAttribute of each
+ * ROI after its detector channel (eg. CHAN1ROI1). When the hardware sums
+ * the ROIs each one is a bin of the spectra read instead. This should be
+ * called with the driver locked, after the channel map has been fixed.
+ */
+void Xspress3::setRoiLimits()
+{
+    char attrName[32];
+    int llm, hlm;
+    roiAttrNames_.resize(maxNumRoi_ * chanMap_.size());
+    for (size_t chan=0; chan<chanMap_.size(); chan++) {
+        for (int roi=0; roi<maxNumRoi_; roi++) {
+            if (acqConfig_.hwRoi) {
+                llm = roi;
+                hlm = (roi < acqConfig_.numRoiBins) ? roi + 1 : roi;
+            } else {
+                this->getIntegerParam(chanMap_[chan], xsp3ChanRoiLlmParam[roi], &llm);
+                this->getIntegerParam(chanMap_[chan], xsp3ChanRoiHlmParam[roi], &hlm);
+            }
+            roi_.setLimits(chan, roi, llm, hlm);
+            epicsSnprintf(attrName, sizeof(attrName), "CHAN%dROI%d", chanMap_[chan]+1, roi+1);
+            roiAttrNames_[chan*maxNumRoi_ + roi] = attrName;
+        }
+    }
+    roi_.setWindow(acqConfig_.firstBin, static_cast<int>(acqConfig_.dims[0]), acqConfig_.rebin);
+}
+
+/**
+ * Sum the MCA ROIs of a frame into roi_, for storeScas to pick up, and
+ * add each ROI that is defined to the NDArray as a CHAN<n>ROI<m>
+ * attribute. This should only be called from the publish task.
+ *
+ * @param pMCA The NDArray holding the MCA data for the frame
+ */
+void Xspress3::sumRois(NDArray *pMCA)
+{
+    const int numBins = static_cast<int>(pMCA->dims[0].size);
+    const int numChannels = static_cast<int>(pMCA->dims[1].size);
+    switch (pMCA->dataType) {
+    case NDUInt32:
+        roi_.calculate(static_cast<const u_int32_t*>(pMCA->pData), numChannels, numBins);
+        break;
+    case NDUInt16:
+        roi_.calculate(static_cast<const epicsUInt16*>(pMCA->pData), numChannels, numBins);
+        break;
+    case NDFloat32:
+        roi_.calculate(static_cast<const float*>(pMCA->pData), numChannels, numBins);
+        break;
+    default:
+        roi_.calculate(static_cast<const double*>(pMCA->pData), numChannels, numBins);
+        break;
+    }
+    const double *pSums = roi_.getSums();
+    for (int chan=0; chan<numChannels; chan++) {
+        for (int roi=0; roi<maxNumRoi_; roi++) {
+            if (roi_.isDefined(chan, roi)) {
+                double sum = pSums[chan*maxNumRoi_ + roi];
+                pMCA->pAttributeList->add(roiAttrNames_[chan*maxNumRoi_ + roi].c_str(), "MCA ROI sum", NDAttrFloat64, &sum);
+            }
+        }
+    }
+}
+
+/**
+ * Copy the ROI sums of a frame into an NDArray of [channel][ROI]. Sums
+ * too big for T saturate at its maximum, as a ROI can sum more counts
+ * than any one bin of an integer spectrum holds.
+ */
+template <typename T> static void copyRoiSums(const double *pSums, int numRois, T *pData, int numChannels, int numBins)
+{
+    const double maxSum = static_cast<double>(std::numeric_limits<T>::max());
+    for (int chan=0; chan<numChannels; chan++) {
+        for (int roi=0; roi<numBins; roi++) {
+            double sum = pSums[chan*numRois + roi];
+            pData[chan*numBins + roi] = static_cast<T>((sum > maxSum) ? maxSum : sum);
+        }
+    }
+}
+
+/**
+ * Replace the NDArray of a frame with one of its ROI sums, for
+ * XSP3_ROI_READOUT when the hardware cannot sum the ROIs. sumRois must
+ * already have been called for the frame. The new NDArray has the same
+ * type and attributes, and the old one is released. This should only be
+ * called from the publish task.
+ *
+ * @param pMCA The NDArray holding the MCA data for the frame
+ *
+ * @return The NDArray of the ROI sums, or pMCA if one could not be allocated
+ */
+NDArray *Xspress3::roiArray(NDArray *pMCA)
+{
+    const int numChannels = static_cast<int>(pMCA->dims[1].size);
+    const int numBins = acqConfig_.numRoiBins;
+    size_t dims[2] = {static_cast<size_t>(numBins), static_cast<size_t>(numChannels)};
+    NDArray *pRoi = this->pNDArrayPool->alloc(2, dims, pMCA->dataType, 0, NULL);
+    if (pRoi == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "Xspress3::roiArray ERROR: Could not allocate an NDArray for the ROI sums, publishing the spectra.\n");
+        return pMCA;
+    }
+    const double *pSums = roi_.getSums();
+    switch (pMCA->dataType) {
+    case NDUInt32:
+        copyRoiSums(pSums, maxNumRoi_, static_cast<u_int32_t*>(pRoi->pData), numChannels, numBins);
+        break;
+    case NDUInt16:
+        copyRoiSums(pSums, maxNumRoi_, static_cast<epicsUInt16*>(pRoi->pData), numChannels, numBins);
+        break;
+    case NDFloat32:
+        copyRoiSums(pSums, maxNumRoi_, static_cast<float*>(pRoi->pData), numChannels, numBins);
+        break;
+    default:
+        copyRoiSums(pSums, maxNumRoi_, static_cast<double*>(pRoi->pData), numChannels, numBins);
+        break;
+    }
+    pMCA->pAttributeList->copy(pRoi->pAttributeList);
+    pMCA->release();
+    return pRoi;
+}
+
+/**
+ * Add the spectra of a frame to the accumulated spectra, and publish them
+ * if XSP3_ACCUMULATE_PERIOD frames have been added since they were last
+ * published. The sum is cleared first if a reset has been asked for, or
+ * if the frame is not the same shape as the frames already in it. This
+ * should only be called from the publish task.
+ *
+ * @param pMCA The NDArray holding the MCA data for the frame
+ * @param frameNumber The (1 based) number of the frame
+ */
+void Xspress3::accumulate(NDArray *pMCA, int frameNumber)
+{
+    const size_t numBins = pMCA->dims[0].size;
+    const size_t numChannels = pMCA->dims[1].size;
+    const int numValues = static_cast<int>(numBins * numChannels);
+    if (epicsAtomicCmpAndSwapIntT(&accumReset_, 1, 0) || (numBins != accumDims_[0]) || (numChannels != accumDims_[1])) {
+        accumSum_.assign(numValues, 0.0);
+        accumDims_[0] = numBins;
+        accumDims_[1] = numChannels;
+        accumFrames_ = accumPublished_ = 0;
+    }
+    switch (pMCA->dataType) {
+    case NDUInt32:
+        xsp3Spectrum::accumulate(static_cast<const u_int32_t*>(pMCA->pData), numValues, &accumSum_[0]);
+        break;
+    case NDUInt16:
+        xsp3Spectrum::accumulate(static_cast<const epicsUInt16*>(pMCA->pData), numValues, &accumSum_[0]);
+        break;
+    case NDFloat32:
+        xsp3Spectrum::accumulate(static_cast<const float*>(pMCA->pData), numValues, &accumSum_[0]);
+        break;
+    default:
+        xsp3Spectrum::accumulate(static_cast<const double*>(pMCA->pData), numValues, &accumSum_[0]);
+        break;
+    }
+    accumFrames_++;
+    accumLastFrame_ = frameNumber;
+    if ((acqConfig_.accumulatePeriod > 0) && (accumFrames_ - accumPublished_ >= acqConfig_.accumulatePeriod)) {
+        this->publishAccumulated();
+    }
+}
+
+/**
+ * Publish a copy of the accumulated spectra, as a Float64 NDArray of
+ * [bin, channel] on NDArray address accumulateAddr_, if any frames have
+ * been added since they were last published. The uniqueId is the number of
+ * the last frame added and the ACCUMULATED_FRAMES attribute holds how many
+ * frames have been added. This should only be called from the publish task.
+ */
+void Xspress3::publishAccumulated()
+{
+    if ((accumFrames_ == accumPublished_) || accumSum_.empty()) {
+        return;
+    }
+    NDArray *pSum = this->pNDArrayPool->alloc(2, accumDims_, NDFloat64, 0, NULL);
+    if (pSum == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "Xspress3::publishAccumulated ERROR: Could not allocate an NDArray for the accumulated spectra.\n");
+        return;
+    }
+    memcpy(pSum->pData, &accumSum_[0], accumSum_.size() * sizeof(double));
+    this->setNDArrayAttributes(pSum, accumLastFrame_);
+    pSum->pAttributeList->add("ACCUMULATED_FRAMES", "Frames in the accumulated spectra", NDAttrInt32, &accumFrames_);
+    accumPublished_ = accumFrames_;
+    if (acqConfig_.arrayCallbacks) {
+        this->doCallbacksGenericPointer(pSum, NDArrayData, accumulateAddr_);
+    }
+    pSum->release();
+}
+
+/**
+ * Check whether any PARAM NDAttributes read the parameters that are set
+ * for each frame (the SCAs, dead time, MCA ROI sums and NDArrayCounter). If they do the
+ * parameters have to be written before the attributes of every frame are
+ * read, which needs the driver lock, rather than only when the parameter
+ * update task gets round to it. This should be called with the driver locked.
+ *
+ * @return true if the publish task should write out the SCAs of every frame
+ */
+bool Xspress3::hasScaAttributes()
+{
+    static const char *frameParams[] = {
+        xsp3ChanSca0ParamString, xsp3ChanSca1ParamString, xsp3ChanSca2ParamString, xsp3ChanSca3ParamString,
+        xsp3ChanSca4ParamString, xsp3ChanSca5ParamString, xsp3ChanSca6ParamString, xsp3ChanSca7ParamString,
+        xsp3ChanDTPercentParamString, xsp3ChanDTFactorParamString, NDArrayCounterString
+    };
+    NDAttrSource_t sourceType;
+    char roiParam[64];
+    for (NDAttribute *pAttr = this->pAttributeList->next(NULL); pAttr != NULL; pAttr = this->pAttributeList->next(pAttr)) {
+        pAttr->getSourceInfo(&sourceType);
+        if (sourceType != NDAttrSourceParam) {
+            continue;
+        }
+        for (size_t i=0; i<sizeof(frameParams)/sizeof(frameParams[0]); i++) {
+            if (strcmp(pAttr->getSource(), frameParams[i]) == 0) {
+                return true;
+            }
+        }
+        for (int roi=0; roi<maxNumRoi_; roi++) {
+            epicsSnprintf(roiParam, sizeof(roiParam), xsp3ChanRoiValueParamString, roi+1);
+            if (strcmp(pAttr->getSource(), roiParam) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Dead time corrected data is floating point (double precision unless
+ * XSP3_DTC_MODE asks for single precision from the driver correction)
+ * uncorrected data is unsigned 32 bit integers (or 16 bit if
+ * XSP3_RAW_DATA_TYPE asks for it) so find out which one and return it
  * @return const NDDataType_t the type as specified in the NDDataType_t enum
  */
 const NDDataType_t Xspress3::getDataType()
 {
-    int deadTimeCorrect;
+    int deadTimeCorrect, dtcMode, rawDataType;
     this->getIntegerParam(this->xsp3DtcEnableParam, &deadTimeCorrect);
-    if (deadTimeCorrect) {
+    this->getIntegerParam(this->xsp3DtcModeParam, &dtcMode);
+    this->getIntegerParam(this->xsp3RawDataTypeParam, &rawDataType);
+    if (deadTimeCorrect && (dtcMode == dtcModeDriverFloat32_)) {
+        return NDFloat32;
+    } else if (deadTimeCorrect) {
         return NDFloat64;
+    } else if (rawDataType == rawDataTypeUInt16_) {
+        return NDUInt16;
     } else {
         return NDUInt32;
     }
 }
 
 /**
- * Get the dimensions of a frame from the xsp3 parameters
- * as [maxSpectra, numChannels]
+ * The type of the data read from the API. This is only double precision
+ * when the API is doing the dead time correction, otherwise the raw
+ * unsigned 32 bit integers are read (and corrected by the driver if needed).
+ * The SCAs read alongside the MCA have the same type.
+ * @return const NDDataType_t the type as specified in the NDDataType_t enum
+ */
+const NDDataType_t Xspress3::getReadDataType()
+{
+    int deadTimeCorrect, dtcMode;
+    this->getIntegerParam(this->xsp3DtcEnableParam, &deadTimeCorrect);
+    this->getIntegerParam(this->xsp3DtcModeParam, &dtcMode);
+    if (deadTimeCorrect && (dtcMode == dtcModeAPI_)) {
+        return NDFloat64;
+    } else {
+        return NDUInt32;
+    }
+}
+
+/**
+ * Convert a frame of raw data into the type of pMCA.
+ *
+ * For NDFloat64 and NDFloat32 the dead time correction is applied. The
+ * correction factor for each channel is worked out by the API from the raw
+ * scalers, so this matches what xsp3_hist_dtc_read4d would have done.
+ *
+ * For NDUInt16 each bin is clipped to 65535 and the number of clipped bins
+ * is stored in the MCA_OVERFLOW attribute.
+ *
+ * @param pRawMCA The raw MCA as [numChannels][maxSpectra]
+ * @param pSCA The raw SCAs as [numChannels][XSP3_SW_NUM_SCALERS]
+ * @param pMCA The NDArray to write the converted MCA to
+ * @param numChannels The number of channels in the frame
+ * @param maxSpectra The number of spectral bins per channel
+ *
+ * @return true if a correction factor could not be calculated otherwise false
+ */
+bool Xspress3::convertFrame(u_int32_t *pRawMCA, u_int32_t *pSCA, NDArray *pMCA, int numChannels, int maxSpectra)
+{
+    const char* functionName = "Xspress3::convertFrame";
+    bool error = false;
+    int xsp3Status;
+    double dtcFactor, dtcAllEvent;
+
+    if (pMCA->dataType == NDUInt16) {
+        epicsInt32 overflows = xsp3Spectrum::saturate(pRawMCA, numChannels*maxSpectra, static_cast<epicsUInt16*>(pMCA->pData));
+        pMCA->pAttributeList->add("MCA_OVERFLOW", "Number of bins clipped to 16 bits", NDAttrInt32, &overflows);
+        return false;
+    }
+    for (int chan=0; chan<numChannels; chan++) {
+        xsp3Status = xsp3->get_dtcfactor(this->xsp3_handle_, pSCA + chan*XSP3_SW_NUM_SCALERS, &dtcFactor, &dtcAllEvent, chanMap_[chan]);
+        if (xsp3Status != XSP3_OK) {
+            checkStatus(xsp3Status, "xsp3_calculateDeadtimeCorrectionFactors", functionName);
+            dtcFactor = 1.0;
+            error = true;
+        }
+        if (pMCA->dataType == NDFloat32) {
+            xsp3Deadtime::correct(pRawMCA + chan*maxSpectra, dtcFactor, maxSpectra, static_cast<float*>(pMCA->pData) + chan*maxSpectra);
+        }
+        else {
+            xsp3Deadtime::correct(pRawMCA + chan*maxSpectra, dtcFactor, maxSpectra, static_cast<double*>(pMCA->pData) + chan*maxSpectra);
+        }
+    }
+    return error;
+}
+
+/**
+ * Get the dimensions of a published frame from the xsp3 parameters
+ * as [number of spectral bins, number of enabled channels]. The number of
+ * spectral bins is maxSpectra reduced by the energy window and rebin factor.
  *
  * @param dims A reference to an array to store the dimensions in
  */
 void Xspress3::getDims(size_t (&dims)[2])
 {
-    int numChannels, maxSpectra;
+    int firstBin, numBins, rebin;
+    std::vector<int> chanMap;
+    this->getChannelMap(chanMap);
+    this->getEnergyWindow(firstBin, numBins, rebin);
+    dims[0] = numBins / rebin;
+    dims[1] = chanMap.size();
+}
+
+/**
+ * Get the channels enabled for readout with XSP3_CHAN_ENABLE, in order.
+ * If every channel has been disabled they are all read out, as an empty
+ * frame is of no use to anyone.
+ *
+ * @param chanMap A reference to a vector to store the channel numbers in
+ */
+void Xspress3::getChannelMap(std::vector<int> &chanMap)
+{
+    int numChannels, enable;
+    this->getIntegerParam(this->xsp3NumChannelsParam, &numChannels);
+    chanMap.clear();
+    for (int chan=0; chan<numChannels; chan++) {
+        this->getIntegerParam(chan, this->xsp3ChanEnableParam, &enable);
+        if (enable) {
+            chanMap.push_back(chan);
+        }
+    }
+    if (chanMap.empty()) {
+        for (int chan=0; chan<numChannels; chan++) {
+            chanMap.push_back(chan);
+        }
+    }
+}
+
+/**
+ * Fix the enabled channels for the next acquisition. This sets chanMap_,
+ * splits it into the contiguous runs of channels that readFrames reads
+ * with one call each, and passes it on to the dead time calculation.
+ * It must only be called while the publish task is idle.
+ *
+ * @return true if some channels are not being read out
+ */
+bool Xspress3::setChannelMap()
+{
+    int numChannels;
+    char chanString[16];
     this->getIntegerParam(this->xsp3NumChannelsParam, &numChannels);
+    this->getChannelMap(chanMap_);
+    chanRuns_.clear();
+    chanMapString_.clear();
+    for (size_t i=0; i<chanMap_.size(); i++) {
+        if ((i > 0) && (chanMap_[i] == chanMap_[i-1] + 1)) {
+            chanRuns_.back().second++;
+        } else {
+            chanRuns_.push_back(std::make_pair(chanMap_[i], 1));
+        }
+        epicsSnprintf(chanString, sizeof(chanString), (i > 0) ? ",%d" : "%d", chanMap_[i]);
+        chanMapString_ += chanString;
+    }
+    deadtime_.setChannelMap(chanMap_);
+    return static_cast<int>(chanMap_.size()) != numChannels;
+}
+
+/**
+ * Get the range of spectral bins to read and how much to rebin them by.
+ * XSP3_ENERGY_BINS of 0 reads to the end of the spectrum. The range is
+ * clipped to maxSpectra and trimmed to a multiple of the rebin factor.
+ * The rebin factor is rounded down to the largest power of 2 that is no
+ * more than the number of bins, as xsp3Spectrum::rebin expects.
+ *
+ * @param firstBin The first spectral bin to read
+ * @param numBins The number of spectral bins to read for each channel
+ * @param rebin The number of adjacent bins to sum into each published bin
+ *
+ * @return true if the published spectra are smaller than maxSpectra
+ */
+bool Xspress3::getEnergyWindow(int &firstBin, int &numBins, int &rebin)
+{
+    int maxSpectra;
     this->getIntegerParam(this->xsp3MaxSpectraParam, &maxSpectra);
-    dims[0] = maxSpectra;
-    dims[1] = numChannels;
+    this->getIntegerParam(this->xsp3EnergyStartParam, &firstBin);
+    this->getIntegerParam(this->xsp3EnergyBinsParam, &numBins);
+    this->getIntegerParam(this->xsp3RebinParam, &rebin);
+    firstBin = std::max(0, std::min(firstBin, maxSpectra - 1));
+    if ((numBins <= 0) || (numBins > maxSpectra - firstBin)) {
+        numBins = maxSpectra - firstBin;
+    }
+    int maxRebin = std::max(1, std::min(rebin, numBins));
+    rebin = 1;
+    while (rebin * 2 <= maxRebin) {
+        rebin *= 2;
+    }
+    numBins -= numBins % rebin;
+    return (firstBin != 0) || (numBins != maxSpectra) || (rebin != 1);
 }
 
 /**
@@ -1898,13 +3384,12 @@ void Xspress3::getDims(size_t (&dims)[2])
  */
 void Xspress3::setNDArrayAttributes(NDArray *&pMCA, int frameNumber)
 {
-    int arrayCallbacks = 0;
     epicsTimeStamp currentTime;
-    this->getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
     epicsTimeGetCurrent(&currentTime);
     pMCA->uniqueId = frameNumber;
     pMCA->timeStamp = currentTime.secPastEpoch + currentTime.nsec/1e9;
     pMCA->pAttributeList->add("TIMESTAMP", "Host Timestamp", NDAttrFloat64, &(pMCA->timeStamp));
+    pMCA->pAttributeList->add("CHANNEL_MAP", "Detector channel of each row", NDAttrString, (void*)chanMapString_.c_str());
     this->getAttributes(pMCA->pAttributeList);
 }
 
@@ -1939,6 +3424,18 @@ int Xspress3::getNumFramesToAcquire()
     return numFrames;
 }
 
+/**
+ * A getter for the maximum number of frames to read in one batch
+ *
+ * @return The batch size stored in xsp3BatchReadoutParam
+ */
+int Xspress3::getBatchSize()
+{
+    int batchSize;
+    this->getIntegerParam(xsp3BatchReadoutParam, &batchSize);
+    return batchSize;
+}
+
 int Xspress3::getMaxNumFrames()
 {
     int maxnum;
@@ -1957,6 +3454,17 @@ void Xspress3::doNDCallbacksIfRequired(NDArray *pMCA)
 {
     int arrayCallbacks;
     this->getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    this->doNDCallbacksIfRequired(pMCA, arrayCallbacks != 0);
+}
+
+/**
+ * Do the NDArray callbacks for pMCA, without reading NDArrayCallbacks
+ *
+ * @param pMCA The NDArray to pass to the plugins
+ * @param arrayCallbacks true if NDArrayCallbacks is enabled
+ */
+void Xspress3::doNDCallbacksIfRequired(NDArray *pMCA, bool arrayCallbacks)
+{
     if (arrayCallbacks) {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "doNDCallbacksIfRequired: Calling NDArray callback\n");
         this->doCallbacksGenericPointer(pMCA, NDArrayData, 0);
@@ -1971,11 +3479,469 @@ int Xspress3::getNumFramesRead()
         this->checkStatus(xsp3Status, "xsp3_dma_check_desc", "getNumFrameRead");
     } else {
         numFrames = xsp3Status;
-        this->setIntegerParam(xsp3FrameCountParam, numFrames);
+        if (epicsAtomicGetIntT(&framesAcquired_) != numFrames) {
+            epicsAtomicSetIntT(&framesAcquired_, numFrames);
+            epicsEventSignal(resultsEvent_);
+        }
+    }
+    return numFrames;
+}
+
+/**
+ * A getter for xsp3PushReadoutParam
+ *
+ * @return non-zero if the data task should wait for new frame callbacks rather than poll
+ */
+int Xspress3::getPushReadout()
+{
+    int pushReadout;
+    this->getIntegerParam(xsp3PushReadoutParam, &pushReadout);
+    return pushReadout;
+}
+
+/**
+ * Hand a frame that has been read out to the publish task. The SCAs and
+ * dead time are copied, so they can be reused as soon as this returns. If XSP3_QUEUE_DEPTH
+ * frames are already waiting this waits for the publish task to take one,
+ * so the readout falls behind rather than losing frames, unless the
+ * acquisition is stopped while it waits, when the frame is released
+ * unqueued. With XSP3_QUEUE_DROP enabled the frame is dropped instead, so
+ * as not to hold up the hardware readout, and XSP3_DROPPED_FRAMES is
+ * incremented.
+ *
+ * @param pMCA The NDArray holding the MCA data for the frame. The queue takes ownership.
+ * @param pSCA A pointer to the SCAs for the frame
+ * @param pDTPercent The dead time percent of each channel, from calculateDeadtime
+ * @param pDTFactor The dead time correction factor of each channel, from calculateDeadtime
+ * @param numChannels The number of xspress3 channels in the frame
+ * @param dataType The NDDataType_t of the SCA data (NDUInt32 or NDFloat64)
+ * @param frameNumber The (1 based) number of the frame
+ *
+ * @return true if the frame was dropped or the acquisition stopped otherwise false
+ */
+bool Xspress3::queueFrame(NDArray *pMCA, void *pSCA, const double *pDTPercent, const double *pDTFactor, int numChannels, NDDataType_t dataType, int frameNumber)
+{
+    xsp3QueuedFrame frame;
+    epicsUInt64 now;
+
+    while (!acqConfig_.queueDrop && (epicsMessageQueuePending(publishQueue_) >= acqConfig_.queueDepth)) {
+        if (epicsEventWaitWithTimeout(queueSpaceEvent_, queueWaitTimeout_) == epicsEventWaitOK) {
+            continue;
+        }
+        if (checkForStopEvent(0.0, "Got stop event while waiting to queue a frame.\n") == epicsEventWaitOK) {
+            // Leave the stop event for the data task, which ends the acquisition
+            epicsEventSignal(this->stopEvent_);
+            pMCA->release();
+            return true;
+        }
+    }
+    if (epicsMessageQueuePending(publishQueue_) < acqConfig_.queueDepth) {
+        frame.pMCA = pMCA;
+        frame.pSCA = pSCARing_ + scaSlot_*scaSlotBytes_;
+        frame.pDTPercent = reinterpret_cast<double*>(frame.pSCA) + XSP3_SW_NUM_SCALERS * this->numChannels_;
+        frame.pDTFactor = frame.pDTPercent + this->numChannels_;
+        frame.frameNumber = frameNumber;
+        frame.numChannels = numChannels;
+        frame.dataType = dataType;
+        frame.aborted = false;
+        frame.queued = xsp3StageTimes::now();
+        memcpy(frame.pSCA, pSCA, XSP3_SW_NUM_SCALERS * numChannels * ((dataType == NDFloat64) ? sizeof(double) : sizeof(u_int32_t)));
+        std::copy(pDTPercent, pDTPercent + numChannels, frame.pDTPercent);
+        std::copy(pDTFactor, pDTFactor + numChannels, frame.pDTFactor);
+        if (epicsMessageQueueTrySend(publishQueue_, &frame, sizeof(frame)) == 0) {
+            scaSlot_ = (scaSlot_ + 1) % (maxQueueDepth_ + 1);
+            return false;
+        }
+    }
+    pMCA->release();
+    epicsAtomicIncrIntT(&droppedFrames_);
+    // Drops come in bursts when the publish task cannot keep up, so only log them once a second
+    dropsUnreported_++;
+    now = xsp3StageTimes::now();
+    if ((dropReported_ == 0) || ((now - dropReported_) * 1e-9 >= 1.0)) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "Xspress3::queueFrame Publish queue full, dropped %d frames up to frame %d.\n", dropsUnreported_, frameNumber);
+        dropReported_ = now;
+        dropsUnreported_ = 0;
+    }
+    return true;
+}
+
+/**
+ * Tell the publish task that the acquisition has finished and wait for it to
+ * publish the frames still queued and set the acquisition stop parameters.
+ *
+ * @param aborted true if the acquisition was aborted early
+ */
+void Xspress3::queueEndOfAcquisition(bool aborted)
+{
+    xsp3QueuedFrame frame;
+    frame.pMCA = NULL;
+    frame.pSCA = NULL;
+    frame.pDTPercent = NULL;
+    frame.pDTFactor = NULL;
+    frame.frameNumber = 0;
+    frame.numChannels = 0;
+    frame.dataType = NDUInt32;
+    frame.aborted = aborted;
+    frame.queued = xsp3StageTimes::now();
+    if (dropsUnreported_ > 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "Xspress3::queueEndOfAcquisition Publish queue full, dropped %d more frames.\n", dropsUnreported_);
+        dropsUnreported_ = 0;
+    }
+    epicsMessageQueueSend(publishQueue_, &frame, sizeof(frame));
+    epicsEventWait(publishDoneEvent_);
+}
+
+/**
+ * Wait for the next frame from the data task, and let the data task know
+ * there is space in the queue
+ *
+ * @param frame A reference to the frame to fill in
+ */
+void Xspress3::receiveFrame(xsp3QueuedFrame &frame)
+{
+    epicsMessageQueueReceive(publishQueue_, &frame, sizeof(frame));
+    epicsEventSignal(queueSpaceEvent_);
+}
+
+/**
+ * Signal the data task that all the frames of an acquisition are published
+ */
+void Xspress3::publishDone()
+{
+    epicsEventSignal(publishDoneEvent_);
+}
+
+/**
+ * Set XSP3_QUEUE_USED to the number of frames waiting to be published.
+ * This should be called with the driver locked.
+ */
+void Xspress3::setQueueUsed()
+{
+    this->setIntegerParam(xsp3QueueUsedParam, epicsMessageQueuePending(publishQueue_));
+}
+
+/**
+ * Wait until a frame has been stored or acquired since the last call
+ */
+void Xspress3::waitForResults()
+{
+    epicsEventWait(resultsEvent_);
+}
+
+/**
+ * Write the latest SCAs and the frame counters collected by the data and
+ * publish tasks to the parameter library, and do the parameter callbacks.
+ * This should be called with the driver locked.
+ */
+void Xspress3::publishResults()
+{
+    epicsUInt64 start = xsp3StageTimes::now();
+    this->writeOutScas();
+    this->exportScalerArrays(false);
+    this->setIntegerParam(xsp3FrameCountParam, epicsAtomicGetIntT(&framesAcquired_));
+    this->setIntegerParam(xsp3DroppedFramesParam, epicsAtomicGetIntT(&droppedFrames_));
+    this->setQueueUsed();
+    this->updateSimCircStatus();
+    this->updateStageTimes(false);
+    this->callChannelParamCallbacks(static_cast<int>(chanMap_.size()));
+    stageTimes_.record(xsp3StageTimes::Params, start);
+}
+
+/**
+ * Do the callbacks for the scaler waveforms of every channel read out,
+ * with the frames stored so far, at most once every
+ * XSP3_SCALER_ARRAYS_PERIOD seconds unless forced. A period of 0 leaves
+ * them until they are forced at the end of the acquisition or by
+ * XSP3_SCALER_ARRAYS_UPDATE. This should be called with the driver locked.
+ *
+ * @param force true to do the callbacks now
+ */
+void Xspress3::exportScalerArrays(bool force)
+{
+    epicsUInt64 now = xsp3StageTimes::now();
+    if (!acqConfig_.scalerArrays) {
+        return;
+    }
+    if (!force && ((acqConfig_.scalerArraysPeriod <= 0.0) ||
+                   ((now - scalerArraysUpdate_) * 1e-9 < acqConfig_.scalerArraysPeriod))) {
+        return;
+    }
+    scalerArraysUpdate_ = now;
+    const int numFrames = scalerStore_.getNumFrames();
+    for (size_t chan=0; chan<chanMap_.size(); chan++) {
+        for (int value=0; value<scalerStore_.getNumValues(); value++) {
+            const double *pWaveform = scalerStore_.getWaveform(value, static_cast<int>(chan));
+            if (pWaveform != NULL) {
+                this->doCallbacksFloat64Array(const_cast<double*>(pWaveform), numFrames, xsp3ChanScalerArrayParam[value], chanMap_[chan]);
+            }
+        }
+    }
+    this->setIntegerParam(xsp3ScalerArraysFramesParam, numFrames);
+}
+
+/**
+ * A getter for xsp3ParamUpdatePeriodParam
+ *
+ * @return The minimum time in seconds between parameter callbacks during an acquisition
+ */
+double Xspress3::getParamUpdatePeriod()
+{
+    double period;
+    this->getDoubleParam(xsp3ParamUpdatePeriodParam, &period);
+    return period;
+}
+
+/**
+ * Work out how far the readout is behind the detector and how fast it is
+ * going, at most once every XSP3_PARAM_UPDATE_PERIOD seconds. The rates
+ * are over the time since the last update and since the start of the
+ * acquisition. In circular buffer mode the time to overflow is how long
+ * it will take the backlog to fill the XSP3_NUM_FRAMES_CONFIG frames of
+ * the buffer at the current rates, or -1 if the backlog is not growing.
+ * The parameter callbacks are left to the publish task.
+ *
+ * @param acquired The number of frames the detector has acquired
+ * @param frameNumber The number of frames read out
+ * @param frameBytes The number of bytes read out for each frame
+ * @param force true to update now, eg. at the end of an acquisition
+ */
+void Xspress3::updateReadoutStatus(int acquired, int frameNumber, size_t frameBytes, bool force)
+{
+    epicsUInt64 now = xsp3StageTimes::now();
+    double interval = (now - readoutUpdate_) * 1e-9;
+    double elapsed = (now - readoutStart_) * 1e-9;
+    int backlog = std::max(acquired - frameNumber, 0);
+    int bufferFrames;
+    double frameRate, readRate, timeToOverflow = -1.0;
+
+    if (backlog > peakBacklog_) {
+        peakBacklog_ = backlog;
+    }
+    if ((!force && (interval < acqConfig_.paramUpdatePeriod)) || (interval <= 0.0)) {
+        return;
+    }
+    frameRate = (acquired - readoutAcquired_) / interval;
+    readRate = (frameNumber - readoutFrames_) / interval;
+
+    this->lock();
+    this->getIntegerParam(xsp3NumFramesConfigParam, &bufferFrames);
+    if (circBuffer_ && (frameRate > readRate)) {
+        timeToOverflow = std::max(bufferFrames - backlog, 0) / (frameRate - readRate);
+    }
+    this->setIntegerParam(xsp3BacklogParam, backlog);
+    this->setIntegerParam(xsp3PeakBacklogParam, peakBacklog_);
+    this->setDoubleParam(xsp3TimeToOverflowParam, timeToOverflow);
+    this->setDoubleParam(xsp3FrameRateParam, frameRate);
+    this->setDoubleParam(xsp3ReadRateParam, readRate);
+    this->setDoubleParam(xsp3ReadMBRateParam, readRate * frameBytes / 1e6);
+    if (elapsed > 0.0) {
+        this->setDoubleParam(xsp3ReadRateAvgParam, frameNumber / elapsed);
+        this->setDoubleParam(xsp3ReadMBRateAvgParam, frameNumber * (frameBytes / 1e6) / elapsed);
+    }
+    this->unlock();
+
+    readoutUpdate_ = now;
+    readoutAcquired_ = acquired;
+    readoutFrames_ = frameNumber;
+}
+
+/**
+ * Publish the statistics of each readout stage, as arrays indexed by
+ * xsp3StageTimes::Stage in microseconds, once the current window of
+ * XSP3_STAGE_WINDOW seconds is over. This should be called with the
+ * driver locked.
+ *
+ * @param roll true to finish the window now, eg. at the end of an acquisition
+ */
+void Xspress3::updateStageTimes(bool roll)
+{
+    epicsFloat64 minTimes[xsp3StageTimes::NumStages];
+    epicsFloat64 meanTimes[xsp3StageTimes::NumStages];
+    epicsFloat64 p99Times[xsp3StageTimes::NumStages];
+    epicsFloat64 maxTimes[xsp3StageTimes::NumStages];
+    xsp3StageStats stats;
+    double window;
+    epicsUInt64 now = xsp3StageTimes::now();
+
+    this->getDoubleParam(xsp3StageWindowParam, &window);
+    if (!roll && ((now - stageWindowStart_) * 1e-9 < window)) {
+        return;
+    }
+    stageTimes_.roll();
+    stageWindowStart_ = now;
+    for (int stage=0; stage<xsp3StageTimes::NumStages; stage++) {
+        stageTimes_.getStats(stage, stats);
+        minTimes[stage] = stats.min * 1e6;
+        meanTimes[stage] = stats.mean * 1e6;
+        p99Times[stage] = stats.p99 * 1e6;
+        maxTimes[stage] = stats.max * 1e6;
+    }
+    this->doCallbacksFloat64Array(minTimes, xsp3StageTimes::NumStages, xsp3StageMinParam, 0);
+    this->doCallbacksFloat64Array(meanTimes, xsp3StageTimes::NumStages, xsp3StageMeanParam, 0);
+    this->doCallbacksFloat64Array(p99Times, xsp3StageTimes::NumStages, xsp3StageP99Param, 0);
+    this->doCallbacksFloat64Array(maxTimes, xsp3StageTimes::NumStages, xsp3StageMaxParam, 0);
+}
+
+/**
+ * Do the parameter callbacks for every channel read out, so that the
+ * per-channel SCA and dead time parameters are pushed out as well as those
+ * on address 0. This should be called with the driver locked.
+ *
+ * @param numChannels The number of xspress3 channels to do callbacks for
+ */
+void Xspress3::callChannelParamCallbacks(int numChannels)
+{
+    this->callParamCallbacks();
+    for (int chan=0; chan<numChannels; chan++) {
+        if (chanMap_[chan] != 0) {
+            this->callParamCallbacks(chanMap_[chan]);
+        }
+    }
+}
+
+/**
+ * Pass the fault injection parameters on to the simulator. Does nothing
+ * when talking to a real detector.
+ */
+void Xspress3::setSimFaults()
+{
+    xsp3SimFaults faults;
+    if (simulator_ == NULL) {
+        return;
+    }
+    this->getDoubleParam(xsp3SimBusyTimeParam, &faults.busy_time);
+    this->getDoubleParam(xsp3SimDelayRateParam, &faults.delay_rate);
+    this->getDoubleParam(xsp3SimDelayTimeParam, &faults.delay_time);
+    this->getIntegerParam(xsp3SimBurstFramesParam, &faults.burst_frames);
+    this->getDoubleParam(xsp3SimDropRateParam, &faults.drop_rate);
+    this->getDoubleParam(xsp3SimErrorRateParam, &faults.error_rate);
+    simulator_->setFaults(faults);
+}
+
+/**
+ * Copy the simulated circular buffer state to its parameters, and report
+ * any frames that have been overwritten since the last time. Does nothing
+ * when talking to a real detector or not in circular buffer mode.
+ */
+void Xspress3::updateSimCircStatus()
+{
+    int lag, maxLag, overruns, lastOverruns;
+    if ((simulator_ == NULL) || (circBuffer_ == 0)) {
+        return;
+    }
+    simulator_->getCircStatus(&lag, &maxLag, &overruns);
+    this->getIntegerParam(xsp3SimCircOverrunsParam, &lastOverruns);
+    if (overruns > lastOverruns) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "Xspress3::updateSimCircStatus: circular buffer overrun, %d frames overwritten before they were read.\n", overruns - lastOverruns);
+    }
+    this->setIntegerParam(xsp3SimCircLagParam, lag);
+    this->setIntegerParam(xsp3SimCircMaxLagParam, maxLag);
+    this->setIntegerParam(xsp3SimCircOverrunsParam, overruns);
+}
+
+/**
+ * Check whether the MCA NDArrays can wrap the API histogram memory. This
+ * needs XSP3_ZERO_COPY to be enabled and API support for
+ * xsp3_histogram_get_data_ptr.
+ *
+ * @return true if readFrameZeroCopy should be tried for each frame
+ */
+bool Xspress3::getZeroCopy()
+{
+    int zeroCopy;
+    this->getIntegerParam(xsp3ZeroCopyParam, &zeroCopy);
+    return zeroCopy && (xsp3->has_get_data_ptr(this->xsp3_handle_) > 0);
+}
+
+/**
+ * Register the new frame callback on every channel configured in the API, so
+ * that the API receive threads wake the data task as soon as a frame completes.
+ * The channels are those of the acquisition config, so this must be called
+ * after snapshotAcqConfig.
+ *
+ * @return true if the API could not register the callbacks, in which case the
+ *         data task should poll instead
+ */
+bool Xspress3::enablePushReadout()
+{
+    const char *functionName = "Xspress3::enablePushReadout";
+    int xsp3Status;
+
+    for (int chan=0; chan<this->numChannels_; chan++) {
+        epicsAtomicSetIntT(&chanFrames_[chan], 0);
+    }
+    //Discard any wake up left over from the last acquisition
+    epicsEventTryWait(this->frameEvent_);
+
+    for (int chan=0; chan<acqConfig_.numApiChannels; chan++) {
+        xsp3Status = xsp3->histogram_set_new_frame_callback(this->xsp3_handle_, chan, xsp3NewFrameCallbackC, this, 1);
+        if (xsp3Status != XSP3_OK) {
+            checkStatus(xsp3Status, "xsp3_histogram_set_new_frame_callback", functionName);
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s New frame callbacks not available, polling instead.\n", functionName);
+            this->disablePushReadout();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Remove the new frame callbacks registered by enablePushReadout
+ */
+void Xspress3::disablePushReadout()
+{
+    for (int chan=0; chan<acqConfig_.numApiChannels; chan++) {
+        xsp3->histogram_set_new_frame_callback(this->xsp3_handle_, chan, NULL, NULL, 1);
+    }
+}
+
+/**
+ * Block until a new frame callback arrives (or timeout) and return the number
+ * of frames completed on all the channels configured in the API, as only they
+ * call back. If no callback arrives within the timeout
+ * the hardware is polled, so a missed callback can only delay a frame.
+ * Like getNumFramesRead this does not need the driver lock, the frame
+ * count is left for the parameter update task.
+ *
+ * @param timeout The maximum time to wait for a callback
+ *
+ * @return The number of frames available to read
+ */
+int Xspress3::waitForFrames(double timeout)
+{
+    int numFrames;
+    if (epicsEventWaitWithTimeout(this->frameEvent_, timeout) != epicsEventWaitOK) {
+        return this->getNumFramesRead();
+    }
+    numFrames = epicsAtomicGetIntT(&chanFrames_[0]);
+    for (int chan=1; chan<acqConfig_.numApiChannels; chan++) {
+        numFrames = std::min(numFrames, epicsAtomicGetIntT(&chanFrames_[chan]));
+    }
+    if (epicsAtomicGetIntT(&framesAcquired_) != numFrames) {
+        epicsAtomicSetIntT(&framesAcquired_, numFrames);
+        epicsEventSignal(resultsEvent_);
     }
     return numFrames;
 }
 
+/**
+ * Record that a frame has completed on a channel and wake the data task.
+ * This is called from the API receive threads, so must not take the driver lock.
+ *
+ * @param chan The channel that has completed a frame
+ * @param tf The (0 based) frame that has completed. The frames counted are
+ *           limited to the frames of the acquisition, so they fit in an int.
+ */
+void Xspress3::newFrame(int chan, int64_t tf)
+{
+    int64_t maxFrames = (acqConfig_.numFrames > 0) ? acqConfig_.numFrames : std::numeric_limits<int>::max();
+    if ((chan >= 0) && (chan < acqConfig_.numApiChannels) && (tf >= 0)) {
+        epicsAtomicSetIntT(&chanFrames_[chan], static_cast<int>(std::min(tf + 1, maxFrames)));
+        epicsEventSignal(this->frameEvent_);
+    }
+}
+
 void Xspress3::xspAsynPrint(int asynPrintType, const char *format, ...)
 {
     const int maxMessageLen=1024;
@@ -1987,27 +3953,140 @@ void Xspress3::xspAsynPrint(int asynPrintType, const char *format, ...)
     va_end(pArg);
 }
 
+/**
+ * The new frame callback registered with the API. In circular buffer mode
+ * the extended frame number is used as that is what the driver counts.
+ *
+ * @param drvPvt A pointer to an instance of Xspress3
+ */
+static void xsp3NewFrameCallbackC(int path, int chan, int tf, int64_t tf_ext, u_int32_t *buffer, void *drvPvt)
+{
+    Xspress3 *pXspAD = (Xspress3 *)drvPvt;
+    pXspAD->newFrame(chan, pXspAD->isCircBuffer() ? tf_ext : tf);
+}
+
+/**
+ * Publish a frame that has already been read out into pMCA and pSCA. This
+ * stores the SCAs for the parameter update task, sets the NDArray
+ * attributes, does the NDArray callbacks and finally releases the NDArray.
+ *
+ * If XSP3_CTRL_MCA_ROI is enabled the MCA ROIs are summed first, so they
+ * are stored with the SCAs and added to the NDArray attributes. In ROI
+ * readout mode, when the hardware has not already summed them, the
+ * NDArray is then replaced by one of the ROI sums.
+ *
+ * If XSP3_ACCUMULATE is enabled the spectra are added to the accumulated
+ * spectra, which are published on their own NDArray address every
+ * XSP3_ACCUMULATE_PERIOD frames. If XSP3_SCA_STREAM is enabled storeScas
+ * also adds the SCAs to the NDArrays of SCAs on another address.
+ *
+ * The driver lock is only taken if PARAM NDAttributes read the SCAs, in
+ * which case they are written to the parameter library before the
+ * attributes are set so that those of every frame are up to date.
+ *
+ * @param pXspAD A pointer to an instance of Xspress3
+ * @param pMCA The NDArray holding the MCA data for the frame
+ * @param pSCA A pointer to the SCAs for the frame
+ * @param pDTPercent The dead time percent of each channel
+ * @param pDTFactor The dead time correction factor of each channel
+ * @param numChannels The number of xspress3 channels in the frame
+ * @param dataType The NDDataType_t of the SCA data (NDUInt32 or NDFloat64)
+ * @param frameNumber The (1 based) number of the frame
+ */
+static void xsp3PublishFrame(Xspress3 *pXspAD, NDArray *pMCA, void *pSCA, const double *pDTPercent, const double *pDTFactor, int numChannels, NDDataType_t dataType, int frameNumber)
+{
+    const xsp3AcqConfig &config = pXspAD->getAcqConfig();
+    xsp3StageTimes &stageTimes = pXspAD->getStageTimes();
+    epicsUInt64 stageStart = xsp3StageTimes::now();
+    if (config.roiEnabled) {
+        pXspAD->sumRois(pMCA);
+    }
+    if (config.accumulate) {
+        pXspAD->accumulate(pMCA, frameNumber);
+    }
+    if (config.roiEnabled && (config.numRoiBins > 0) && !config.hwRoi) {
+        pMCA = pXspAD->roiArray(pMCA);
+    }
+    pXspAD->storeScas(pSCA, pDTPercent, pDTFactor, numChannels, dataType, frameNumber);
+    if (config.scaAttributes) {
+        pXspAD->lock();
+        stageStart = stageTimes.record(xsp3StageTimes::Lock, stageStart);
+        pXspAD->writeOutScas();
+        pXspAD->unlock();
+    }
+    stageStart = stageTimes.record(xsp3StageTimes::Scas, stageStart);
+    pXspAD->setNDArrayAttributes(pMCA, frameNumber);
+    stageStart = stageTimes.record(xsp3StageTimes::Attributes, stageStart);
+    pXspAD->doNDCallbacksIfRequired(pMCA, config.arrayCallbacks);
+    pMCA->release();
+    stageTimes.record(xsp3StageTimes::Plugins, stageStart);
+}
+
 /**
  * A function, ordinarily to be run in a seperate thread, to wait for
  * and then execute acquisitions.
  *
+ * When more than one frame is waiting and XSP3_BATCH_READOUT is greater than
+ * one, all the waiting frames (up to the batch size) are read with a single
+ * read4d call into staging arrays and then split into NDArrays.
+ *
+ * When XSP3_PUSH_READOUT is enabled the task blocks on the API new frame
+ * callbacks, rather than polling xsp3_scaler_check_progress, while it is
+ * waiting for the next frame.
+ *
+ * When XSP3_DTC_MODE asks for the dead time correction to be done in the
+ * driver, or XSP3_RAW_DATA_TYPE asks for 16 bit raw data, raw frames are
+ * read into the staging arrays and then converted into the NDArrays.
+ *
+ * Only the energy window set by XSP3_ENERGY_START and XSP3_ENERGY_BINS is
+ * read from the API. If XSP3_REBIN is more than 1 the frames are rebinned
+ * in the staging arrays before they are copied or converted.
+ *
+ * When XSP3_ZERO_COPY is enabled single raw frames are published in NDArrays
+ * that wrap the API histogram memory instead of a copy of it.
+ *
+ * Frames are handed to xsp3PublishTaskC through a queue of at most
+ * XSP3_QUEUE_DEPTH frames, so this task only reads from the hardware. When
+ * the queue is full it waits for space, or drops the frame if XSP3_QUEUE_DROP
+ * is enabled.
+ *
+ * The configuration of each acquisition is taken by snapshotAcqConfig
+ * when it starts, so the driver lock is not taken for each frame.
+ *
  * @param xspAD A pointer to an instance of Xspress3
  */
 static void xsp3DataTaskC(void *xspAD)
 {
     Xspress3 *pXspAD = (Xspress3 *)xspAD;
     void *pSCA;
+    void *pSCABatch = NULL;
+    void *pMCABatch = NULL;
     NDArray *pMCA;
     NDDataType_t dataType;
+    NDDataType_t readType; //The type read from the API, for both the MCA and SCAs
     bool acquire=false;
     bool aborted=false;
     bool error=false;
+    bool pushReadout=false;
+    bool zeroCopy=false;
+    bool convert=false;
+    bool stage=false;
+    xsp3AcqConfig config;
 
     int numChannels, maxSpectra, frameNumber, numFrames=0, acquired, lastAcquired;
+    int batchSize, batchFrames, stagedFrames=0;
+    int firstBin, rebin;
+    bool windowed;
+    size_t mcaFrameBytes, outFrameBytes, scaFrameBytes;
     //int frame_count, last_frame_count, frame_counter, frames_remaining, frame_offset;
     size_t dims[2];
+    size_t readDims[2];
+    size_t stagedDims[2] = {0, 0};
     const double timeout = 0.00001;
+    const double pushTimeout = 0.1;
     const int checkTimes = 20;
+    xsp3StageTimes &stageTimes = pXspAD->getStageTimes();
+    epicsUInt64 stageStart;
     // const char* functionName = "Xspress3::xps3DataTaskC";
     // The scalar array can be reused so create it now
     pXspAD->createSCAArray(pSCA);
@@ -2021,61 +4100,216 @@ static void xsp3DataTaskC(void *xspAD)
         pXspAD->checkForStopEvent(timeout, "Got stop event before start event.\n");
         if (pXspAD->waitForStartEvent("Got start event.\n") == epicsEventWaitOK) {
             acquire = true;
-            pXspAD->lock();
+        }
+        pXspAD->lock();
+        if (acquire) {
             pXspAD->setStartingParameters();
-            pXspAD->unlock();
         }
-        dataType = pXspAD->getDataType();
-        pXspAD->getDims(dims);
-        maxSpectra = dims[0];
+        config = pXspAD->snapshotAcqConfig();
+        pXspAD->unlock();
+        dataType = config.dataType;
+        readType = config.readType;
+        convert = (dataType != readType);
+        windowed = config.windowed;
+        firstBin = config.firstBin;
+        maxSpectra = config.numBins;
+        rebin = config.rebin;
+        dims[0] = config.dims[0];
+        dims[1] = config.dims[1];
         numChannels = dims[1];
-        numFrames = pXspAD->getNumFramesToAcquire();
+        readDims[0] = maxSpectra;
+        readDims[1] = numChannels;
+        stage = convert || (rebin > 1);
+        numFrames = config.numFrames;
+        batchSize = config.batchSize;
+        // The staging arrays are only reallocated when the batch geometry changes
+        if (((batchSize > 1) || stage) &&
+            ((batchSize != stagedFrames) || (readDims[0] != stagedDims[0]) || (readDims[1] != stagedDims[1]))) {
+            if (pXspAD->createBatchArrays(pSCABatch, pMCABatch, batchSize, readDims)) {
+                // Without staging arrays there is nowhere to batch, convert or rebin in
+                stagedFrames = 0;
+                pXspAD->lock();
+                config = pXspAD->unstageAcqConfig();
+                pXspAD->unlock();
+                batchSize = config.batchSize;
+                dataType = config.dataType;
+                readType = config.readType;
+                rebin = config.rebin;
+                dims[0] = config.dims[0];
+                convert = stage = false;
+            } else {
+                stagedFrames = batchSize;
+                stagedDims[0] = readDims[0];
+                stagedDims[1] = readDims[1];
+            }
+        }
+        mcaFrameBytes = readDims[0] * readDims[1] * ((readType == NDFloat64) ? sizeof(double) : sizeof(u_int32_t));
+        outFrameBytes = dims[0] * dims[1] * ((readType == NDFloat64) ? sizeof(double) : sizeof(u_int32_t));
+        scaFrameBytes = XSP3_SW_NUM_SCALERS * dims[1] * ((readType == NDFloat64) ? sizeof(double) : sizeof(u_int32_t));
+        pushReadout = acquire && config.pushReadout && !pXspAD->enablePushReadout();
+        zeroCopy = acquire && (dataType == NDUInt32) && !windowed && config.zeroCopy;
         pXspAD->xspAsynPrint(ASYN_TRACE_FLOW, "Collect %d frames\n", numFrames);
 	// printf("data task acquire=%d, numframes=%d  / frameNumber=%d\n", (int)acquire, numFrames, frameNumber);
         while (acquire && (frameNumber < numFrames)) {
-            acquired = pXspAD->getNumFramesRead();
+            if (!pushReadout) {
+                acquired = pXspAD->getNumFramesRead();
+            } else if (frameNumber >= acquired) {
+                acquired = pXspAD->waitForFrames(pushTimeout);
+            }
             if (frameNumber < acquired) {
                 lastAcquired = acquired;
-                if (!pXspAD->createMCAArray(dims, pMCA, dataType)) {
-                    if (dataType == NDFloat64) {
-                        error = pXspAD->readFrame(static_cast<double*>(pSCA), static_cast<double*>(pMCA->pData), frameNumber, maxSpectra);
+                batchFrames = std::min(std::min(acquired, numFrames) - frameNumber, batchSize);
+                stageStart = xsp3StageTimes::now();
+                if ((batchFrames > 1) || stage) {
+                    if (readType == NDFloat64) {
+                        error = pXspAD->readFrames(static_cast<double*>(pSCABatch), static_cast<double*>(pMCABatch), frameNumber, batchFrames, firstBin, maxSpectra);
+                    }
+                    else {
+                        error = pXspAD->readFrames(static_cast<u_int32_t*>(pSCABatch), static_cast<u_int32_t*>(pMCABatch), frameNumber, batchFrames, firstBin, maxSpectra);
+                    }
+                    stageStart = stageTimes.record(xsp3StageTimes::Read, stageStart);
+                    if (error) {
+                        pXspAD->xspAsynPrint(ASYN_TRACE_ERROR, "There was an error during batch read out %d\n", error);
+                    }
+                    const xsp3Deadtime &dtc = pXspAD->calculateDeadtime(pSCABatch, numChannels, readType, batchFrames);
+                    // The frames have been consumed from the hardware, so move on even if an array cannot be allocated
+                    for (int batchFrame=0; batchFrame<batchFrames; batchFrame++) {
+                        frameNumber++;
+                        if (!pXspAD->createMCAArray(dims, pMCA, dataType)) {
+                            void *pSCAFrame = static_cast<char*>(pSCABatch) + batchFrame*scaFrameBytes;
+                            void *pMCAFrame = static_cast<char*>(pMCABatch) + batchFrame*mcaFrameBytes;
+                            if ((rebin > 1) && (readType == NDFloat64)) {
+                                xsp3Spectrum::rebin(static_cast<double*>(pMCAFrame), dims[0]*dims[1], rebin);
+                            }
+                            else if (rebin > 1) {
+                                xsp3Spectrum::rebin(static_cast<u_int32_t*>(pMCAFrame), dims[0]*dims[1], rebin);
+                            }
+                            if (convert) {
+                                pXspAD->convertFrame(static_cast<u_int32_t*>(pMCAFrame), static_cast<u_int32_t*>(pSCAFrame), pMCA, numChannels, dims[0]);
+                            }
+                            else {
+                                memcpy(pMCA->pData, pMCAFrame, outFrameBytes);
+                            }
+                            pXspAD->queueFrame(pMCA, pSCAFrame, dtc.getDTPercent() + batchFrame*numChannels,
+                                               dtc.getDTFactor() + batchFrame*numChannels, numChannels, readType, frameNumber);
+                        }
+                        else {
+                            pXspAD->xspAsynPrint(ASYN_TRACE_ERROR, "Did not create a new array for frame %d!\n", frameNumber);
+                        }
+                        stageStart = stageTimes.record(xsp3StageTimes::Process, stageStart);
+                    }
+                }
+                else if (zeroCopy && !pXspAD->readFrameZeroCopy(static_cast<u_int32_t*>(pSCA), pMCA, frameNumber, dims)) {
+                    stageStart = stageTimes.record(xsp3StageTimes::Read, stageStart);
+                    frameNumber++;
+                    const xsp3Deadtime &dtc = pXspAD->calculateDeadtime(pSCA, numChannels, readType, 1);
+                    pXspAD->queueFrame(pMCA, pSCA, dtc.getDTPercent(), dtc.getDTFactor(), numChannels, readType, frameNumber);
+                    stageTimes.record(xsp3StageTimes::Process, stageStart);
+                }
+                else if (!pXspAD->createMCAArray(dims, pMCA, dataType)) {
+                    if (readType == NDFloat64) {
+                        error = pXspAD->readFrames(static_cast<double*>(pSCA), static_cast<double*>(pMCA->pData), frameNumber, 1, firstBin, maxSpectra);
                     }
                     else {
-                        error = pXspAD->readFrame(static_cast<u_int32_t*>(pSCA), static_cast<u_int32_t*>(pMCA->pData), frameNumber, maxSpectra);
+                        error = pXspAD->readFrames(static_cast<u_int32_t*>(pSCA), static_cast<u_int32_t*>(pMCA->pData), frameNumber, 1, firstBin, maxSpectra);
                     }
+                    stageStart = stageTimes.record(xsp3StageTimes::Read, stageStart);
                     if (error) {
                         pXspAD->xspAsynPrint(ASYN_TRACE_ERROR, "There was an error during read out %d\n", error);
                     }
 
-                    pXspAD->lock();
-                    pXspAD->writeOutScas(pSCA, numChannels, dataType);
-                    pXspAD->unlock();
                     frameNumber++;
-                    pXspAD->setNDArrayAttributes(pMCA, frameNumber);
-                    pXspAD->lock();
-                    pXspAD->callParamCallbacks();
-                    pXspAD->unlock();
-                    pXspAD->doNDCallbacksIfRequired(pMCA);
-                    pMCA->release();
+                    const xsp3Deadtime &dtc = pXspAD->calculateDeadtime(pSCA, numChannels, readType, 1);
+                    pXspAD->queueFrame(pMCA, pSCA, dtc.getDTPercent(), dtc.getDTFactor(), numChannels, readType, frameNumber);
+                    stageTimes.record(xsp3StageTimes::Process, stageStart);
                 }
                 else {
                     pXspAD->xspAsynPrint(ASYN_TRACE_ERROR, "Did not create a new array!\n");
                 }
 
             }
-            if (pXspAD->checkForStopEvent(timeout, "Got stop event.\n") == epicsEventWaitOK) {
+            pXspAD->updateReadoutStatus(acquired, frameNumber, mcaFrameBytes + scaFrameBytes, false);
+            if (pXspAD->checkForStopEvent(pushReadout ? 0.0 : timeout, "Got stop event.\n") == epicsEventWaitOK) {
                 acquire = false;
                 aborted = true;
                 pXspAD->checkHistBusy(checkTimes);
-                pXspAD->lock();
-                pXspAD->setAcqStopParameters(true);
-                pXspAD->unlock();
             }
         }
-        if (!aborted) {
+        if (pushReadout) {
+            pXspAD->disablePushReadout();
+        }
+        if (acquire || aborted) {
+            pXspAD->updateReadoutStatus(acquired, frameNumber, mcaFrameBytes + scaFrameBytes, true);
+        }
+        pXspAD->queueEndOfAcquisition(aborted);
+    }
+}
+
+/**
+ * A function, ordinarily to be run in a seperate thread, to publish the
+ * frames read out by xsp3DataTaskC. Storing the SCAs, the NDArray
+ * attributes and the NDArray callbacks all happen here, so slow plugins
+ * cannot hold up the hardware readout. At the end of an acquisition the
+ * accumulated spectra, any partial batch of the SCA stream and the values
+ * from the last frame are written out, and the stop parameters are set
+ * once every queued frame has been published.
+ *
+ * The parameter callbacks during the acquisition are left to
+ * xsp3ParamUpdateTaskC.
+ *
+ * @param xspAD A pointer to an instance of Xspress3
+ */
+static void xsp3PublishTaskC(void *xspAD)
+{
+    Xspress3 *pXspAD = (Xspress3 *)xspAD;
+    xsp3QueuedFrame frame;
+
+    while (1) {
+        pXspAD->receiveFrame(frame);
+        if (frame.pMCA != NULL) {
+            pXspAD->getStageTimes().record(xsp3StageTimes::Queue, frame.queued);
+            xsp3PublishFrame(pXspAD, frame.pMCA, frame.pSCA, frame.pDTPercent, frame.pDTFactor, frame.numChannels, frame.dataType, frame.frameNumber);
+        }
+        else {
+            if (pXspAD->getAcqConfig().accumulate) {
+                pXspAD->publishAccumulated();
+            }
+            pXspAD->flushScaStream();
             pXspAD->lock();
-            pXspAD->setAcqStopParameters(false);
+            pXspAD->publishResults();
+            pXspAD->exportScalerArrays(true);
+            pXspAD->updateStageTimes(true);
+            pXspAD->setAcqStopParameters(frame.aborted);
             pXspAD->unlock();
+            pXspAD->publishDone();
+        }
+    }
+}
+
+/**
+ * A function, ordinarily to be run in a seperate low priority thread, to
+ * write the SCAs and frame counters stored by the data and publish tasks to
+ * the parameter library and do the parameter callbacks. This happens at
+ * most once every XSP3_PARAM_UPDATE_PERIOD seconds, so fast acquisitions
+ * do not flood Channel Access monitors, and the data and publish tasks
+ * do not have to wait for the driver lock for each frame. With a period
+ * of 0 it does not sleep, and publishes as soon as each frame is stored.
+ *
+ * @param xspAD A pointer to an instance of Xspress3
+ */
+static void xsp3ParamUpdateTaskC(void *xspAD)
+{
+    Xspress3 *pXspAD = (Xspress3 *)xspAD;
+    double period;
+
+    while (1) {
+        pXspAD->waitForResults();
+        pXspAD->lock();
+        pXspAD->publishResults();
+        period = pXspAD->getParamUpdatePeriod();
+        pXspAD->unlock();
+        if (period > 0.0) {
+            epicsThreadSleep(period);
         }
     }
 }
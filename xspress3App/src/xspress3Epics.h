@@ -38,10 +38,13 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
+#include <utility>
 
 #include <epicsTime.h>
 #include <epicsThread.h>
 #include <epicsEvent.h>
+#include <epicsMessageQueue.h>
 #include <epicsMutex.h>
 #include <epicsString.h>
 #include <epicsStdio.h>
@@ -54,6 +57,11 @@
 
 #include "xsp3Detector.h"
 #include "xsp3Simulator.h"
+#include "xsp3Deadtime.h"
+#include "xsp3StageTimes.h"
+#include "xsp3Spectrum.h"
+#include "xsp3Roi.h"
+#include "xsp3ScalerStore.h"
 
 /* These are the drvInfo strings that are used to identify the parameters.
  * They are used by asyn clients, including standard asyn device support */
@@ -114,8 +122,136 @@
 #define xsp3EventWidthParamString        "XSP3_EVENT_WIDTH"
 #define xsp3ChanDTPercentParamString     "XSP3_CHAN_DTPERCENT"
 #define xsp3ChanDTFactorParamString      "XSP3_CHAN_DTFACTOR"
+//MCA ROIs, formatted with the (1 based) ROI number
+#define XSP3_MAX_NUM_ROI 16
+#define xsp3ChanRoiLlmParamString        "XSP3_CHAN_ROI%d_LLM"
+#define xsp3ChanRoiHlmParamString        "XSP3_CHAN_ROI%d_HLM"
+#define xsp3ChanRoiValueParamString      "XSP3_CHAN_ROI%d_VALUE"
+//Readout tuning
+#define xsp3BatchReadoutParamString      "XSP3_BATCH_READOUT"
+#define xsp3PushReadoutParamString      "XSP3_PUSH_READOUT"
+#define xsp3ZeroCopyParamString          "XSP3_ZERO_COPY"
+#define xsp3RoiReadoutParamString        "XSP3_ROI_READOUT"
+#define xsp3RoiReadoutModeParamString    "XSP3_ROI_READOUT_MODE"
+#define xsp3AccumulateParamString        "XSP3_ACCUMULATE"
+#define xsp3AccumulatePeriodParamString  "XSP3_ACCUMULATE_PERIOD"
+#define xsp3AccumulateResetParamString   "XSP3_ACCUMULATE_RESET"
+#define xsp3AccumulatedFramesParamString "XSP3_ACCUMULATED_FRAMES"
+#define xsp3ScalerArraysParamString      "XSP3_SCALER_ARRAYS"
+#define xsp3ScalerArraysPeriodParamString "XSP3_SCALER_ARRAYS_PERIOD"
+#define xsp3ScalerArraysUpdateParamString "XSP3_SCALER_ARRAYS_UPDATE"
+#define xsp3ScalerArraysFramesParamString "XSP3_SCALER_ARRAYS_FRAMES"
+#define xsp3ScaStreamParamString         "XSP3_SCA_STREAM"
+#define xsp3ScaStreamFramesParamString   "XSP3_SCA_STREAM_FRAMES"
+//Scaler history of a channel, the SCAs formatted with the (0 based) scaler number then the dead time
+#define XSP3_NUM_SCALER_ARRAYS (XSP3_SW_NUM_SCALERS + 2)
+#define xsp3ChanScaArrayParamString       "XSP3_CHAN_SCA%d_ARRAY"
+#define xsp3ChanDTPercentArrayParamString "XSP3_CHAN_DTPERCENT_ARRAY"
+#define xsp3ChanDTFactorArrayParamString  "XSP3_CHAN_DTFACTOR_ARRAY"
+#define xsp3QueueDepthParamString        "XSP3_QUEUE_DEPTH"
+#define xsp3QueueUsedParamString         "XSP3_QUEUE_USED"
+#define xsp3DroppedFramesParamString     "XSP3_DROPPED_FRAMES"
+#define xsp3QueueDropParamString         "XSP3_QUEUE_DROP"
+#define xsp3BacklogParamString           "XSP3_BACKLOG"
+#define xsp3PeakBacklogParamString       "XSP3_PEAK_BACKLOG"
+#define xsp3TimeToOverflowParamString    "XSP3_TIME_TO_OVERFLOW"
+#define xsp3FrameRateParamString         "XSP3_FRAME_RATE"
+#define xsp3ReadRateParamString          "XSP3_READ_RATE"
+#define xsp3ReadRateAvgParamString       "XSP3_READ_RATE_AVG"
+#define xsp3ReadMBRateParamString        "XSP3_READ_MB_RATE"
+#define xsp3ReadMBRateAvgParamString     "XSP3_READ_MB_RATE_AVG"
+#define xsp3ParamUpdatePeriodParamString "XSP3_PARAM_UPDATE_PERIOD"
+#define xsp3StageWindowParamString       "XSP3_STAGE_WINDOW"
+#define xsp3StageMinParamString          "XSP3_STAGE_MIN"
+#define xsp3StageMeanParamString         "XSP3_STAGE_MEAN"
+#define xsp3StageP99ParamString          "XSP3_STAGE_P99"
+#define xsp3StageMaxParamString          "XSP3_STAGE_MAX"
+#define xsp3DtcModeParamString           "XSP3_DTC_MODE"
+#define xsp3RawDataTypeParamString       "XSP3_RAW_DATA_TYPE"
+#define xsp3EnergyStartParamString       "XSP3_ENERGY_START"
+#define xsp3EnergyBinsParamString        "XSP3_ENERGY_BINS"
+#define xsp3RebinParamString             "XSP3_REBIN"
+#define xsp3ChanEnableParamString        "XSP3_CHAN_ENABLE"
+//Simulation
+#define xsp3ChanSimRateParamString       "XSP3_CHAN_SIM_RATE"
+#define xsp3SimThreadsParamString        "XSP3_SIM_THREADS"
+#define xsp3SimRingFramesParamString     "XSP3_SIM_RING_FRAMES"
+#define xsp3SimBusyTimeParamString       "XSP3_SIM_BUSY_TIME"
+#define xsp3SimDelayRateParamString      "XSP3_SIM_DELAY_RATE"
+#define xsp3SimDelayTimeParamString      "XSP3_SIM_DELAY_TIME"
+#define xsp3SimBurstFramesParamString    "XSP3_SIM_BURST_FRAMES"
+#define xsp3SimDropRateParamString       "XSP3_SIM_DROP_RATE"
+#define xsp3SimErrorRateParamString      "XSP3_SIM_ERROR_RATE"
+#define xsp3SimCircLagParamString        "XSP3_SIM_CIRC_LAG"
+#define xsp3SimCircMaxLagParamString     "XSP3_SIM_CIRC_MAX_LAG"
+#define xsp3SimCircOverrunsParamString   "XSP3_SIM_CIRC_OVERRUNS"
 
 
+class xsp3ZeroCopyPool;
+
+/**
+ * A frame passed from the data task to the publish task
+ */
+typedef struct {
+  NDArray *pMCA; //NULL marks the end of an acquisition
+  void *pSCA;
+  double *pDTPercent; //The dead time percent of each channel, worked out by the data task
+  double *pDTFactor; //The dead time correction factor of each channel
+  int frameNumber;
+  int numChannels;
+  NDDataType_t dataType;
+  bool aborted;
+  epicsUInt64 queued; //xsp3StageTimes::now() when the frame was queued
+} xsp3QueuedFrame;
+
+/**
+ * The configuration of an acquisition, taken from the parameter library
+ * once when it starts so the data and publish tasks do not need the
+ * driver lock to read it for each frame.
+ */
+typedef struct {
+  NDDataType_t dataType; //The type of the MCA NDArrays
+  NDDataType_t readType; //The type read from the API, for both the MCA and SCAs
+  size_t dims[2]; //[number of spectral bins, number of channels] of the MCA NDArrays
+  int firstBin; //The energy window read from the API
+  int numBins;
+  int rebin;
+  bool windowed; //true if the energy window is not the full spectrum
+  int numFrames;
+  int numApiChannels; //XSP3_NUM_CHANNELS, the channels configured in the API, which all make new frame callbacks
+  int batchSize;
+  int queueDepth;
+  bool queueDrop; //XSP3_QUEUE_DROP is enabled, so frames are dropped rather than waiting for space in the queue
+  bool pushReadout;
+  bool zeroCopy; //XSP3_ZERO_COPY is enabled and the API supports it
+  bool arrayCallbacks;
+  bool scaAttributes; //PARAM NDAttributes read the SCAs, so they are written to the parameter library for every frame
+  bool roiEnabled; //XSP3_CTRL_MCA_ROI or XSP3_ROI_READOUT is enabled, so the MCA ROIs are summed for every frame
+  int numRoiBins; //The ROI sums of each channel are published instead of the spectra, 0 to publish the spectra
+  bool hwRoi; //The hardware sums the ROIs, so the spectra read are already the numRoiBins ROI sums
+  bool accumulate; //XSP3_ACCUMULATE is enabled, so the spectra are added to the accumulated spectra
+  int accumulatePeriod; //Publish the accumulated spectra every this many frames, 0 for only at the end
+  bool scalerArrays; //XSP3_SCALER_ARRAYS is enabled, so the scalers of every frame are kept in the scaler store
+  double scalerArraysPeriod; //The minimum time in seconds between scaler waveform callbacks, 0 for only at the end
+  int scaStreamFrames; //The frames of SCAs in each NDArray published on scaStreamAddr_, 0 if XSP3_SCA_STREAM is disabled
+  double paramUpdatePeriod;
+} xsp3AcqConfig;
+
+/**
+ * The SCAs and dead time of a frame, as doubles, waiting to be written to
+ * the parameter library
+ */
+typedef struct {
+  int frameNumber;
+  int numChannels;
+  std::vector<double> sca; //[channel][XSP3_SW_NUM_SCALERS]
+  std::vector<double> dtPercent; //[channel]
+  std::vector<double> dtFactor; //[channel]
+  int numRois; //XSP3_MAX_NUM_ROI if the MCA ROIs were summed, otherwise 0
+  std::vector<double> roi; //[channel][XSP3_MAX_NUM_ROI]
+  int accumulated; //The number of frames in the accumulated spectra, or -1 if they are not being accumulated
+} xsp3FrameResults;
+
 extern "C" {
   int xspress3Config(const char *portName, int numChannels, int numCards, const char *baseIP, int maxFrames, int maxDriverFrames, int maxSpectra, int maxBuffers, size_t maxMemory, int debug, int simTest, int circBuffer);
 }
@@ -125,12 +261,14 @@ class Xspress3 : public ADDriver {
 
  public:
   Xspress3(const char *portName, int numChannels, int numCards, const char *baseIP, int maxFrames, int maxDriverFrames, int maxSpectra, int maxBuffers, size_t maxMemory, int debug, int simTest, int circBuffer);
-  Xspress3(const char *portName, int numChannels);
+  Xspress3(const char *portName, int numChannels, int circBuffer=0);
   virtual ~Xspress3();
 
   /* These are the methods that we override from asynPortDriver */
   virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
   virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+  virtual asynStatus readFloat64Array(asynUser *pasynUser, epicsFloat64 *value,
+                                      size_t nElements, size_t *nIn);
   virtual asynStatus writeOctet(asynUser *pasynUser, const char *value,
                                     size_t nChars, size_t *nActual);
   virtual void report(FILE *fp, int details);
@@ -140,22 +278,67 @@ class Xspress3 : public ADDriver {
   void adReportError(const char* message);
   bool createMCAArray(size_t dims[2], NDArray *&pMCA, NDDataType_t dataType);
   bool createSCAArray(void *&pSCA);
+  bool createBatchArrays(void *&pSCABatch, void *&pMCABatch, int batchFrames, size_t dims[2]);
   bool readFrame(double* pSCA, double* pMCAData, int frameNumber, int maxSpectra);
   bool readFrame(u_int32_t* pSCA, u_int32_t* pMCAData, int frameNumber, int maxSpectra);
-  void writeOutScas(void *&pSCA, int numChannels, NDDataType_t dataType);
+  bool readFrames(double* pSCA, double* pMCAData, int frameNumber, int numFrames, int firstBin, int numBins);
+  bool readFrames(u_int32_t* pSCA, u_int32_t* pMCAData, int frameNumber, int numFrames, int firstBin, int numBins);
+  bool readFrameZeroCopy(u_int32_t* pSCA, NDArray *&pMCA, int frameNumber, size_t dims[2]);
+  void ackFrames(int frameNumber, int numFrames);
+  const xsp3Deadtime &calculateDeadtime(const void *pSCA, int numChannels, NDDataType_t dataType, int numFrames);
+  void storeScas(const void *pSCA, const double *pDTPercent, const double *pDTFactor, int numChannels, NDDataType_t dataType, int frameNumber);
+  bool writeOutScas();
+  void sumRois(NDArray *pMCA);
+  NDArray *roiArray(NDArray *pMCA);
+  void accumulate(NDArray *pMCA, int frameNumber);
+  void publishAccumulated();
+  void exportScalerArrays(bool force);
+  void streamScas(const xsp3FrameResults &results);
+  void flushScaStream();
   void setStartingParameters();
+  const xsp3AcqConfig &snapshotAcqConfig();
+  const xsp3AcqConfig &unstageAcqConfig();
+  const xsp3AcqConfig &getAcqConfig() { return this->acqConfig_; }
   const NDDataType_t getDataType();
+  const NDDataType_t getReadDataType();
+  bool convertFrame(u_int32_t *pRawMCA, u_int32_t *pSCA, NDArray *pMCA, int numChannels, int maxSpectra);
   void getDims(size_t (&dims)[2]);
+  bool getEnergyWindow(int &firstBin, int &numBins, int &rebin);
+  void getChannelMap(std::vector<int> &chanMap);
+  bool setChannelMap();
   asynStatus checkHistBusy(int checkTimes);
   const int getXsp3Handle() { return this->xsp3_handle_; }
+  const int isCircBuffer() { return this->circBuffer_; }
   xsp3Api *getXsp3() { return this->xsp3; }
   void setNDArrayAttributes(NDArray *&pMCA, int frameNumber);
   void setAcqStopParameters(bool aborted);
   int getNumFramesToAcquire();
+  int getBatchSize();
   int getMaxNumFrames();
   int getFrameCounter();
   void doNDCallbacksIfRequired(NDArray *pMCA);
+  void doNDCallbacksIfRequired(NDArray *pMCA, bool arrayCallbacks);
   int getNumFramesRead();
+  int getPushReadout();
+  bool getZeroCopy();
+  bool queueFrame(NDArray *pMCA, void *pSCA, const double *pDTPercent, const double *pDTFactor, int numChannels, NDDataType_t dataType, int frameNumber);
+  void queueEndOfAcquisition(bool aborted);
+  void receiveFrame(xsp3QueuedFrame &frame);
+  void publishDone();
+  void setQueueUsed();
+  void waitForResults();
+  void publishResults();
+  double getParamUpdatePeriod();
+  xsp3StageTimes &getStageTimes() { return this->stageTimes_; }
+  void updateStageTimes(bool roll);
+  void updateReadoutStatus(int acquired, int frameNumber, size_t frameBytes, bool force);
+  void callChannelParamCallbacks(int numChannels);
+  void setSimFaults();
+  void updateSimCircStatus();
+  bool enablePushReadout();
+  void disablePushReadout();
+  int waitForFrames(double timeout);
+  void newFrame(int chan, int64_t tf);
   void xspAsynPrint(int asynPrintType, const char *format, ...);
 
  private:
@@ -180,6 +363,16 @@ class Xspress3 : public ADDriver {
   asynStatus setTriggerMode(int mode, int invert_f0, int invert_veto, int debounce );
   void createInitialParameters();
   bool setInitialParameters(int maxFrames, int maxDriverFrames, int numCards, int maxSpectra);
+  bool createPublishQueue();
+  bool createFrameResults();
+  bool hasScaAttributes();
+  int findRoiParam(int function, const int (&params)[XSP3_MAX_NUM_ROI]);
+  int findScalerArrayParam(int function);
+  void setRoiLimits();
+  int getNumRoiBins(const std::vector<int> &chanMap);
+  void setupRoiReadout();
+  bool setHardwareRois(const std::vector<int> &chanMap, int numRoiBins);
+  void clearHardwareRois();
 
   //Put private static data members here
   static const epicsInt32 ctrlDisable_;
@@ -189,6 +382,21 @@ class Xspress3 : public ADDriver {
   static const epicsInt32 maxNumRoi_;
   static const epicsInt32 maxStringSize_;
   static const epicsInt32 maxCheckHistPolls_;
+  static const epicsInt32 maxBatchFrames_;
+  static const epicsInt32 maxQueueDepth_;
+  static const double queueWaitTimeout_;
+  static const epicsInt32 dtcModeAPI_;
+  static const epicsInt32 dtcModeDriverFloat64_;
+  static const epicsInt32 dtcModeDriverFloat32_;
+  static const epicsInt32 rawDataTypeUInt32_;
+  static const epicsInt32 rawDataTypeUInt16_;
+  static const epicsInt32 maxRebin_;
+  static const epicsInt32 roiReadoutOff_;
+  static const epicsInt32 roiReadoutHardware_;
+  static const epicsInt32 roiReadoutSoftware_;
+  static const epicsInt32 fullSpectraBits_;
+  static const epicsInt32 accumulateAddr_;
+  static const epicsInt32 scaStreamAddr_;
   static const epicsInt32 mbboTriggerFIXED_;
   static const epicsInt32 mbboTriggerINTERNAL_;
   static const epicsInt32 mbboTriggerIDC_;
@@ -203,6 +411,7 @@ class Xspress3 : public ADDriver {
   int xsp3_handle_;
 
   xsp3Api* xsp3;
+  xsp3Simulator* simulator_; //The same object as xsp3 in simulation mode, otherwise NULL
 
   //Constructor parameters.
   const epicsUInt32 debug_; //debug parameter for API
@@ -214,6 +423,52 @@ class Xspress3 : public ADDriver {
   epicsEventId statusEvent_;
   epicsEventId startEvent_;
   epicsEventId stopEvent_;
+  epicsEventId frameEvent_;
+  std::vector<int> chanFrames_; //Frames completed on each channel, updated from the API new frame callbacks
+  xsp3Deadtime deadtime_; //Event widths and dead time calculation for all channels
+  xsp3StageTimes stageTimes_; //How long each stage of the frame readout takes
+  epicsUInt64 stageWindowStart_; //xsp3StageTimes::now() when the current window of stage times started
+  epicsUInt64 readoutStart_; //xsp3StageTimes::now() at the start of the acquisition
+  epicsUInt64 readoutUpdate_; //xsp3StageTimes::now() when the readout status was last updated
+  int readoutAcquired_; //Frames acquired at the last readout status update
+  int readoutFrames_; //Frames read out at the last readout status update
+  int peakBacklog_; //The most frames waiting to be read out in this acquisition
+  xsp3ZeroCopyPool *pZeroCopyPool_; //Allocates NDArrays that wrap the API histogram memory
+  int hwRoiBins_; //The ROI bins the hardware has been set up to histogram into, 0 for full spectra
+  epicsMessageQueueId publishQueue_; //Frames waiting for the publish task
+  epicsEventId publishDoneEvent_; //Signalled when the publish task has finished an acquisition
+  epicsEventId queueSpaceEvent_; //Signalled when the publish task takes a frame off the queue
+  char *pSCARing_; //A copy of the SCAs for each queued frame, maxQueueDepth_+1 slots
+  size_t scaSlotBytes_;
+  int scaSlot_; //The next slot to use, only touched by the data task
+  epicsUInt64 dropReported_; //xsp3StageTimes::now() when dropped frames were last logged, only touched by the data task
+  int dropsUnreported_; //Frames dropped since then, only touched by the data task
+  std::vector<int> chanMap_; //The detector channel of each row of the MCA, fixed for an acquisition
+  std::vector<std::pair<int, int> > chanRuns_; //The [first channel, number of channels] of each contiguous block of chanMap_
+  std::string chanMapString_; //chanMap_ as a comma separated list, for the CHANNEL_MAP attribute
+  xsp3AcqConfig acqConfig_; //Fixed for an acquisition, only written by the data task while the publish task is idle
+  xsp3Deadtime acqDeadtime_; //The settings of deadtime_ for the data task, taken with acqConfig_
+  xsp3Roi roi_; //The MCA ROI limits of the acquisition, and the sums of the frame being published
+  std::vector<std::string> roiAttrNames_; //The NDAttribute name of each ROI of roi_, [channel][XSP3_MAX_NUM_ROI]
+  std::vector<double> accumSum_; //The accumulated spectra, [channel][bin], only touched by the publish task
+  size_t accumDims_[2]; //The dims of accumSum_, as those of the MCA NDArrays added to it
+  int accumFrames_; //The number of frames in accumSum_
+  int accumPublished_; //accumFrames_ when accumSum_ was last published
+  int accumLastFrame_; //The number of the last frame added to accumSum_
+  int accumReset_; //Set to ask the publish task to clear accumSum_ before it adds the next frame
+  xsp3ScalerStore scalerStore_; //The scalers of every frame of the acquisition, filled by the publish task
+  epicsUInt64 scalerArraysUpdate_; //xsp3StageTimes::now() when the scaler waveforms were last published
+  NDArray *pScaStream_; //The NDArray of SCAs being filled by the publish task, NULL between batches
+  int scaStreamFilled_; //The number of frames in pScaStream_
+  xsp3FrameResults results_[2]; //The publish task fills one while the other holds the latest frame
+  int resultsFront_; //The one of results_ that holds the latest frame
+  bool resultsFresh_; //results_[resultsFront_] has not been written out yet
+  epicsMutexId resultsLock_; //Protects resultsFront_ and resultsFresh_, only held for a swap or a copy
+  epicsEventId resultsEvent_; //Signalled when there is something new for the parameter update task
+  xsp3FrameResults resultsOut_; //The frame being written to the parameter library, protected by the driver lock
+  int framesAcquired_; //For xsp3FrameCountParam, set by the data task without the driver lock
+  int framesRead_; //For NDArrayCounter, set by the data task without the driver lock
+  int droppedFrames_; //For xsp3DroppedFramesParam, set by the data task without the driver lock
 
   //Values used for pasynUser->reason, and indexes into the parameter library.
   int xsp3FirstParam;
@@ -267,9 +522,64 @@ class Xspress3 : public ADDriver {
   int xsp3EventWidthParam;
   int xsp3ChanDTPercentParam;
   int xsp3ChanDTFactorParam;
+  int xsp3ChanRoiLlmParam[XSP3_MAX_NUM_ROI];
+  int xsp3ChanRoiHlmParam[XSP3_MAX_NUM_ROI];
+  int xsp3ChanRoiValueParam[XSP3_MAX_NUM_ROI];
   int xsp3PulsePerTriggerParam;
   int xsp3ITFGStartParam;
   int xsp3ITFGStopParam;
+  int xsp3BatchReadoutParam;
+  int xsp3PushReadoutParam;
+  int xsp3ZeroCopyParam;
+  int xsp3RoiReadoutParam;
+  int xsp3RoiReadoutModeParam;
+  int xsp3AccumulateParam;
+  int xsp3AccumulatePeriodParam;
+  int xsp3AccumulateResetParam;
+  int xsp3AccumulatedFramesParam;
+  int xsp3ScalerArraysParam;
+  int xsp3ScalerArraysPeriodParam;
+  int xsp3ScalerArraysUpdateParam;
+  int xsp3ScalerArraysFramesParam;
+  int xsp3ScaStreamParam;
+  int xsp3ScaStreamFramesParam;
+  int xsp3ChanScalerArrayParam[XSP3_NUM_SCALER_ARRAYS];
+  int xsp3QueueDepthParam;
+  int xsp3QueueUsedParam;
+  int xsp3DroppedFramesParam;
+  int xsp3QueueDropParam;
+  int xsp3BacklogParam;
+  int xsp3PeakBacklogParam;
+  int xsp3TimeToOverflowParam;
+  int xsp3FrameRateParam;
+  int xsp3ReadRateParam;
+  int xsp3ReadRateAvgParam;
+  int xsp3ReadMBRateParam;
+  int xsp3ReadMBRateAvgParam;
+  int xsp3ParamUpdatePeriodParam;
+  int xsp3StageWindowParam;
+  int xsp3StageMinParam;
+  int xsp3StageMeanParam;
+  int xsp3StageP99Param;
+  int xsp3StageMaxParam;
+  int xsp3DtcModeParam;
+  int xsp3RawDataTypeParam;
+  int xsp3EnergyStartParam;
+  int xsp3EnergyBinsParam;
+  int xsp3RebinParam;
+  int xsp3ChanEnableParam;
+  int xsp3ChanSimRateParam;
+  int xsp3SimThreadsParam;
+  int xsp3SimRingFramesParam;
+  int xsp3SimBusyTimeParam;
+  int xsp3SimDelayRateParam;
+  int xsp3SimDelayTimeParam;
+  int xsp3SimBurstFramesParam;
+  int xsp3SimDropRateParam;
+  int xsp3SimErrorRateParam;
+  int xsp3SimCircLagParam;
+  int xsp3SimCircMaxLagParam;
+  int xsp3SimCircOverrunsParam;
   int xsp3LastParam;
   #define XSP3_LAST_DRIVER_COMMAND xsp3LastParam
 };
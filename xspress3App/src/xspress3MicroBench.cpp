@@ -0,0 +1,361 @@
+/**
+ * Author: Diamond Light Source, Copyright 2014
+ *
+ * License: This file is part of 'xspress3'
+ *
+ * 'xspress3' is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * 'xspress3' is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with 'xspress3'.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @brief Micro-benchmarks of the per-frame stages of the Xspress3 driver.
+ *
+ * Each benchmark times one stage of the readout of a frame on its own, for
+ * every combination of the channel counts and spectrum lengths asked for.
+ * The number of iterations is increased until a run takes at least the
+ * minimum time, and the time per iteration (one frame of every channel) is
+ * reported. Unlike xspress3Bench this says which stage got slower.
+ *
+ * The readFrame benchmarks read the same frame each time, so the simulator
+ * serves it from its cache and the time is the driver and copying cost.
+ * The generator benchmarks make a new frame each time.
+ *
+ * Usage: xspress3MicroBench [-c channels] [-s spectra] [-f filter] [-m min time]
+ * where channels and spectra are comma separated lists and only the
+ * benchmarks whose name contains filter are run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+
+#include <epicsTime.h>
+#include <dbAccess.h>
+
+#include "xspress3Epics.h"
+#include "xsp3SimElement.h"
+
+/**
+ * Everything the benchmarks of one channel count and spectrum length use,
+ * set up before any of them are timed.
+ */
+struct microBenchFixture
+{
+    Xspress3 *pXsp;
+    int numChannels;
+    int maxSpectra;
+    size_t dims[2];
+    std::vector<u_int32_t> scaUInt32;
+    std::vector<double> scaDouble;
+    std::vector<u_int32_t> mcaUInt32;
+    std::vector<double> mcaDouble;
+    NDArray *pMCA;
+    xsp3Roi *pRoi;
+    std::vector<double> accumSum;
+    std::vector<xsp3SimElement> sineElements;
+    std::vector<xsp3SimElement> rateElements;
+    std::vector<uint32_t> scalers;
+};
+
+typedef void (*microBenchFunc)(microBenchFixture &fixture, long iterations);
+
+struct microBenchCase
+{
+    const char *name;
+    microBenchFunc run;
+};
+
+static void benchStoreScasUInt32(microBenchFixture &fixture, long iterations)
+{
+    for (long i=0; i<iterations; i++) {
+        fixture.pXsp->storeScas(&fixture.scaUInt32[0], fixture.numChannels, NDUInt32, static_cast<int>(i));
+    }
+}
+
+static void benchStoreScasDouble(microBenchFixture &fixture, long iterations)
+{
+    for (long i=0; i<iterations; i++) {
+        fixture.pXsp->storeScas(&fixture.scaDouble[0], fixture.numChannels, NDFloat64, static_cast<int>(i));
+    }
+}
+
+// writeOutScas only writes a frame once, so each iteration stores one as well
+static void benchWriteOutScas(microBenchFixture &fixture, long iterations)
+{
+    fixture.pXsp->lock();
+    for (long i=0; i<iterations; i++) {
+        fixture.pXsp->storeScas(&fixture.scaUInt32[0], fixture.numChannels, NDUInt32, static_cast<int>(i));
+        fixture.pXsp->writeOutScas();
+    }
+    fixture.pXsp->unlock();
+}
+
+static void benchReadFrameUInt32(microBenchFixture &fixture, long iterations)
+{
+    for (long i=0; i<iterations; i++) {
+        fixture.pXsp->readFrame(&fixture.scaUInt32[0], &fixture.mcaUInt32[0], 1, fixture.maxSpectra);
+    }
+}
+
+static void benchReadFrameDouble(microBenchFixture &fixture, long iterations)
+{
+    for (long i=0; i<iterations; i++) {
+        fixture.pXsp->readFrame(&fixture.scaDouble[0], &fixture.mcaDouble[0], 1, fixture.maxSpectra);
+    }
+}
+
+static void benchSetNDArrayAttributes(microBenchFixture &fixture, long iterations)
+{
+    fixture.pXsp->lock();
+    for (long i=0; i<iterations; i++) {
+        fixture.pXsp->setNDArrayAttributes(fixture.pMCA, static_cast<int>(i));
+    }
+    fixture.pXsp->unlock();
+}
+
+static void benchRoiCalculate(microBenchFixture &fixture, long iterations)
+{
+    for (long i=0; i<iterations; i++) {
+        fixture.pRoi->calculate(&fixture.mcaUInt32[0], fixture.numChannels, fixture.maxSpectra);
+    }
+}
+
+static void benchAccumulate(microBenchFixture &fixture, long iterations)
+{
+    for (long i=0; i<iterations; i++) {
+        xsp3Spectrum::accumulate(&fixture.mcaUInt32[0], fixture.numChannels * fixture.maxSpectra, &fixture.accumSum[0]);
+    }
+}
+
+static void benchCreateMCAArrayUInt32(microBenchFixture &fixture, long iterations)
+{
+    NDArray *pMCA;
+    for (long i=0; i<iterations; i++) {
+        if (!fixture.pXsp->createMCAArray(fixture.dims, pMCA, NDUInt32)) {
+            pMCA->release();
+        }
+    }
+}
+
+static void benchCreateMCAArrayDouble(microBenchFixture &fixture, long iterations)
+{
+    NDArray *pMCA;
+    for (long i=0; i<iterations; i++) {
+        if (!fixture.pXsp->createMCAArray(fixture.dims, pMCA, NDFloat64)) {
+            pMCA->release();
+        }
+    }
+}
+
+static void benchGenerateRawSpectra(std::vector<xsp3SimElement> &elements, microBenchFixture &fixture, long iterations)
+{
+    static int frame = 0;
+    for (long i=0; i<iterations; i++, frame++) {
+        for (int chan=0; chan<fixture.numChannels; chan++) {
+            elements[chan].generateRawSpectra(frame, 0, fixture.maxSpectra, &fixture.mcaUInt32[chan*fixture.maxSpectra]);
+        }
+    }
+}
+
+static void benchGenerateRawSpectraSine(microBenchFixture &fixture, long iterations)
+{
+    benchGenerateRawSpectra(fixture.sineElements, fixture, iterations);
+}
+
+static void benchGenerateRawSpectraRate(microBenchFixture &fixture, long iterations)
+{
+    benchGenerateRawSpectra(fixture.rateElements, fixture, iterations);
+}
+
+static void benchGenerateDTCSpectraRate(microBenchFixture &fixture, long iterations)
+{
+    static int frame = 0;
+    for (long i=0; i<iterations; i++, frame++) {
+        for (int chan=0; chan<fixture.numChannels; chan++) {
+            fixture.rateElements[chan].generateDTCSpectra(frame, 0, fixture.maxSpectra, &fixture.mcaDouble[chan*fixture.maxSpectra]);
+        }
+    }
+}
+
+static void benchGenerateScalersRate(microBenchFixture &fixture, long iterations)
+{
+    static int frame = 0;
+    for (long i=0; i<iterations; i++, frame++) {
+        for (int chan=0; chan<fixture.numChannels; chan++) {
+            fixture.rateElements[chan].generateScalers(frame, &fixture.scalers[chan*XSP3_SW_NUM_SCALERS]);
+        }
+    }
+}
+
+static const microBenchCase microBenchCases[] = {
+    {"storeScas/uint32",           benchStoreScasUInt32},
+    {"storeScas/double",           benchStoreScasDouble},
+    {"writeOutScas",               benchWriteOutScas},
+    {"readFrame/uint32",           benchReadFrameUInt32},
+    {"readFrame/double",           benchReadFrameDouble},
+    {"setNDArrayAttributes",       benchSetNDArrayAttributes},
+    {"xsp3Roi/uint32",             benchRoiCalculate},
+    {"accumulate/uint32",          benchAccumulate},
+    {"createMCAArray/uint32",      benchCreateMCAArrayUInt32},
+    {"createMCAArray/double",      benchCreateMCAArrayDouble},
+    {"generateRawSpectra/sine",    benchGenerateRawSpectraSine},
+    {"generateRawSpectra/rate",    benchGenerateRawSpectraRate},
+    {"generateDTCSpectra/rate",    benchGenerateDTCSpectraRate},
+    {"generateScalers/rate",       benchGenerateScalersRate},
+};
+
+/**
+ * Split a comma separated list of integers
+ */
+static std::vector<int> microBenchParseList(const char *list)
+{
+    std::vector<int> values;
+    std::string str(list);
+    size_t pos = 0;
+    while (pos <= str.size()) {
+        size_t comma = str.find(',', pos);
+        if (comma == std::string::npos) comma = str.size();
+        if (comma > pos) values.push_back(atoi(str.substr(pos, comma - pos).c_str()));
+        pos = comma + 1;
+    }
+    return values;
+}
+
+/**
+ * Create the driver and buffers for a channel count and spectrum length.
+ * Each needs its own driver, and asyn port, because ports cannot be deleted.
+ */
+static void microBenchSetup(microBenchFixture &fixture, int numChannels, int maxSpectra)
+{
+    static int port = 0;
+    char portName[32];
+    const size_t mcaSize = static_cast<size_t>(numChannels) * maxSpectra;
+
+    epicsSnprintf(portName, sizeof(portName), "MICROBENCH%d", ++port);
+    fixture.pXsp = new Xspress3(portName, numChannels, 1, "127.0.0.1", 1000, 1000, maxSpectra, -1, 0, 0, 1, 0);
+    fixture.numChannels = numChannels;
+    fixture.maxSpectra = maxSpectra;
+    fixture.dims[0] = maxSpectra;
+    fixture.dims[1] = numChannels;
+    fixture.scaUInt32.assign(numChannels * XSP3_SW_NUM_SCALERS, 0);
+    fixture.scaDouble.assign(numChannels * XSP3_SW_NUM_SCALERS, 0.0);
+    fixture.mcaUInt32.assign(mcaSize, 0);
+    fixture.mcaDouble.assign(mcaSize, 0.0);
+    fixture.accumSum.assign(mcaSize, 0.0);
+    fixture.scalers.assign(numChannels * XSP3_SW_NUM_SCALERS, 0);
+    fixture.pMCA = NULL;
+    fixture.pXsp->createMCAArray(fixture.dims, fixture.pMCA, NDUInt32);
+    // Real SCAs, so storeScas does the dead time calculation
+    fixture.pXsp->lock();
+    fixture.pXsp->snapshotAcqConfig();
+    fixture.pXsp->unlock();
+    fixture.pXsp->readFrame(&fixture.scaUInt32[0], &fixture.mcaUInt32[0], 1, maxSpectra);
+    fixture.pXsp->readFrame(&fixture.scaDouble[0], &fixture.mcaDouble[0], 1, maxSpectra);
+    // Every ROI defined, spread over the spectrum
+    fixture.pRoi = new xsp3Roi(numChannels, XSP3_MAX_NUM_ROI);
+    for (int chan=0; chan<numChannels; chan++) {
+        for (int roi=0; roi<XSP3_MAX_NUM_ROI; roi++) {
+            fixture.pRoi->setLimits(chan, roi, roi * maxSpectra / (2 * XSP3_MAX_NUM_ROI), maxSpectra / 2 + roi * maxSpectra / (2 * XSP3_MAX_NUM_ROI));
+        }
+    }
+    fixture.pRoi->setWindow(0, maxSpectra, 1);
+    for (int chan=0; chan<numChannels; chan++) {
+        fixture.sineElements.push_back(xsp3SimElement(maxSpectra));
+        fixture.rateElements.push_back(xsp3SimElement(maxSpectra));
+        fixture.rateElements.back().setFrameTime(1e-3);
+        fixture.rateElements.back().setCountRate(1e5);
+    }
+}
+
+/**
+ * Time a benchmark, increasing the iterations until it runs for minTime
+ *
+ * @return The time per iteration in seconds
+ */
+static double microBenchTime(const microBenchCase &bench, microBenchFixture &fixture, double minTime, long &iterations)
+{
+    double elapsed = 0.0;
+    iterations = 1;
+    while (1) {
+        epicsTime start = epicsTime::getCurrent();
+        bench.run(fixture, iterations);
+        elapsed = epicsTime::getCurrent() - start;
+        if ((elapsed >= minTime) || (iterations >= 1000000000L)) break;
+        if (elapsed < minTime/10) {
+            iterations *= 10;
+        } else {
+            iterations = static_cast<long>(iterations * 1.2 * minTime / elapsed) + 1;
+        }
+    }
+    return elapsed / iterations;
+}
+
+static void microBenchUsage()
+{
+    fprintf(stderr, "Usage: xspress3MicroBench [-c channels] [-s spectra] [-f filter] [-m min time]\n"
+                    "  -c  Comma separated numbers of channels (default 1,4,8)\n"
+                    "  -s  Comma separated numbers of spectral bins, maxSpectra (default 1024,4096)\n"
+                    "  -f  Only run the benchmarks whose name contains this\n"
+                    "  -m  Minimum time to run each benchmark for in seconds (default 0.5)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<int> channels, spectra;
+    const char *filter = "";
+    double minTime = 0.5;
+    int opt;
+
+    channels.push_back(1); channels.push_back(4); channels.push_back(8);
+    spectra.push_back(1024); spectra.push_back(4096);
+    while ((opt = getopt(argc, argv, "c:s:f:m:h")) != -1) {
+        switch (opt) {
+        case 'c': channels = microBenchParseList(optarg); break;
+        case 's': spectra = microBenchParseList(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'm': minTime = atof(optarg); break;
+        default:
+            microBenchUsage();
+            return 1;
+        }
+    }
+    if (channels.empty() || spectra.empty()) {
+        microBenchUsage();
+        return 1;
+    }
+
+    // There is no IOC database, so let the driver callbacks through
+    interruptAccept = 1;
+
+    printf("%-26s %8s %8s %12s %12s %12s\n", "benchmark", "channels", "spectra", "iterations", "us/frame", "frames/s");
+    for (size_t c=0; c<channels.size(); c++) {
+        for (size_t s=0; s<spectra.size(); s++) {
+            microBenchFixture fixture;
+            microBenchSetup(fixture, channels[c], spectra[s]);
+            for (size_t b=0; b<sizeof(microBenchCases)/sizeof(microBenchCases[0]); b++) {
+                long iterations;
+                double perFrame;
+                if (strstr(microBenchCases[b].name, filter) == NULL) continue;
+                perFrame = microBenchTime(microBenchCases[b], fixture, minTime, iterations);
+                printf("%-26s %8d %8d %12ld %12.3f %12.0f\n", microBenchCases[b].name, channels[c], spectra[s],
+                       iterations, perFrame*1e6, perFrame > 0.0 ? 1.0/perFrame : 0.0);
+                fflush(stdout);
+            }
+            if (fixture.pMCA != NULL) fixture.pMCA->release();
+        }
+    }
+    return 0;
+}